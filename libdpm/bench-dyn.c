@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2008 Marius Vollmer <marius.vollmer@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/.
+ */
+
+/* Microbenchmarks for the dynamic extents of dyn.
+
+   bench-dyn [ROUNDS]
+
+   Times empty dyn_blocks, dyn_blocks with a dyn_let and a
+   dyn_on_unwind in them, allocating and dropping a string, and a
+   dyn_catch with and without a dyn_throw.  Each is run ROUNDS times
+   and reported in nanoseconds per round.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dyn.h"
+
+static double
+now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static dyn_var var[1];
+static int counter;
+
+static void
+count (int for_throw, void *data)
+{
+  counter++;
+}
+
+static void
+no_throw (dyn_target *target, void *data)
+{
+  counter++;
+}
+
+static void
+do_throw (dyn_target *target, void *data)
+{
+  dyn_throw (target, NULL);
+}
+
+static void
+report (const char *name, int rounds, double secs)
+{
+  printf ("%-12s %6.1f ns\n", name, secs / rounds * 1e9);
+}
+
+int
+main (int argc, char **argv)
+{
+  int rounds = argc > 1? atoi (argv[1]) : 10000000;
+  double start;
+
+  start = now ();
+  for (int i = 0; i < rounds; i++)
+    dyn_block
+      ;
+  report ("block", rounds, now () - start);
+
+  start = now ();
+  for (int i = 0; i < rounds; i++)
+    dyn_block
+      {
+	dyn_let (var, NULL);
+	dyn_on_unwind (count, NULL);
+      }
+  report ("let+unwind", rounds, now () - start);
+
+  start = now ();
+  for (int i = 0; i < rounds; i++)
+    dyn_block
+      dyn_from_string ("foo");
+  report ("alloc", rounds, now () - start);
+
+  start = now ();
+  for (int i = 0; i < rounds; i++)
+    dyn_block
+      dyn_catch (no_throw, NULL);
+  report ("catch", rounds, now () - start);
+
+  start = now ();
+  for (int i = 0; i < rounds; i++)
+    dyn_block
+      dyn_catch (do_throw, NULL);
+  report ("catch+throw", rounds, now () - start);
+
+  return 0;
+}
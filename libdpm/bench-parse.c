@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2008 Marius Vollmer <marius.vollmer@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/.
+ */
+
+/* Parsing throughput.
+
+   bench-parse FILE [ROUNDS]
+
+   Parses the Packages file FILE ROUNDS times from memory, the same
+   way that dpm_db_origin_update does: every stanza is split into its
+   control fields, and the fields with relations are split into their
+   alternatives.  Nothing is stored.  The throughput is reported in
+   MB/s, once with line counting and once without.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dpm.h"
+
+static double
+now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool
+relation_field_p (const char *name, int len)
+{
+  static const char *fields[] = {
+    "Pre-Depends", "Depends", "Conflicts", "Provides", "Replaces",
+    "Breaks", "Recommends", "Enhances", "Suggests", NULL
+  };
+
+  for (int i = 0; fields[i]; i++)
+    if (strlen (fields[i]) == len && strncmp (fields[i], name, len) == 0)
+      return true;
+  return false;
+}
+
+static int
+parse (const char *buf, int len, bool count_lines)
+{
+  int n_alternatives = 0;
+
+  dyn_block
+    {
+      dyn_input in = dyn_open_string (buf, len);
+      if (count_lines)
+	dyn_input_count_lines (in);
+
+      while (dpm_parse_looking_at_control (in))
+	dyn_foreach_iter (f, dpm_parse_control_fields, in)
+	  if (relation_field_p (f.name, f.name_len))
+	    dyn_block
+	      {
+		dyn_input rin = dyn_open_string (f.value, f.value_len);
+		do {
+		  dyn_foreach_iter (alt, dpm_parse_relation_alternatives, rin)
+		    n_alternatives++;
+		} while (dpm_parse_next_relation (rin));
+	      }
+    }
+
+  return n_alternatives;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc != 2 && argc != 3)
+    {
+      fprintf (stderr, "Usage: bench-parse FILE [ROUNDS]\n");
+      exit (1);
+    }
+
+  int rounds = argc == 3? atoi (argv[2]) : 10;
+
+  FILE *f = fopen (argv[1], "r");
+  if (f == NULL)
+    dyn_error ("Can't open %s: %m", argv[1]);
+  char *buf = NULL;
+  size_t len = 0;
+  int capacity = 0;
+  size_t n;
+  do {
+    buf = dyn_mgrow (buf, &capacity, 1, len + 65536);
+    n = fread (buf + len, 1, capacity - len, f);
+    len += n;
+  } while (n > 0);
+  fclose (f);
+
+  for (int count_lines = 0; count_lines < 2; count_lines++)
+    {
+      int n_alternatives = 0;
+      double start = now ();
+      for (int r = 0; r < rounds; r++)
+	n_alternatives = parse (buf, len, count_lines);
+      double secs = now () - start;
+
+      printf ("%s: %d alternatives, %.1f MB/s\n",
+	      count_lines? "counting lines" : "plain",
+	      n_alternatives, len * (double)rounds / secs / 1e6);
+    }
+
+  free (buf);
+  return 0;
+}
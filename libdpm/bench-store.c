@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2008 Marius Vollmer <marius.vollmer@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/.
+ */
+
+/* Microbenchmarks for the struct-store.
+
+   bench-store intern STORE FILE [ROUNDS]
+
+   Interns every line of FILE into a table, ROUNDS times, once for a
+   store of format version 2 and once for version 3.  The first round
+   adds the lines, the others find them.  This is dominated by hashing
+   the lines.  The memory management of the unstored trie nodes is
+   reported as well.
+
+   bench-store commit STORE [ROUNDS]
+
+   Commits ROUNDS new roots, each with a couple of new objects, once
+   for a store of format version 4 and once for version 5.  Version 4
+   syncs the new objects and the header separately, version 5 syncs
+   them together.  STORE should be on a real disk.
+
+   bench-store layout DB
+
+   Counts how many pages are touched when showing each package in the
+   Dpm database DB, and when only looking at the relations of its
+   versions.  The pages touched for the relations of all packages
+   together are counted as well.  DB is counted twice: after a full
+   collection that lays out objects breadth-first, like the collector
+   used to, and after a normal one.  This measures how well the
+   collector keeps related objects together.
+
+   bench-store gc STORE [DICTS ENTRIES]
+
+   Collects STORE nine times in each of three ways and reports the
+   fastest run: rehashing dictionaries by inserting their entries one
+   by one, like the collector used to, rebuilding them in one thread,
+   and rebuilding them with as many threads as there are processors.
+   With DICTS and ENTRIES, STORE is first filled with DICTS
+   dictionaries of ENTRIES entries each.  Otherwise it is collected as
+   it is, and can be a Dpm database, for example.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "dpm.h"
+
+void
+usage ()
+{
+  fprintf (stderr, "Usage: bench-store intern STORE FILE [ROUNDS]\n");
+  fprintf (stderr, "       bench-store commit STORE [ROUNDS]\n");
+  fprintf (stderr, "       bench-store layout DB\n");
+  fprintf (stderr, "       bench-store gc STORE [DICTS ENTRIES]\n");
+  exit (1);
+}
+
+static double
+now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Create an empty STORE of format VERSION, which is 2, 3, or 4.  Its
+   header has two slots of 21 words, all zero except for the checksum.
+ */
+static void
+create_store (const char *store, int version)
+{
+  uint32_t head[2 + 2*21] = { 0x42445453, version };
+  head[2+20] = head[2+21+20] = crc32 (0, (void *)(head + 2),
+				      20 * sizeof (uint32_t));
+
+  int fd = open (store, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0 || write (fd, head, sizeof (head)) != sizeof (head))
+    dyn_error ("Can't write %s: %m", store);
+  close (fd);
+}
+
+void
+bench_intern (const char *store, const char *file, int rounds)
+{
+  FILE *f = fopen (file, "r");
+  if (f == NULL)
+    dyn_error ("Can't open %s: %m", file);
+
+  char **lines = NULL;
+  int n_lines = 0, capacity = 0;
+  size_t n_bytes = 0;
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t l;
+
+  while ((l = getline (&line, &len, f)) > 0)
+    {
+      if (line[l-1] == '\n')
+	line[--l] = '\0';
+      lines = dyn_mgrow (lines, &capacity, sizeof (char *), n_lines + 1);
+      lines[n_lines++] = strdup (line);
+      n_bytes += l;
+    }
+  free (line);
+  fclose (f);
+
+  for (int version = 2; version <= 3; version++)
+    dyn_block
+      {
+	create_store (store, version);
+
+	ss_store ss = ss_open (store, SS_WRITE);
+	ss_tab *t = ss_tab_init (ss, NULL);
+	ss_unstored_stats before, after;
+
+	ss_get_unstored_stats (&before);
+	double start = now ();
+	for (int r = 0; r < rounds; r++)
+	  for (int i = 0; i < n_lines; i++)
+	    ss_tab_intern_blob (t, strlen (lines[i]), lines[i]);
+	double secs = now () - start;
+	ss_get_unstored_stats (&after);
+
+	ss_tab_abort (t);
+	printf ("version %d: %d lines, %.2f Mlines/s, %.1f MB/s\n",
+		version, n_lines,
+		n_lines * (double)rounds / secs / 1e6,
+		n_bytes * (double)rounds / secs / 1e6);
+	printf ("  %llu mallocs, %llu arena blocks (%llu reused), "
+		"%llu chunks, %llu grown in place\n",
+		(unsigned long long)(after.mallocs - before.mallocs),
+		(unsigned long long)(after.arena_allocs - before.arena_allocs),
+		(unsigned long long)(after.arena_reused - before.arena_reused),
+		(unsigned long long)(after.arena_chunks - before.arena_chunks),
+		(unsigned long long)(after.grown_in_place
+				     - before.grown_in_place));
+      }
+
+  for (int i = 0; i < n_lines; i++)
+    free (lines[i]);
+  free (lines);
+}
+
+void
+bench_commit (const char *store, int rounds)
+{
+  for (int version = 4; version <= 5; version++)
+    dyn_block
+      {
+	if (version < 5)
+	  create_store (store, version);
+	else
+	  ss_open (store, SS_TRUNC);
+
+	ss_store ss = ss_open (store, SS_WRITE);
+
+	double start = now ();
+	for (int r = 0; r < rounds; r++)
+	  ss_set_root (ss, ss_new (ss, 0, 2,
+				   ss_blob_new (ss, 8, "checkpnt"),
+				   ss_get_root (ss)));
+	double secs = now () - start;
+
+	printf ("version %d: %d commits, %.3f ms per commit\n",
+		version, rounds, secs * 1e3 / rounds);
+      }
+}
+
+/* The pages with the objects that are looked at by dpm-tool show, or
+   only those for the relations if SHOW is false.  Only the first page
+   of a blob is counted.  The pages are also added to ALL_PAGES.
+ */
+static uintptr_t *all_pages;
+static int n_all_pages, all_pages_capacity;
+
+static int
+count_package_pages (dpm_package pkg, bool show)
+{
+  uintptr_t pages[1024];
+  int n_pages = 0;
+
+  void touch (void *ptr)
+  {
+    uintptr_t page = (uintptr_t)ptr / 4096;
+    for (int i = 0; i < n_pages; i++)
+      if (pages[i] == page)
+	return;
+    if (n_pages < 1024)
+      pages[n_pages++] = page;
+    all_pages = dyn_mgrow (all_pages, &all_pages_capacity,
+			   sizeof (uintptr_t), n_all_pages + 1);
+    all_pages[n_all_pages++] = page;
+  }
+
+  void walk (ss_val v, int depth)
+  {
+    if (v == NULL || ss_is_int (v))
+      return;
+    touch (v);
+    if (ss_is_blob (v))
+      return;
+    touch ((uint32_t *)v + ss_len (v));
+    if (depth > 0)
+      for (int i = 0; i < ss_len (v); i++)
+	walk (ss_ref (v, i), depth - 1);
+  }
+
+  walk (pkg, 1);
+  dyn_foreach (o, dpm_db_origins)
+    dyn_foreach (v, dpm_db_origin_package_versions, o, pkg)
+      {
+	if (show)
+	  walk (v, 5);
+	else
+	  {
+	    walk (v, 0);
+	    walk (dpm_ver_relations (v), 4);
+	  }
+      }
+
+  return n_pages;
+}
+
+void
+bench_layout (const char *db)
+{
+  dyn_block
+    {
+      dyn_let (dpm_database_name, dyn_from_string (db));
+
+      for (int depth_first = 0; depth_first < 2; depth_first++)
+	{
+	  int n_packages = 0, n_working_set = 0;
+	  uint64_t n_show_pages = 0, n_rel_pages = 0;
+
+	  ss_gc_set_debug (depth_first? 0 : SS_GC_DEBUG_BREADTH_FIRST);
+	  dpm_db_open ();
+	  dpm_db_gc_and_done ();
+	  ss_gc_set_debug (0);
+
+	  dpm_db_open ();
+	  double start = now ();
+	  dyn_foreach (pkg, dpm_db_packages)
+	    n_show_pages += count_package_pages (pkg, true);
+	  n_all_pages = 0;
+	  dyn_foreach (pkg, dpm_db_packages)
+	    {
+	      n_rel_pages += count_package_pages (pkg, false);
+	      n_packages++;
+	    }
+	  double secs = now () - start;
+
+	  int cmp (const void *a, const void *b)
+	  {
+	    uintptr_t x = *(uintptr_t *)a, y = *(uintptr_t *)b;
+	    return x < y? -1 : x > y;
+	  }
+	  qsort (all_pages, n_all_pages, sizeof (uintptr_t), cmp);
+	  for (int i = 0; i < n_all_pages; i++)
+	    if (i == 0 || all_pages[i] != all_pages[i-1])
+	      n_working_set++;
+
+	  if (n_packages == 0)
+	    n_packages = 1;
+	  printf ("%s: %.2f pages per package shown, "
+		  "%.2f for relations, %d for all relations, %.2f s\n",
+		  depth_first? "depth-first  " : "breadth-first",
+		  n_show_pages / (double)n_packages,
+		  n_rel_pages / (double)n_packages, n_working_set, secs);
+
+	  dpm_db_done ();
+	}
+    }
+}
+
+void
+bench_gc (const char *store, int n_dicts, int n_entries)
+{
+  if (n_dicts > 0)
+    dyn_block
+      {
+	ss_store ss = ss_open (store, SS_TRUNC);
+	ss_val dicts[n_dicts];
+
+	for (int i = 0; i < n_dicts; i++)
+	  {
+	    ss_dict *d = ss_dict_init (ss, NULL, SS_DICT_STRONG);
+	    for (int j = 0; j < n_entries; j++)
+	      ss_dict_set (d, ss_new (ss, 0, 1, ss_from_int (j)),
+			   ss_from_int (i));
+	    dicts[i] = ss_dict_finish (d);
+	  }
+	ss_set_root (ss, ss_newv (ss, 0, n_dicts, dicts));
+      }
+
+  int n_procs = sysconf (_SC_NPROCESSORS_ONLN);
+  for (int mode = 0; mode < 3; mode++)
+    {
+      double best = 0;
+      char label[32];
+
+      ss_gc_set_debug (mode == 0? SS_GC_DEBUG_INSERT : 0);
+      ss_gc_set_threads (mode == 1? 1 : 0);
+      for (int r = 0; r < 9; r++)
+	dyn_block
+	  {
+	    ss_store ss = ss_open (store, SS_WRITE);
+	    double start = now ();
+	    ss_gc (ss);
+	    double secs = now () - start;
+	    if (r == 0 || secs < best)
+	      best = secs;
+	  }
+      ss_gc_set_debug (0);
+      ss_gc_set_threads (0);
+
+      if (mode == 0)
+	strcpy (label, "insertion");
+      else
+	sprintf (label, "%d thread%s", mode == 1? 1 : n_procs,
+		 mode == 1 || n_procs == 1? "" : "s");
+      printf ("%-11s: %.3f s\n", label, best);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2)
+    usage ();
+
+  if (strcmp (argv[1], "intern") == 0 && (argc == 4 || argc == 5))
+    bench_intern (argv[2], argv[3], argc == 5? atoi (argv[4]) : 100);
+  else if (strcmp (argv[1], "commit") == 0 && (argc == 3 || argc == 4))
+    bench_commit (argv[2], argc == 4? atoi (argv[3]) : 1000);
+  else if (strcmp (argv[1], "layout") == 0 && argc == 3)
+    bench_layout (argv[2]);
+  else if (strcmp (argv[1], "gc") == 0 && (argc == 3 || argc == 5))
+    bench_gc (argv[2], argc == 5? atoi (argv[3]) : 0,
+	      argc == 5? atoi (argv[4]) : 0);
+  else
+    usage ();
+
+  return 0;
+}
@@ -35,11 +35,12 @@ dyn_var dpm_database_name[1];
    - strings             (string table)
    - packages            (string -> package, weak key)
    - versions            (version table)
-   - status              (package -> status)
+   - status              (package -> status, vector)
    - origin_available    (origin -> (package -> versions, strong), strong)
    - tags                (tag -> versions)
    - reverse_relations   (package -> list of versions, weak sets)
    - provides            (package -> list of versions, weak sets)
+   - names               (list of weak lists of packages, sorted by name)
 
    A package:
 
@@ -105,11 +106,21 @@ struct dpm_db_struct {
   ss_tab *strings;
   ss_dict *packages;
   ss_tab *versions;
-  ss_dict *status;
+  ss_vec *status;
   ss_dict *origin_available;
   ss_dict *tags;
   ss_dict *reverse_rels;
   ss_dict *provides;
+  ss_val names;
+  bool names_missing;    // root from before the name index
+
+  dpm_package *new_packages;
+  int n_new_packages, new_packages_capacity;
+  bool read_only;
+
+  int transaction_depth;
+  dpm_db_savepoint transaction_start;
+  bool relaxed;
 };
 
 static void
@@ -122,7 +133,7 @@ dpm_db_abort (struct dpm_db_struct *db)
   if (db->versions)
     ss_tab_abort (db->versions);
   if (db->status)
-    ss_dict_abort (db->status);
+    ss_vec_abort (db->status);
   if (db->origin_available)
     ss_dict_abort (db->origin_available);
   if (db->tags)
@@ -140,6 +151,12 @@ dpm_db_abort (struct dpm_db_struct *db)
   db->tags = NULL;
   db->reverse_rels = NULL;
   db->provides = NULL;
+  db->names = NULL;
+
+  free (db->new_packages);
+  db->new_packages = NULL;
+  db->n_new_packages = 0;
+  db->new_packages_capacity = 0;
 }
 
 static void
@@ -172,41 +189,50 @@ dpm_db_make (ss_store store)
   db->tags = NULL;
   db->reverse_rels = NULL;
   db->provides = NULL;
+  db->names = NULL;
+  db->names_missing = false;
+  db->new_packages = NULL;
+  db->n_new_packages = 0;
+  db->new_packages_capacity = 0;
+  db->read_only = false;
+  db->transaction_depth = 0;
+  db->transaction_start = NULL;
+  db->relaxed = false;
   return db;
 }
 
 static dyn_var cur_db[1];
 
+static void add_new_package (dpm_db db, dpm_package pkg);
+
 dpm_db
 dpm_db_current ()
 {
   return dyn_get (cur_db);
 }
 
-void
-dpm_db_open ()
+static void
+dpm_db_init (dpm_db db, ss_val root)
 {
-  dyn_val name = dyn_get (dpm_database_name);
-
-  if (name == NULL)
-    dyn_error ("dpm_database_name not set");
-
-  dpm_db db = dpm_db_make (ss_open (name, SS_WRITE));
-  dyn_let (cur_db, db);
-
-  ss_val root = ss_get_root (db->store);
-
-  if (root && !ss_streq (ss_ref_safely (root, 0), "dpm-0"))
-    dyn_error ("%s is not a dpm database", name);
-
   db->strings =
     ss_tab_init (db->store, ss_ref_safely (root, 1));
   db->packages =
     ss_dict_init (db->store, ss_ref_safely (root, 2), SS_DICT_WEAK_KEYS);
   db->versions =
     ss_tab_init (db->store, ss_ref_safely (root, 3));
-  db->status =
-    ss_dict_init (db->store, ss_ref_safely (root, 4), SS_DICT_STRONG);
+  ss_val status = ss_ref_safely (root, 4);
+  if (status && !ss_is (status, SS_VEC_TAG))
+    {
+      /* Databases from before the status vector have a dictionary.
+       */
+      ss_dict *d = ss_dict_init (db->store, status, SS_DICT_STRONG);
+      db->status = ss_vec_init (db->store, NULL);
+      dyn_foreach_iter (e, ss_dict_entries, d)
+	ss_vec_set (db->status, e.key, e.val);
+      ss_dict_abort (d);
+    }
+  else
+    db->status = ss_vec_init (db->store, status);
   db->origin_available =
     ss_dict_init (db->store, ss_ref_safely (root, 5), SS_DICT_STRONG);
   db->tags =
@@ -215,6 +241,69 @@ dpm_db_open ()
     ss_dict_init (db->store, ss_ref_safely (root, 7), SS_DICT_WEAK_SETS);
   db->provides =
     ss_dict_init (db->store, ss_ref_safely (root, 8), SS_DICT_WEAK_SETS);
+  db->names = ss_ref_safely (root, 9);
+  db->names_missing = (root && ss_len (root) < 10);
+}
+
+static void
+dpm_db_open_mode (int mode)
+{
+  dyn_val name = dyn_get (dpm_database_name);
+
+  if (name == NULL)
+    dyn_error ("dpm_database_name not set");
+
+  dpm_db db = dpm_db_make (ss_open (name, mode));
+  db->read_only = (mode == SS_READ);
+  dyn_let (cur_db, db);
+
+  ss_val root = ss_get_root (db->store);
+
+  if (root && !ss_streq (ss_ref_safely (root, 0), "dpm-0"))
+    dyn_error ("%s is not a dpm database", name);
+
+  dpm_db_init (db, root);
+}
+
+void
+dpm_db_open ()
+{
+  dpm_db_open_mode (SS_WRITE);
+}
+
+void
+dpm_db_open_read_only ()
+{
+  dpm_db_open_mode (SS_READ);
+}
+
+static void names_update (dpm_db db);
+
+static ss_val
+dpm_db_store (dpm_db db)
+{
+  names_update (db);
+  return ss_new (db->store, 0, 10,
+		 ss_blob_new (db->store, 5, "dpm-0"),
+		 ss_tab_store (db->strings), 
+		 ss_dict_store (db->packages),
+		 ss_tab_store (db->versions),
+		 ss_vec_store (db->status),
+		 ss_dict_store (db->origin_available),
+		 ss_dict_store (db->tags),
+		 ss_dict_store (db->reverse_rels),
+		 ss_dict_store (db->provides),
+		 db->names);
+}
+
+static void
+dpm_db_commit_now (dpm_db db)
+{
+  ss_val root = dpm_db_store (db);
+  if (db->relaxed)
+    ss_set_root_relaxed (db->store, root);
+  else
+    ss_set_root (db->store, root);
 }
 
 void
@@ -222,17 +311,81 @@ dpm_db_checkpoint ()
 {
   dpm_db db = dyn_get (cur_db);
 
-  ss_val root = ss_new (db->store, 0, 9,
-			ss_blob_new (db->store, 5, "dpm-0"),
-			ss_tab_store (db->strings), 
-			ss_dict_store (db->packages),
-			ss_tab_store (db->versions),
-			ss_dict_store (db->status),
-			ss_dict_store (db->origin_available),
-			ss_dict_store (db->tags),
-			ss_dict_store (db->reverse_rels),
-			ss_dict_store (db->provides));
-  ss_set_root (db->store, root);
+  if (db->transaction_depth == 0)
+    dpm_db_commit_now (db);
+}
+
+/* Transactions
+ */
+
+dpm_db_savepoint
+dpm_db_save ()
+{
+  dpm_db db = dyn_get (cur_db);
+  return dpm_db_store (db);
+}
+
+void
+dpm_db_rollback_to (dpm_db_savepoint sp)
+{
+  dpm_db db = dyn_get (cur_db);
+
+  dpm_db_abort (db);
+  dpm_db_init (db, sp);
+}
+
+void
+dpm_db_begin ()
+{
+  dpm_db db = dyn_get (cur_db);
+
+  if (db->transaction_depth++ == 0)
+    db->transaction_start = dpm_db_save ();
+}
+
+void
+dpm_db_commit ()
+{
+  dpm_db db = dyn_get (cur_db);
+
+  if (db->transaction_depth == 0)
+    dyn_error ("No transaction to commit");
+
+  if (--db->transaction_depth == 0)
+    {
+      db->transaction_start = NULL;
+      dpm_db_commit_now (db);
+    }
+}
+
+void
+dpm_db_rollback ()
+{
+  dpm_db db = dyn_get (cur_db);
+
+  if (db->transaction_depth == 0)
+    dyn_error ("No transaction to roll back");
+
+  dpm_db_rollback_to (db->transaction_start);
+  db->transaction_depth = 0;
+  db->transaction_start = NULL;
+}
+
+void
+dpm_db_set_relaxed (bool relaxed)
+{
+  dpm_db db = dyn_get (cur_db);
+
+  db->relaxed = relaxed;
+  if (!relaxed)
+    ss_flush (db->store);
+}
+
+void
+dpm_db_sync ()
+{
+  dpm_db db = dyn_get (cur_db);
+  ss_flush (db->store);
 }
 
 void
@@ -241,7 +394,8 @@ dpm_db_done ()
   dpm_db db = dyn_get (cur_db);
 
   dpm_db_abort (db);
-  ss_maybe_gc (db->store);
+  ss_flush (db->store);
+  ss_maybe_gc_deferred (db->store);
   dyn_unref (db->store);
   db->store = NULL;
 
@@ -254,6 +408,7 @@ dpm_db_gc_and_done ()
   dpm_db db = dyn_get (cur_db);
 
   dpm_db_abort (db);
+  ss_flush (db->store);
   ss_gc (db->store);
   dyn_unref (db->store);
   db->store = NULL;
@@ -305,18 +460,24 @@ intern (dpm_db db, const char *string)
 /* Packages
  */
 
+static dpm_package
+create_package (dpm_db db, ss_val interned_name)
+{
+  dpm_package pkg = ss_new (db->store, 65, 2,
+			    NULL,
+			    interned_name);
+  ss_dict_set (db->packages, interned_name, pkg);
+  add_new_package (db, pkg);
+  return pkg;
+}
+
 static dpm_package
 find_create_package (dpm_db db, const char *name, int len)
 {
   ss_val interned_name = ss_tab_intern_blob (db->strings, len, (void *)name);
   dpm_package pkg = ss_dict_get (db->packages, interned_name);
   if (pkg == NULL)
-    {
-      pkg = ss_new (db->store, 65, 2,
-		    NULL,
-		    interned_name);
-      ss_dict_set (db->packages, interned_name, pkg);
-    }
+    pkg = create_package (db, interned_name);
   return pkg;
 }
 
@@ -365,6 +526,348 @@ dpm_db_packages_elt (dpm_db_packages *iter)
   return iter->package;
 }
 
+/* The name index
+
+   The packages are also kept in a list that is sorted by name, for
+   finding all packages with a given prefix.  The list is split into
+   leaves of at most NAMES_LEAF_SIZE packages.  The leaves are weak,
+   so that the index doesn't keep packages alive that would otherwise
+   be collected; thus some of their entries might be null.
+
+   New packages are collected in db->new_packages and merged into the
+   index when the database is stored, or when the index is used.  Only
+   the leaves that receive new packages are copied.
+
+   Databases from before the name index get one the first time it is
+   needed.  Read-only databases can't store any, and
+   dpm_db_packages_prefix sorts the packages itself for them.
+ */
+
+#define NAMES_LEAF_SIZE 128
+
+static int
+name_cmp (ss_val a, const char *b, int b_len)
+{
+  int a_len = ss_len (a);
+  int r = memcmp (ss_blob_start (a), b, a_len < b_len? a_len : b_len);
+  return r? r : a_len - b_len;
+}
+
+static int
+package_cmp (dpm_package a, dpm_package b)
+{
+  ss_val b_name = dpm_pkg_name (b);
+  return name_cmp (dpm_pkg_name (a), ss_blob_start (b_name), ss_len (b_name));
+}
+
+static void
+add_new_package (dpm_db db, dpm_package pkg)
+{
+  db->new_packages = dyn_mgrow (db->new_packages,
+				&db->new_packages_capacity,
+				sizeof (dpm_package), db->n_new_packages + 1);
+  db->new_packages[db->n_new_packages++] = pkg;
+}
+
+static dpm_package
+names_leaf_first (ss_val leaf)
+{
+  for (int i = 0; i < ss_len (leaf); i++)
+    if (ss_ref (leaf, i))
+      return ss_ref (leaf, i);
+  return NULL;
+}
+
+/* The packages that have been created since opening are in the
+   dictionary as well.
+ */
+static void
+names_add_all (dpm_db db)
+{
+  db->n_new_packages = 0;
+  dyn_foreach_iter (e, ss_dict_entries, db->packages)
+    add_new_package (db, e.val);
+  db->names_missing = false;
+}
+
+static void
+names_update (dpm_db db)
+{
+  if (db->names_missing)
+    names_add_all (db);
+
+  if (db->n_new_packages == 0)
+    return;
+
+  int cmp (const void *a, const void *b)
+  {
+    return package_cmp (*(dpm_package *)a, *(dpm_package *)b);
+  }
+
+  dpm_package *new = db->new_packages;
+  int n_new = db->n_new_packages;
+  qsort (new, n_new, sizeof (dpm_package), cmp);
+
+  ss_store store = db->store;
+  int n_old = db->names? ss_len (db->names) : 0;
+
+  ss_val *leaves = NULL;
+  int n_leaves = 0, leaves_capacity = 0;
+  dpm_package *pkgs = NULL;
+  int n_pkgs = 0, pkgs_capacity = 0;
+
+  void add_leaf (ss_val leaf)
+  {
+    leaves = dyn_mgrow (leaves, &leaves_capacity, sizeof (ss_val),
+			n_leaves + 1);
+    leaves[n_leaves++] = leaf;
+  }
+
+  void add_pkg (dpm_package pkg)
+  {
+    pkgs = dyn_mgrow (pkgs, &pkgs_capacity, sizeof (dpm_package),
+		      n_pkgs + 1);
+    pkgs[n_pkgs++] = pkg;
+  }
+
+  /* Full leaves are split in half, so that the next insertions don't
+     have to split them again.
+   */
+  void add_pkgs_as_leaves ()
+  {
+    int n_pieces = 1;
+    if (n_pkgs > NAMES_LEAF_SIZE)
+      n_pieces = (n_pkgs + NAMES_LEAF_SIZE/2 - 1) / (NAMES_LEAF_SIZE/2);
+    for (int k = 0; k < n_pieces; k++)
+      {
+	int start = k * n_pkgs / n_pieces, end = (k+1) * n_pkgs / n_pieces;
+	add_leaf (ss_newv (store, SS_WEAK_TAG, end - start, pkgs + start));
+      }
+    n_pkgs = 0;
+  }
+
+  /* The first package of each leaf that follows, so that we know
+     where the new packages go.
+   */
+  dpm_package next_first[n_old + 1];
+  next_first[n_old] = NULL;
+  for (int i = n_old - 1; i >= 0; i--)
+    {
+      next_first[i] = names_leaf_first (ss_ref (db->names, i));
+      if (next_first[i] == NULL)
+	next_first[i] = next_first[i+1];
+    }
+
+  int j = 0;
+  for (int i = 0; i < n_old; i++)
+    {
+      ss_val leaf = ss_ref (db->names, i);
+      dpm_package next = next_first[i+1];
+      int end = j;
+      while (end < n_new
+	     && (next == NULL || package_cmp (new[end], next) < 0))
+	end++;
+
+      if (end == j)
+	{
+	  if (next_first[i] != next)
+	    add_leaf (leaf);
+	}
+      else
+	{
+	  /* Merge, dropping the entries that have been cleared.
+	   */
+	  for (int k = 0; k < ss_len (leaf); k++)
+	    {
+	      dpm_package pkg = ss_ref (leaf, k);
+	      if (pkg == NULL)
+		continue;
+	      while (j < end && package_cmp (new[j], pkg) < 0)
+		add_pkg (new[j++]);
+	      add_pkg (pkg);
+	    }
+	  while (j < end)
+	    add_pkg (new[j++]);
+	  add_pkgs_as_leaves ();
+	}
+    }
+
+  while (j < n_new)
+    add_pkg (new[j++]);
+  if (n_pkgs > 0)
+    add_pkgs_as_leaves ();
+
+  db->names = ss_newv (store, 0, n_leaves, leaves);
+  db->n_new_packages = 0;
+  free (leaves);
+  free (pkgs);
+}
+
+/* The first position between LO and HI in NAMES whose name is not
+   less than KEY.  NAME_AT returns NULL for empty positions, which
+   have the name of the next non-empty one.
+ */
+static int
+names_lower_bound (int lo, int hi, ss_val (*name_at) (int i),
+		   const char *key, int key_len)
+{
+  while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2, j = mid;
+      ss_val name = NULL;
+      while (j < hi && (name = name_at (j)) == NULL)
+	j++;
+      if (j < hi && name_cmp (name, key, key_len) < 0)
+	lo = j + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
+
+static bool
+dpm_db_packages_prefix_match (dpm_db_packages_prefix *iter)
+{
+  ss_val name = dpm_pkg_name (iter->package);
+  return (ss_len (name) >= iter->prefix_len
+	  && memcmp (ss_blob_start (name), iter->prefix, iter->prefix_len) == 0);
+}
+
+/* Move to the next package at or after the current position.
+ */
+static void
+dpm_db_packages_prefix_settle (dpm_db_packages_prefix *iter)
+{
+  iter->package = NULL;
+  if (iter->pkgs)
+    {
+      if (iter->index < iter->n_pkgs)
+	{
+	  iter->package = iter->pkgs[iter->index];
+	  if (!dpm_db_packages_prefix_match (iter))
+	    iter->package = NULL;
+	}
+      return;
+    }
+  while (iter->names && iter->leaf < ss_len (iter->names))
+    {
+      ss_val leaf = ss_ref (iter->names, iter->leaf);
+      while (iter->index < ss_len (leaf))
+	{
+	  iter->package = ss_ref (leaf, iter->index);
+	  if (iter->package)
+	    {
+	      if (!dpm_db_packages_prefix_match (iter))
+		iter->package = NULL;
+	      return;
+	    }
+	  iter->index++;
+	}
+      iter->leaf++;
+      iter->index = 0;
+    }
+}
+
+void
+dpm_db_packages_prefix_init (dpm_db_packages_prefix *iter,
+			     const char *prefix)
+{
+  iter->db = dyn_ref (dyn_get (cur_db));
+  iter->prefix = prefix? prefix : "";
+  iter->prefix_len = strlen (iter->prefix);
+  iter->names = NULL;
+  iter->pkgs = NULL;
+  iter->n_pkgs = 0;
+  iter->leaf = 0;
+  iter->index = 0;
+
+  if (iter->db->read_only && iter->db->names_missing)
+    {
+      int cmp (const void *a, const void *b)
+      {
+	return package_cmp (*(dpm_package *)a, *(dpm_package *)b);
+      }
+
+      ss_val name_at (int i)
+      {
+	return dpm_pkg_name (iter->pkgs[i]);
+      }
+
+      int capacity = 0;
+      dyn_foreach_iter (e, ss_dict_entries, iter->db->packages)
+	{
+	  iter->pkgs = dyn_mgrow (iter->pkgs, &capacity,
+				  sizeof (dpm_package), iter->n_pkgs + 1);
+	  iter->pkgs[iter->n_pkgs++] = e.val;
+	}
+      qsort (iter->pkgs, iter->n_pkgs, sizeof (dpm_package), cmp);
+      iter->index = names_lower_bound (0, iter->n_pkgs, name_at,
+				       iter->prefix, iter->prefix_len);
+    }
+  else
+    {
+      names_update (iter->db);
+      iter->names = iter->db->names;
+    }
+
+  if (iter->names)
+    {
+      ss_val leaf_first_name (int i)
+      {
+	dpm_package pkg = names_leaf_first (ss_ref (iter->names, i));
+	return pkg? dpm_pkg_name (pkg) : NULL;
+      }
+
+      /* The first leaf that starts at or after the prefix; the
+	 matches might begin in the one before it.
+       */
+      int l = names_lower_bound (0, ss_len (iter->names), leaf_first_name,
+				 iter->prefix, iter->prefix_len);
+      if (l > 0)
+	{
+	  ss_val leaf = ss_ref (iter->names, l-1);
+
+	  ss_val name_at (int i)
+	  {
+	    dpm_package pkg = ss_ref (leaf, i);
+	    return pkg? dpm_pkg_name (pkg) : NULL;
+	  }
+
+	  iter->leaf = l-1;
+	  iter->index = names_lower_bound (0, ss_len (leaf), name_at,
+					   iter->prefix, iter->prefix_len);
+	}
+    }
+
+  dpm_db_packages_prefix_settle (iter);
+}
+
+void
+dpm_db_packages_prefix_fini (dpm_db_packages_prefix *iter)
+{
+  free (iter->pkgs);
+  dyn_unref (iter->db);
+}
+
+void
+dpm_db_packages_prefix_step (dpm_db_packages_prefix *iter)
+{
+  iter->index++;
+  dpm_db_packages_prefix_settle (iter);
+}
+
+bool
+dpm_db_packages_prefix_done (dpm_db_packages_prefix *iter)
+{
+  return iter->package == NULL;
+}
+
+dpm_package
+dpm_db_packages_prefix_elt (dpm_db_packages_prefix *iter)
+{
+  return iter->package;
+}
+
 /* Origins
  */
 
@@ -374,6 +877,35 @@ dpm_db_origin_find (const char *label)
   return intern (dyn_get (cur_db), label);
 }
 
+/* Additions to the reverse indices are collected over many stanzas
+   and then applied in a single batch per dictionary.
+ */
+#define PENDING_ADDS_SIZE 1024
+
+typedef struct {
+  ss_dict *dict;
+  int n_ops;
+  ss_dict_op ops[PENDING_ADDS_SIZE];
+} pending_adds;
+
+static void
+pending_adds_flush (pending_adds *pa)
+{
+  ss_dict_apply_batch (pa->dict, pa->n_ops, pa->ops);
+  pa->n_ops = 0;
+}
+
+static void
+pending_adds_add (pending_adds *pa, ss_val key, ss_val val)
+{
+  if (pa->n_ops == PENDING_ADDS_SIZE)
+    pending_adds_flush (pa);
+  pa->ops[pa->n_ops].op = SS_DICT_OP_ADD;
+  pa->ops[pa->n_ops].key = key;
+  pa->ops[pa->n_ops].val = val;
+  pa->n_ops++;
+}
+
 typedef struct {
   dpm_db db;
 
@@ -400,6 +932,10 @@ typedef struct {
   dpm_origin origin;
   ss_dict *available;
 
+  pending_adds reverse_rels;
+  pending_adds provides;
+  pending_adds tags;
+
   dpm_package package;
 } update_data;
 
@@ -472,13 +1008,13 @@ parse_relations (update_data *ud, int t, const char *value, int value_len)
 }
 
 static uint32_t
-hash_version (dpm_version ver)
+hash_version (ss_store ss, dpm_version ver)
 {
   if (dpm_ver_checksum (ver))
-    return ss_hash (dpm_ver_checksum (ver));
+    return ss_hash (ss, dpm_ver_checksum (ver));
   else
-    return (ss_hash (dpm_pkg_name (dpm_ver_package (ver)))
-	    + ss_hash (dpm_ver_version (ver)));
+    return (ss_hash (ss, dpm_pkg_name (dpm_ver_package (ver)))
+	    + ss_hash (ss, dpm_ver_version (ver)));
 }
 
 static bool
@@ -492,7 +1028,8 @@ static void
 record_version (update_data *ud, dpm_version ver)
 {
   dpm_version int_ver = ss_tab_intern_x (ud->db->versions, ver,
-                                         hash_version (ver), version_equal);
+                                         hash_version (ud->db->store, ver),
+					 version_equal);
 
   dpm_package pkg = dpm_ver_package (ver);
 
@@ -503,25 +1040,25 @@ record_version (update_data *ud, dpm_version ver)
       ss_val rels_rec = dpm_ver_relations (ver);
       ss_val tags = dpm_ver_tags (ver);
 
-      void add_rev_rels (ss_dict *dict, ss_val rels)
+      void add_rev_rels (pending_adds *pa, ss_val rels)
       {
 	if (rels)
 	  for (int j = 0; j < ss_len (rels); j++)
 	    {
 	      ss_val rel = ss_ref (rels, j);
 	      for (int k = 0; k < ss_len (rel); k += 3)
-		ss_dict_add (dict, ss_ref (rel, k+1), ver);
+		pending_adds_add (pa, ss_ref (rel, k+1), ver);
 	    }
       }
 
       for (int i = 0; i < ss_len (rels_rec); i++)
-	add_rev_rels (ud->db->reverse_rels, ss_ref (rels_rec, i));
+	add_rev_rels (&ud->reverse_rels, ss_ref (rels_rec, i));
 
-      add_rev_rels (ud->db->provides, dpm_rels_provides (rels_rec));
+      add_rev_rels (&ud->provides, dpm_rels_provides (rels_rec));
 
       if (tags)
         for (int i = 0; i < ss_len (tags); i++)
-          ss_dict_add (ud->db->tags, ss_ref (tags, i), ver);
+          pending_adds_add (&ud->tags, ss_ref (tags, i), ver);
     }
 }
 
@@ -562,9 +1099,13 @@ handle_removes (update_data *ud, dyn_input in)
 	  else if ((v = intern_softn (ud->db, version, version_len)))
 	    {
 	      ss_val vs = ss_dict_get (ud->available, p);
-	      for (int i = 0; i < ss_len (vs); i++)
-		if (dpm_ver_version (ss_ref (vs, i)) == v)
-		  ss_dict_del (ud->available, p, ss_ref (vs, i));
+	      int n = 0;
+	      dpm_version del[ss_set_len (vs)];
+	      dyn_foreach (ver, ss_elts, vs)
+		if (dpm_ver_version (ver) == v)
+		  del[n++] = ver;
+	      for (int i = 0; i < n; i++)
+		ss_dict_del (ud->available, p, del[i]);
 	    }
         }
 
@@ -660,19 +1201,20 @@ parse_package_stanza (update_data *ud, dyn_input in)
 	suggests = parse_relations (ud, DPM_SUGGESTS, f.value, f.value_len);
       else
 	{
-	  ss_val val = ss_tab_intern_blob (db->strings,
-					   f.value_len, (void *)f.value);
+	  ss_val val;
+
+	  if (key == ud->description_key)
+	    val = ss_tab_intern_blob_compressed (db->strings, f.value_len,
+						 (void *)f.value);
+	  else
+	    val = ss_tab_intern_blob (db->strings,
+				      f.value_len, (void *)f.value);
 	  
 	  if (key == ud->package_key)
 	    {
 	      dpm_package pkg = ss_dict_get (db->packages, val);
 	      if (pkg == NULL)
-		{
-		  pkg = ss_new (db->store, 65, 2,
-				NULL,
-				val);
-		  ss_dict_set (db->packages, val, pkg);
-		}
+		pkg = create_package (db, val);
 	      ud->package = pkg;
 	    }
 	  else if (key == ud->version_key)
@@ -690,11 +1232,11 @@ parse_package_stanza (update_data *ud, dyn_input in)
       
 	  if (key == ud->description_key)
 	    {
-	      char *desc = ss_blob_start (val);
-	      char *pos = memchr (desc, '\n', ss_len (val));
+	      const char *desc = f.value;
+	      const char *pos = memchr (desc, '\n', f.value_len);
 	      if (pos)
 		shortdesc = ss_tab_intern_blob (db->strings,
-						pos-desc, desc);
+						pos-desc, (void *)desc);
 	      else
 		shortdesc = val;
 	    }
@@ -788,9 +1330,20 @@ dpm_db_origin_update (dpm_origin origin,
                   ss_dict_get (ud.db->origin_available, origin),
 		  SS_DICT_STRONG);
 
+  ud.reverse_rels.dict = ud.db->reverse_rels;
+  ud.reverse_rels.n_ops = 0;
+  ud.provides.dict = ud.db->provides;
+  ud.provides.n_ops = 0;
+  ud.tags.dict = ud.db->tags;
+  ud.tags.n_ops = 0;
+
   while (parse_package_stanza (&ud, in))
     ;
 
+  pending_adds_flush (&ud.reverse_rels);
+  pending_adds_flush (&ud.provides);
+  pending_adds_flush (&ud.tags);
+
   ss_dict_set (ud.db->origin_available, origin,
 	       ss_dict_finish (ud.available));
 }
@@ -1293,7 +1846,7 @@ dpm_db_status (dpm_package pkg)
 {
   dpm_db db = dyn_get (cur_db);
 
-  dpm_status s = ss_dict_get (db->status, pkg);
+  dpm_status s = ss_vec_get (db->status, pkg);
   if (s)
     return s;
   if (!null_status)
@@ -1313,10 +1866,10 @@ dpm_db_set_status (dpm_package pkg, dpm_version ver, int status)
   if (ver != dpm_stat_version (old)
       || status != dpm_stat_status (old))
     {
-      ss_dict_set (db->status, pkg, ss_new (db->store, 0, 3,
-					    ver,
-					    ss_from_int (status),
-					    ss_ref (old, 2)));
+      ss_vec_set (db->status, pkg, ss_new (db->store, 0, 3,
+					   ver,
+					   ss_from_int (status),
+					   ss_ref (old, 2)));
     }
 }
 
@@ -1328,10 +1881,10 @@ dpm_db_set_status_flags (dpm_package pkg, int flags)
   dpm_status old = dpm_db_status (pkg);
   if (flags != dpm_stat_flags (old))
     {
-      ss_dict_set (db->status, pkg, ss_new (db->store, 0, 3,
-					    ss_ref (old, 0),
-					    ss_ref (old, 1),
-					    ss_from_int (flags)));
+      ss_vec_set (db->status, pkg, ss_new (db->store, 0, 3,
+					   ss_ref (old, 0),
+					   ss_ref (old, 1),
+					   ss_from_int (flags)));
     }
 }
 
@@ -1388,6 +1941,32 @@ dpm_db_stats ()
 	   n_packages, n_versions);
 }
 
+void
+dpm_db_profile ()
+{
+  dpm_db db = dyn_get (cur_db);
+  static const char *names[] = {
+    NULL, "strings", "packages", "versions", "status",
+    "origin_available", "tags", "reverse_rels", "provides", "names"
+  };
+
+  ss_store_profile prof;
+  ss_profile_store (db->store, &prof);
+  ss_store_profile_dump (&prof);
+
+  ss_val root = ss_get_root (db->store);
+  int n_names = sizeof (names) / sizeof (names[0]);
+  for (int i = 1; root && i < ss_len (root) && i < n_names; i++)
+    {
+      ss_trie_profile trie;
+      if (ss_profile_trie (ss_ref (root, i), &trie))
+	{
+	  printf ("\n%s: ", names[i]);
+	  ss_trie_profile_dump (&trie);
+	}
+    }
+}
+
 /* Formatters
  */
 
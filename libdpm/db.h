@@ -40,6 +40,10 @@
    different from the list of files in the package), etc.  The status
    is not available in a single record, it is too volatile for this.
    Instead, a set of accessor functions is used to maintain it
+
+   The database can be opened read-only with dpm_db_open_read_only,
+   which works while another process has it open for writing.  Such a
+   reader sees the database as it was when it was opened.
  */
 
 extern dyn_var dpm_database_name[1];
@@ -53,16 +57,49 @@ int dpm_db_check_versions (ss_val a, int op, ss_val b);
 int dpm_db_check_versions_str (ss_val a, int op, const char *b, int b_len);
 
 void dpm_db_open ();
+void dpm_db_open_read_only ();
 void dpm_db_checkpoint ();
 void dpm_db_done ();
 void dpm_db_gc_and_done ();
 
+/* Transactions
+
+   Changes between dpm_db_begin and dpm_db_commit are committed
+   together, and dpm_db_checkpoint does nothing in between.
+   Transactions can be nested; only the outermost dpm_db_commit
+   commits.  Dpm_db_rollback undoes all changes since the outermost
+   dpm_db_begin.
+
+   A savepoint captures the current state of the database, and
+   dpm_db_rollback_to goes back to it.  Savepoints are only valid
+   until the database is closed.
+
+   With relaxed durability, committing doesn't wait for the disk and
+   other clients don't see the new state until dpm_db_sync is called,
+   or the database is closed with dpm_db_done.  A crash loses all
+   commits since the last sync, but never leaves the database in an
+   inconsistent state.
+ */
+
+typedef ss_val dpm_db_savepoint;
+
+void dpm_db_begin ();
+void dpm_db_commit ();
+void dpm_db_rollback ();
+
+dpm_db_savepoint dpm_db_save ();
+void dpm_db_rollback_to (dpm_db_savepoint sp);
+
+void dpm_db_set_relaxed (bool relaxed);
+void dpm_db_sync ();
+
 int dpm_db_package_id_limit ();
 int dpm_db_version_id_limit ();
 
 ss_val dpm_db_intern (const char *string);
 
 void dpm_db_stats ();
+void dpm_db_profile ();
 
 /* Packages
  */
@@ -81,6 +118,22 @@ DYN_DECLARE_STRUCT_ITER (dpm_package, dpm_db_packages)
   dpm_package package;
 };
 
+/* The packages whose names start with PREFIX, sorted by name.  With
+   an empty or null PREFIX, this is all packages.
+ */
+DYN_DECLARE_STRUCT_ITER (dpm_package, dpm_db_packages_prefix,
+			 const char *prefix)
+{
+  dpm_db db;
+  ss_val names;
+  dpm_package *pkgs;     // sorted, when there is no index to use
+  int n_pkgs;
+  const char *prefix;
+  int prefix_len;
+  int leaf, index;
+  dpm_package package;
+};
+
 /* Versions
  */
 
@@ -26,11 +26,17 @@
 #include <limits.h>
 #include <setjmp.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef HAVE_BZLIB
 #include <bzlib.h>
 #endif
@@ -139,10 +145,25 @@ dyn_strndup (const char *str, int n)
 
 /* Dynamic values */
 
+/* A value is preceded by two words: the size of its block, and a
+   header with the type tag in the top 8 bits, a flag for shared
+   values, and the reference count in the low 23 bits.
+   The reference count of a shared value is only changed with atomic
+   instructions.  The flag itself never changes once the value is
+   visible to other threads.
+ */
+
 #define DYN_HEAD(v)      (((uint32_t *)v)[-1])
-#define DYN_REFCOUNT(v)  (DYN_HEAD(v)&0xFFFFFF)
+#define DYN_BLOCK_SIZE(v) (((uint32_t *)v)[-2])
+#define DYN_SHARED       0x800000
+#define DYN_REFCOUNT(v)  (DYN_HEAD(v)&0x7FFFFF)
 #define DYN_TAG(v)       (DYN_HEAD(v)>>24)
 
+#define DYN_IS_SHARED(v) \
+  (__atomic_load_n (&DYN_HEAD(v), __ATOMIC_RELAXED) & DYN_SHARED)
+
+#define DYN_THREAD_LOCAL __thread __attribute__ ((tls_model ("initial-exec")))
+
 static dyn_type *dyn_types[256];
 
 void
@@ -158,7 +179,97 @@ dyn_type_register (dyn_type *type)
     }
 }
 
-static int n_objects;
+/* Small values are allocated from pools, one free list for each
+   multiple of 16 bytes up to DYN_POOL_MAX.  The free lists are filled
+   from slabs of DYN_SLAB_SIZE bytes that are never given back.
+
+   Each thread has its own cache with the free lists and its own
+   counters, so that allocating doesn't need any locking.  A value
+   that is freed in another thread goes to the free list of that
+   thread.  The caches of threads that have exited are reused by new
+   threads.
+ */
+
+#ifdef __SANITIZE_ADDRESS__
+/* Let the sanitizer see each value on its own.
+ */
+#define DYN_POOL_MAX    0
+#else
+#define DYN_POOL_MAX    256
+#endif
+#define DYN_POOL_GRAIN  16
+#define DYN_N_POOLS     (DYN_POOL_MAX / DYN_POOL_GRAIN)
+#define DYN_SLAB_SIZE   (64*1024)
+
+typedef struct dyn_pool_cache {
+  struct dyn_pool_cache *next, *next_idle;
+  void *free[DYN_N_POOLS];
+  char *slab;
+  size_t slab_left;
+  long live_objects[256];
+  long live_bytes[256];
+} dyn_pool_cache;
+
+static DYN_THREAD_LOCAL dyn_pool_cache *pool_cache;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static dyn_pool_cache *all_pool_caches, *idle_pool_caches;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void
+dyn_pool_cache_release (void *data)
+{
+  dyn_pool_cache *c = data;
+  pthread_mutex_lock (&pool_lock);
+  c->next_idle = idle_pool_caches;
+  idle_pool_caches = c;
+  pthread_mutex_unlock (&pool_lock);
+}
+
+static void
+dyn_pool_make_key ()
+{
+  pthread_key_create (&pool_key, dyn_pool_cache_release);
+}
+
+static dyn_pool_cache *
+dyn_pool_cache_get ()
+{
+  if (pool_cache == NULL)
+    {
+      dyn_pool_cache *c;
+
+      pthread_mutex_lock (&pool_lock);
+      if (idle_pool_caches)
+	{
+	  c = idle_pool_caches;
+	  idle_pool_caches = c->next_idle;
+	}
+      else
+	{
+	  c = calloc (1, sizeof (dyn_pool_cache));
+	  if (c)
+	    {
+	      c->next = all_pool_caches;
+	      all_pool_caches = c;
+	    }
+	}
+      pthread_mutex_unlock (&pool_lock);
+      if (c == NULL)
+	dyn_oom ();
+
+      pthread_once (&pool_key_once, dyn_pool_make_key);
+      pthread_setspecific (pool_key, c);
+      pool_cache = c;
+    }
+  return pool_cache;
+}
+
+/* The counters are read by other threads in dyn_get_type_stats.
+ */
+#define DYN_COUNT(var, delta) \
+  __atomic_store_n (&(var), (var) + (delta), __ATOMIC_RELAXED)
 
 dyn_val
 dyn_alloc (dyn_type *type, size_t size)
@@ -166,14 +277,84 @@ dyn_alloc (dyn_type *type, size_t size)
   if (type->tag == 0)
     abort();
 
-  uint32_t *mem = dyn_calloc (size + sizeof (uint32_t));
-  dyn_val val = (dyn_val)(mem + 1);
-  mem[0] = (type->tag << 24) | 1;
+  dyn_pool_cache *c = dyn_pool_cache_get ();
+  size_t block_size = size + 2*sizeof (uint32_t);
+  uint32_t *mem;
+
+  if (block_size <= DYN_POOL_MAX)
+    {
+      int pool = (block_size - 1) / DYN_POOL_GRAIN;
+      block_size = (pool + 1) * DYN_POOL_GRAIN;
+      mem = c->free[pool];
+      if (mem)
+	c->free[pool] = *(void **)mem;
+      else
+	{
+	  if (c->slab_left < block_size)
+	    {
+	      c->slab = dyn_malloc (DYN_SLAB_SIZE);
+	      c->slab_left = DYN_SLAB_SIZE;
+	    }
+	  mem = (uint32_t *)c->slab;
+	  c->slab += block_size;
+	  c->slab_left -= block_size;
+	}
+      memset (mem, 0, block_size);
+    }
+  else
+    {
+      if (block_size > UINT32_MAX)
+	dyn_oom ();
+      mem = dyn_calloc (block_size);
+    }
+
+  dyn_val val = (dyn_val)(mem + 2);
+  mem[0] = block_size;
+  mem[1] = (type->tag << 24) | 1;
   dyn_unref_on_unwind (val);
-  n_objects += 1;
+  DYN_COUNT (c->live_objects[type->tag], 1);
+  DYN_COUNT (c->live_bytes[type->tag], block_size);
   return val;
 }
 
+static void
+dyn_free (dyn_val val)
+{
+  dyn_pool_cache *c = dyn_pool_cache_get ();
+  uint32_t *mem = ((uint32_t *)val) - 2;
+  size_t block_size = DYN_BLOCK_SIZE(val);
+  int tag = DYN_TAG(val);
+
+  DYN_COUNT (c->live_objects[tag], -1);
+  DYN_COUNT (c->live_bytes[tag], -(long)block_size);
+
+  if (block_size <= DYN_POOL_MAX)
+    {
+      int pool = block_size / DYN_POOL_GRAIN - 1;
+      *(void **)mem = c->free[pool];
+      c->free[pool] = mem;
+    }
+  else
+    free (mem);
+}
+
+void
+dyn_get_type_stats (dyn_type *type, dyn_type_stats *stats)
+{
+  stats->live_objects = 0;
+  stats->live_bytes = 0;
+
+  pthread_mutex_lock (&pool_lock);
+  for (dyn_pool_cache *c = all_pool_caches; c; c = c->next)
+    {
+      stats->live_objects += __atomic_load_n (&c->live_objects[type->tag],
+					      __ATOMIC_RELAXED);
+      stats->live_bytes += __atomic_load_n (&c->live_bytes[type->tag],
+					    __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&pool_lock);
+}
+
 int
 dyn_is (dyn_val val, dyn_type *type)
 {
@@ -193,24 +374,41 @@ dyn_val
 dyn_ref (dyn_val val)
 {
   if (val)
-    DYN_HEAD(val) += 1;
+    {
+      if (DYN_IS_SHARED (val))
+	__atomic_add_fetch (&DYN_HEAD(val), 1, __ATOMIC_RELAXED);
+      else
+	DYN_HEAD(val) += 1;
+    }
 
   return val;
 }
 
+dyn_val
+dyn_share (dyn_val val)
+{
+  if (val)
+    DYN_HEAD(val) |= DYN_SHARED;
+  return val;
+}
+
 void
 dyn_unref (dyn_val val)
 {
   if (val)
     {
-      DYN_HEAD(val) -= 1;
-      if (DYN_REFCOUNT(val) == 0)
+      uint32_t head;
+      if (DYN_IS_SHARED (val))
+	head = __atomic_sub_fetch (&DYN_HEAD(val), 1, __ATOMIC_ACQ_REL);
+      else
+	head = (DYN_HEAD(val) -= 1);
+
+      if ((head & 0x7FFFFF) == 0)
 	{
 	  dyn_type *t = dyn_types[DYN_TAG(val)];
 	  if (t->unref)
 	    t->unref (t, val);
-	  free (((uint32_t *)val)-1);
-	  n_objects--;
+	  dyn_free (val);
 	}
     }
 }
@@ -347,7 +545,6 @@ typedef enum {
 } dyn_kind;
 
 typedef struct dyn_item {
-  struct dyn_item *up;
   dyn_kind kind;
   union {
     struct {
@@ -357,6 +554,7 @@ typedef struct dyn_item {
     struct {
       dyn_var *var;
       dyn_val oldval;
+      bool oldbound;
     } var;
     struct {
       dyn_val val;
@@ -368,108 +566,162 @@ typedef struct dyn_item {
   } val;
 } dyn_item;
 
-/* XXX - use a thread local variable instead of a global.
+/* The windlist is a stack of items that only ever grows.  Pushing
+   and popping an item doesn't allocate anything once the stack has
+   reached its high water mark.  Items are referred to by their
+   position since the stack moves when it grows.
  */
 
-static dyn_item *windlist = NULL;
+static DYN_THREAD_LOCAL dyn_item *windlist = NULL;
+static DYN_THREAD_LOCAL int windlist_top = 0, windlist_capacity = 0;
 
-static void
-dyn_add_unwind_item (dyn_item *item)
+/* Each thread has its own bindings of the dynamic variables, indexed
+   by the id of the variable.  Variables get their id when they are
+   first bound with dyn_let.  A variable that is not bound in the
+   current thread has its global value.
+ */
+
+typedef struct {
+  dyn_val val;
+  bool bound;
+} dyn_binding;
+
+static DYN_THREAD_LOCAL dyn_binding *bindings = NULL;
+static DYN_THREAD_LOCAL int bindings_capacity = 0;
+
+static int dyn_n_vars = 0;
+
+static dyn_binding *
+dyn_var_binding (dyn_var *var)
 {
-  item->up = windlist;
-  windlist = item;
+  int id = __atomic_load_n (&var->id, __ATOMIC_RELAXED);
+  if (id < bindings_capacity && bindings[id].bound)
+    return &bindings[id];
+  return NULL;
+}
+
+static dyn_item *
+dyn_push_unwind_item (dyn_kind kind)
+{
+  if (windlist_top == windlist_capacity)
+    windlist = dyn_mgrow (windlist, &windlist_capacity,
+			  sizeof (dyn_item), windlist_top + 1);
+  dyn_item *item = &windlist[windlist_top++];
+  item->kind = kind;
+  return item;
 }
 
 static void
-dyn_unwind (dyn_item *goal, int for_throw)
+dyn_unwind (int goal, int for_throw)
 {
-  while (windlist != goal)
+  while (windlist_top > goal)
     {
-      dyn_item *w = windlist;
+      /* The item is popped before running it, so that it can push
+	 and pop its own items.
+       */
+      dyn_item w = windlist[--windlist_top];
 
-      switch (w->kind)
+      switch (w.kind)
 	{
 	case dyn_kind_extent:
 	  break;
 	case dyn_kind_func:
-	  w->val.func.func (for_throw, w->val.func.data);
+	  w.val.func.func (for_throw, w.val.func.data);
 	  break;
 	case dyn_kind_var:
-	  dyn_unref (w->val.var.var->val);
-	  w->val.var.var->val = w->val.var.oldval;
+	  {
+	    dyn_binding *b = &bindings[w.val.var.var->id];
+	    dyn_unref (b->val);
+	    b->val = w.val.var.oldval;
+	    b->bound = w.val.var.oldbound;
+	  }
 	  break;
 	case dyn_kind_unref:
-	  dyn_unref (w->val.unref.val);
+	  dyn_unref (w.val.unref.val);
 	  break;
 	case dyn_kind_target:
-	  dyn_unref (w->val.target.value);
+	  dyn_unref (w.val.target.value);
 	  break;
 	}
-      windlist = w->up;
-      free (w);
     }
 }
 
 void
 dyn_begin ()
 {
-  dyn_item *item = dyn_malloc (sizeof (dyn_item));
-  item->kind = dyn_kind_extent;
-  dyn_add_unwind_item (item);
+  dyn_push_unwind_item (dyn_kind_extent);
 }
 
 void
 dyn_end ()
 {
-  dyn_item *w = windlist;
-  while (w->kind != dyn_kind_extent)
-    w = w->up;
-  dyn_unwind (w->up, 0);
+  int i = windlist_top - 1;
+  while (windlist[i].kind != dyn_kind_extent)
+    i--;
+  dyn_unwind (i, 0);
 }
 
 void
 dyn_on_unwind (void (*func) (int for_throw, void *data), void *data)
 {
-  dyn_item *item = dyn_malloc (sizeof (dyn_item));
-  item->kind = dyn_kind_func;
+  dyn_item *item = dyn_push_unwind_item (dyn_kind_func);
   item->val.func.func = func;
   item->val.func.data = data;
-  dyn_add_unwind_item (item);
 }
 
 dyn_val
 dyn_get (dyn_var *var)
 {
-  return var->val;
+  dyn_binding *b = dyn_var_binding (var);
+  return b? b->val : var->val;
 }
 
 void
 dyn_set (dyn_var *var, dyn_val val)
 {
+  dyn_binding *b = dyn_var_binding (var);
+  dyn_val *loc = b? &b->val : &var->val;
   dyn_ref (val);
-  dyn_unref (var->val);
-  var->val = val;
+  dyn_unref (*loc);
+  *loc = val;
 }
 
 void
 dyn_let (dyn_var *var, dyn_val val)
 {
-  dyn_item *item = dyn_malloc (sizeof (dyn_item));
-  item->kind = dyn_kind_var;
+  int id = __atomic_load_n (&var->id, __ATOMIC_ACQUIRE);
+  if (id == 0)
+    {
+      /* Losing the race only wastes an id.
+       */
+      int new_id = __atomic_add_fetch (&dyn_n_vars, 1, __ATOMIC_RELAXED);
+      if (__atomic_compare_exchange_n (&var->id, &id, new_id, false,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	id = new_id;
+    }
+
+  if (id >= bindings_capacity)
+    {
+      int old_capacity = bindings_capacity;
+      bindings = dyn_mgrow (bindings, &bindings_capacity,
+			    sizeof (dyn_binding), id + 1);
+      memset (bindings + old_capacity, 0,
+	      (bindings_capacity - old_capacity) * sizeof (dyn_binding));
+    }
+
+  dyn_item *item = dyn_push_unwind_item (dyn_kind_var);
   item->val.var.var = var;
-  item->val.var.oldval = var->val;
-  dyn_add_unwind_item (item);
-  dyn_ref (val);
-  var->val = val;
+  item->val.var.oldval = bindings[id].val;
+  item->val.var.oldbound = bindings[id].bound;
+  bindings[id].val = dyn_ref (val);
+  bindings[id].bound = true;
 }
 
 void
 dyn_unref_on_unwind (dyn_val val)
 {
-  dyn_item *item = dyn_malloc (sizeof (dyn_item));
-  item->kind = dyn_kind_unref;
+  dyn_item *item = dyn_push_unwind_item (dyn_kind_unref);
   item->val.unref.val = val;
-  dyn_add_unwind_item (item);  
 }
 
 dyn_val
@@ -502,11 +754,10 @@ dyn_catch (void (*func) (dyn_target *target, void *data), void *data)
 {
   dyn_target target;
 
-  dyn_item *item = dyn_malloc (sizeof (dyn_item));
-  item->kind = dyn_kind_target;
+  int pos = windlist_top;
+  dyn_item *item = dyn_push_unwind_item (dyn_kind_target);
   item->val.target.target = &target;
   item->val.target.value = NULL;
-  dyn_add_unwind_item (item);
 
   /* If we caught something, we leave our entry in the windlist so
      that the value is freed later.  When we didn't catch anything, we
@@ -517,26 +768,26 @@ dyn_catch (void (*func) (dyn_target *target, void *data), void *data)
   if (setjmp (target.jmp) == 0)
     {
       func (&target, data);
-      dyn_unwind (item->up, 0);
+      dyn_unwind (pos, 0);
       return NULL;
     }
   else
-    return item->val.target.value;
+    return windlist[pos].val.target.value;
 }
 
 void
 dyn_throw (dyn_target *target, dyn_val value)
 {
-  dyn_item *w = windlist;
-  while (w && (w->kind != dyn_kind_target
-	       || w->val.target.target != target
-	       || w->val.target.value != NULL))
-    w = w->up;
+  int i = windlist_top - 1;
+  while (i >= 0 && (windlist[i].kind != dyn_kind_target
+		    || windlist[i].val.target.target != target
+		    || windlist[i].val.target.value != NULL))
+    i--;
 
-  if (w)
+  if (i >= 0)
     {
-      w->val.target.value = dyn_ref (value);
-      dyn_unwind (w, 1);
+      windlist[i].val.target.value = dyn_ref (value);
+      dyn_unwind (i + 1, 1);
       longjmp (target->jmp, 1);
     }
   else
@@ -679,7 +930,7 @@ struct dyn_input_struct {
   int (*read) (void *handle, char *buf, int n);
   void (*close) (void *handle);
 
-  int bufstatic;
+  int bufstatic, bufmapped;
   char *buf, *bufend, *buflimit;
   int bufsize;
 
@@ -701,6 +952,7 @@ dyn_input_new ()
   in->close = NULL;
 
   in->bufstatic = 0;
+  in->bufmapped = 0;
   in->buf = NULL;
   in->bufsize = 0;
   in->bufend = in->buf;
@@ -778,14 +1030,14 @@ dyn_input_lineno (dyn_input in)
 static int
 dyn_fd_read (void *handle, char *buf, int n)
 {
-  int fd = (int) handle;
+  int fd = (int)(intptr_t) handle;
   return read (fd, buf, n);
 }
 
 static void
 dyn_fd_close (void *handle)
 {
-  int fd = (int) handle;
+  int fd = (int)(intptr_t) handle;
   close (fd);
 }
 
@@ -796,6 +1048,64 @@ has_suffix (const char *str, const char *suffix)
   return len >= suflen && strcmp (str+len-suflen, suffix) == 0;
 }
 
+/* Map all of FD into memory as the buffer of IN, if it is a regular
+   file, and set errno otherwise.  The mapping is private and writable so that
+   dyn_input_mutable_mark does not need to copy it.
+ */
+static int
+dyn_input_map_fd (dyn_input in, int fd)
+{
+  struct stat st;
+
+  if (fstat (fd, &st) < 0)
+    return 0;
+  if (!S_ISREG (st.st_mode) || st.st_size > INT_MAX)
+    {
+      errno = S_ISREG (st.st_mode)? EFBIG : ENODEV;
+      return 0;
+    }
+
+  if (st.st_size == 0)
+    {
+      dyn_input_set_static_buffer (in, "", 0);
+      return 1;
+    }
+
+  char *buf = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		    fd, 0);
+  if (buf == MAP_FAILED)
+    return 0;
+  madvise (buf, st.st_size, MADV_SEQUENTIAL);
+
+  dyn_input_set_static_buffer (in, buf, st.st_size);
+  in->bufstatic = 0;
+  in->bufmapped = 1;
+  return 1;
+}
+
+dyn_input
+dyn_open_mmap (const char *filename)
+{
+  int fd;
+  dyn_input in = dyn_input_new ();
+
+  in->filename = dyn_strdup (filename);
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    dyn_error ("%m");
+  if (!dyn_input_map_fd (in, fd))
+    {
+      int err = errno;
+      close (fd);
+      errno = err;
+      dyn_error ("can't map %s: %m", filename);
+    }
+  close (fd);
+
+  return in;
+}
+
 dyn_input
 dyn_open_file (const char *filename)
 {
@@ -807,7 +1117,7 @@ dyn_open_file (const char *filename)
   in->close = dyn_fd_close;
 
   fd = open (filename, O_RDONLY);
-  in->handle = (void *)fd;
+  in->handle = (void *)(intptr_t)fd;
   if (fd < 0)
     dyn_error ("%m");
 
@@ -1025,7 +1335,9 @@ dyn_input_unref (dyn_type *type, void *object)
   if (in->close)
     in->close (in->handle);
 
-  if (!in->bufstatic)
+  if (in->bufmapped)
+    munmap (in->buf, in->bufsize);
+  else if (!in->bufstatic)
     free (in->buf);
   free (in->filename);
 }
@@ -1156,9 +1468,12 @@ dyn_input_set_pos (dyn_input in, const char *pos)
     {
       if (in->pos < pos)
 	{
-	  for (char *p = in->pos; p < pos; p++)
-	    if (*p == '\n')
+	  const char *p = in->pos;
+	  while ((p = memchr (p, '\n', pos - p)))
+	    {
 	      in->lineno++;
+	      p++;
+	    }
 	}
       else
 	{
@@ -1188,8 +1503,67 @@ dyn_input_looking_at (dyn_input in, const char *str)
     return 0;
 }
 
+/* Character sets */
+
+#define DYN_CHARSET_HAS(set, c) \
+  ((set)->bits[(unsigned char)(c) >> 5] & (1u << ((unsigned char)(c) & 31)))
+
+void
+dyn_charset_init (dyn_charset *set, const char *chars)
+{
+  memset (set, 0, sizeof (*set));
+  for (const unsigned char *c = (const unsigned char *)chars; *c; c++)
+    if (!DYN_CHARSET_HAS (set, *c))
+      {
+	set->bits[*c >> 5] |= 1u << (*c & 31);
+	if (set->n_chars < DYN_CHARSET_MAX_CHARS)
+	  set->chars[set->n_chars] = *c;
+	set->n_chars++;
+      }
+}
+
+/* Return the first character in [PTR, END) that is in SET, or END.
+   A single character is found with memchr.  Up to
+   DYN_CHARSET_MAX_CHARS characters are compared against 16 bytes at a
+   time when SSE2 is available.  The rest is done with the bitmap.
+ */
+static const char *
+dyn_charset_find (const dyn_charset *set, const char *ptr, const char *end)
+{
+  if (set->n_chars == 1)
+    {
+      const char *p = memchr (ptr, set->chars[0], end - ptr);
+      return p? p : end;
+    }
+
+#ifdef __SSE2__
+  if (set->n_chars <= DYN_CHARSET_MAX_CHARS && end - ptr >= 16)
+    {
+      __m128i c[DYN_CHARSET_MAX_CHARS];
+      for (int i = 0; i < set->n_chars; i++)
+	c[i] = _mm_set1_epi8 (set->chars[i]);
+
+      while (end - ptr >= 16)
+	{
+	  __m128i v = _mm_loadu_si128 ((const __m128i *)ptr);
+	  __m128i m = _mm_setzero_si128 ();
+	  for (int i = 0; i < set->n_chars; i++)
+	    m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, c[i]));
+	  int mask = _mm_movemask_epi8 (m);
+	  if (mask)
+	    return ptr + __builtin_ctz (mask);
+	  ptr += 16;
+	}
+    }
+#endif
+
+  while (ptr < end && !DYN_CHARSET_HAS (set, *ptr))
+    ptr++;
+  return ptr;
+}
+
 int
-dyn_input_find (dyn_input in, const char *delims)
+dyn_input_find_set (dyn_input in, const dyn_charset *delims)
 {
   while (1)
     {
@@ -1199,9 +1573,9 @@ dyn_input_find (dyn_input in, const char *delims)
       if (n == 0)
 	return 0;
 
-      for (ptr = dyn_input_pos (in), end = ptr + n; ptr < end; ptr++)
-	if (strchr (delims, *ptr))
-	  break;
+      ptr = dyn_input_pos (in);
+      end = ptr + n;
+      ptr = dyn_charset_find (delims, ptr, end);
 
       dyn_input_set_pos (in, ptr);
       if (ptr < end)
@@ -1210,9 +1584,9 @@ dyn_input_find (dyn_input in, const char *delims)
 }
 
 int
-dyn_input_find_after (dyn_input in, const char *delims)
+dyn_input_find_after_set (dyn_input in, const dyn_charset *delims)
 {
-  if (dyn_input_find (in, delims))
+  if (dyn_input_find_set (in, delims))
     {
       dyn_input_advance (in, 1);
       return 1;
@@ -1221,7 +1595,7 @@ dyn_input_find_after (dyn_input in, const char *delims)
 }
 
 void
-dyn_input_skip (dyn_input in, const char *chars)
+dyn_input_skip_set (dyn_input in, const dyn_charset *chars)
 {
   while (1)
     {
@@ -1232,7 +1606,7 @@ dyn_input_skip (dyn_input in, const char *chars)
 	return;
 
       for (ptr = dyn_input_pos (in), end = ptr + n; ptr < end; ptr++)
-	if (!strchr (chars, *ptr))
+	if (!DYN_CHARSET_HAS (chars, *ptr))
 	  break;
 
       dyn_input_set_pos (in, ptr);
@@ -1241,6 +1615,30 @@ dyn_input_skip (dyn_input in, const char *chars)
     }
 }
 
+int
+dyn_input_find (dyn_input in, const char *delims)
+{
+  dyn_charset set;
+  dyn_charset_init (&set, delims);
+  return dyn_input_find_set (in, &set);
+}
+
+int
+dyn_input_find_after (dyn_input in, const char *delims)
+{
+  dyn_charset set;
+  dyn_charset_init (&set, delims);
+  return dyn_input_find_after_set (in, &set);
+}
+
+void
+dyn_input_skip (dyn_input in, const char *chars)
+{
+  dyn_charset set;
+  dyn_charset_init (&set, chars);
+  dyn_input_skip_set (in, &set);
+}
+
 /* Output streams */
 
 static void dyn_output_unref (dyn_type *, void *);
@@ -1497,7 +1895,7 @@ dyn_create_file (const char *name)
   
   f->fd = -1;
   f->name = dyn_strdup (name);
-  f->tmpname = dyn_malloc (strlen (name) + 7);
+  f->tmpname = dyn_malloc (strlen (name) + 8);
   strcpy (f->tmpname, name);
   strcat (f->tmpname, ".XXXXXX");
 
@@ -1689,9 +2087,15 @@ dyn_write_with_formatter (dyn_output out,
 }
 
 void
-dyn_writev (dyn_output out, const char *fmt, va_list ap)
+dyn_writev (dyn_output out, const char *fmt, va_list args)
 {
   int err = errno;
+  va_list ap;
+
+  /* Formatters consume arguments through a pointer to AP, which only
+     works reliably for a local copy.
+   */
+  va_copy (ap, args);
 
   while (*fmt)
     {
@@ -1707,6 +2111,7 @@ dyn_writev (dyn_output out, const char *fmt, va_list ap)
 	  switch (*fmt)
 	    {
 	    case '\0':
+	      va_end (ap);
 	      return;
 	    case 's':
 	      {
@@ -1806,8 +2211,8 @@ dyn_writev (dyn_output out, const char *fmt, va_list ap)
 	    case 'L':
 	      {
 		const char *sub_fmt = va_arg (ap, const char *);
-		va_list sub_ap = va_arg (ap, va_list);
-		dyn_writev (out, sub_fmt, sub_ap);
+		va_list *sub_ap = va_arg (ap, va_list *);
+		dyn_writev (out, sub_fmt, *sub_ap);
 	      }
 	      break;
 	    case '{':
@@ -1849,13 +2254,22 @@ dyn_writev (dyn_output out, const char *fmt, va_list ap)
 	dyn_write_string (out, fmt, 1);
       fmt++;
     }
+
+  va_end (ap);
 }
 
 static void
 dyn_report ()
 {
-  dyn_unwind (NULL, 0);
-  fprintf (stderr, "%d living objects\n", n_objects);
+  dyn_unwind (0, 0);
+  for (int tag = 1; tag < 256 && dyn_types[tag]; tag++)
+    {
+      dyn_type_stats stats;
+      dyn_get_type_stats (dyn_types[tag], &stats);
+      if (stats.live_objects)
+	fprintf (stderr, "%ld living %s objects, %ld bytes\n",
+		 stats.live_objects, dyn_types[tag]->name, stats.live_bytes);
+    }
 }
 
 __attribute__ ((constructor))
@@ -38,8 +38,16 @@
 
    You can use the dyn_block macro instead of dyn_begin and dyn_end.
 
+   Dynamic extents and their actions are kept on a stack per thread
+   that is reused, so they don't allocate memory and are cheap enough
+   for tight loops.
+
    A dynamic variable is like a thread local variable, but it will
-   revert to its previous value when a dynamic extent ends.
+   revert to its previous value when a dynamic extent ends.  A
+   variable that has not been bound with dyn_let in the current
+   thread has a global value, which is what dyn_get returns and
+   dyn_set changes.  Changing the global value while other threads
+   read it needs to be synchronized by the caller.
 
    A "dynamic value" is a reference counted block of memory with a
    type tag.  You can define new types of values, and strings are
@@ -62,6 +70,13 @@
    dynamic context to a value, use dyn_on_unwind_unref.  This is
    typically done in constructors.
 
+   A dynamic value belongs to the thread that created it, and its
+   reference count is updated without any synchronization.  Before
+   handing a value to other threads, call dyn_share on it.  From then
+   on, its reference count is updated atomically.  This does not
+   extend to the values it refers to, nor does it make the value
+   itself safe to modify from more than one thread.
+
    You can mark a point in the call stack with dyn_catch, and you can
    directly return to such a point with dyn_throw.  When this happens,
    all intermediate dynamic extents are ended and their actions are
@@ -155,8 +170,19 @@ void dyn_type_register (dyn_type *type);
 typedef void *dyn_val;
 
 dyn_val dyn_alloc (dyn_type *type, size_t size);
+
+/* The number of values of a type that are currently alive in all
+   threads, and the memory they use, including their headers.
+ */
+typedef struct {
+  long live_objects;
+  long live_bytes;
+} dyn_type_stats;
+
+void dyn_get_type_stats (dyn_type *type, dyn_type_stats *stats);
 dyn_val dyn_ref (dyn_val val);
 void dyn_unref (dyn_val val);
+dyn_val dyn_share (dyn_val val);
 void dyn_unref_on_unwind (dyn_val val);
 dyn_val dyn_end_with (dyn_val val);
 
@@ -208,6 +234,14 @@ int dyn_eq (dyn_val a, const char *b);
    it and continue to find the end.  After this, the mark is still in
    the buffer and thus all bytes from mark to the current position are
    available to you in memory.
+
+   The function dyn_open_mmap maps a whole regular file into memory
+   and uses that as the buffer, so nothing is ever copied.  Only use
+   it for files that nobody truncates or rewrites in place while they
+   are being read, such as files that are only ever replaced by
+   renaming a new one over them: reading past the end of a truncated
+   mapping kills the process with SIGBUS.  dyn_open_file reads the
+   file in chunks and can be used for anything.
 */
 
 DYN_DECLARE_TYPE (dyn_input);
@@ -216,6 +250,7 @@ DYN_DECLARE_TYPE (dyn_output);
 int dyn_file_exists (const char *filename);
 
 dyn_input dyn_open_file (const char *filename);
+dyn_input dyn_open_mmap (const char *filename);
 dyn_input dyn_open_string (const char *str, int len);
 dyn_input dyn_open_zlib (dyn_input compressed);
 dyn_input dyn_open_bz2 (dyn_input compressed);
@@ -242,6 +277,35 @@ int dyn_input_find_after (dyn_input in, const char *delims);
 void dyn_input_skip (dyn_input in, const char *chars);
 int dyn_input_looking_at (dyn_input in, const char *str);
 
+/* The delimiters for dyn_input_find and the characters for
+   dyn_input_skip can also be given as a dyn_charset, which is faster
+   when the same set is used over and over again.  The null character
+   is never part of a set.  Use DYN_DEFINE_CHARSET to define a static
+   set that is initialized when the program starts.
+ */
+
+#define DYN_CHARSET_MAX_CHARS 8
+
+typedef struct {
+  uint32_t bits[8];
+  int n_chars;
+  unsigned char chars[DYN_CHARSET_MAX_CHARS];
+} dyn_charset;
+
+void dyn_charset_init (dyn_charset *set, const char *chars);
+
+#define DYN_DEFINE_CHARSET(_sym, _chars)       \
+  static dyn_charset _sym[1];                  \
+  __attribute__ ((constructor))                \
+  static void _sym##__init ()                  \
+  {                                            \
+    dyn_charset_init (_sym, _chars);           \
+  }
+
+int dyn_input_find_set (dyn_input in, const dyn_charset *delims);
+int dyn_input_find_after_set (dyn_input in, const dyn_charset *delims);
+void dyn_input_skip_set (dyn_input in, const dyn_charset *chars);
+
 /* Output streams
 
    Like input streams, output streams manage a memory buffer.  You
@@ -303,6 +367,9 @@ void dyn_output_advance (dyn_output out, int n);
         stream.
 
    %B - takes a pointer and int as address and length and prints those bytes.
+
+   %L - takes a format string and a pointer to a va_list and prints
+        them as with dyn_writev.
    
    %% - prints a single %.
  
@@ -333,6 +400,7 @@ void dyn_register_formatter (const char *id, dyn_formatter_func *func);
 
 typedef struct {
   dyn_val val;
+  int id;
 } dyn_var;
 
 dyn_val dyn_get (dyn_var *var);
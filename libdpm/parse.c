@@ -28,6 +28,15 @@
 
 #include "parse.h"
 
+DYN_DEFINE_CHARSET (blank_chars, " \t\n");
+DYN_DEFINE_CHARSET (space_chars, " \t");
+DYN_DEFINE_CHARSET (newline_chars, "\n");
+DYN_DEFINE_CHARSET (comma_chars, ",");
+DYN_DEFINE_CHARSET (name_delims, " \t\n,(|");
+DYN_DEFINE_CHARSET (version_delims, " \t\n),|");
+DYN_DEFINE_CHARSET (op_chars, "<>=");
+DYN_DEFINE_CHARSET (field_delims, ":\n");
+
 static int
 whitespace_p (char c)
 {
@@ -53,7 +62,7 @@ dpm_parse_comma_fields_step (dpm_parse_comma_fields *iter)
 {
   dyn_input in = iter->in;
 
-  dyn_input_skip (in, " \t\n");
+  dyn_input_skip_set (in, blank_chars);
   if (dyn_input_grow (in, 1) < 1)
     {
       iter->field = NULL;
@@ -61,7 +70,7 @@ dpm_parse_comma_fields_step (dpm_parse_comma_fields *iter)
     }
 
   dyn_input_set_mark (in);
-  dyn_input_find (in, ",");
+  dyn_input_find_set (in, comma_chars);
       
   iter->field = dyn_input_mark (in);
   iter->len = dyn_input_pos (in) - iter->field;
@@ -81,7 +90,7 @@ dpm_parse_comma_fields_done (dpm_parse_comma_fields *iter)
 bool
 dpm_parse_next_relation (dyn_input in)
 {
-  dyn_input_skip (in, " \t");
+  dyn_input_skip_set (in, space_chars);
   if (dyn_input_looking_at (in, ","))
     {
       dyn_input_advance (in, 1);
@@ -111,14 +120,14 @@ dpm_parse_relation_alternatives_step (dpm_parse_relation_alternatives *iter)
 {
   dyn_input in = iter->in;
 
-  dyn_input_skip (in, " \t\n");
+  dyn_input_skip_set (in, blank_chars);
 
   if (!iter->first)
     {
       if (dyn_input_looking_at (in, "|"))
 	{
 	  dyn_input_advance (in, 1);
-	  dyn_input_skip (in, " \t\n");
+	  dyn_input_skip_set (in, blank_chars);
 	}
       else
 	{
@@ -128,7 +137,7 @@ dpm_parse_relation_alternatives_step (dpm_parse_relation_alternatives *iter)
     }
 
   dyn_input_set_mark (in);
-  dyn_input_find (in, " \t\n,(|");
+  dyn_input_find_set (in, name_delims);
   iter->name_len = dyn_input_off (in);
   
   if (iter->name_len == 0)
@@ -137,29 +146,29 @@ dpm_parse_relation_alternatives_step (dpm_parse_relation_alternatives *iter)
       return;
     }
 
-  dyn_input_skip (in, " \t\n");
+  dyn_input_skip_set (in, blank_chars);
   if (dyn_input_looking_at (in, "("))
     {
       int op_offset, version_offset;
       
       dyn_input_advance (in, 1);
 
-      dyn_input_skip (in, " \t\n");
+      dyn_input_skip_set (in, blank_chars);
       op_offset = dyn_input_off (in);
-      dyn_input_skip (in, "<>=");
+      dyn_input_skip_set (in, op_chars);
       iter->op_len = dyn_input_off (in) - op_offset;
 
-      dyn_input_skip (in, " \t\n");
+      dyn_input_skip_set (in, blank_chars);
       if (dyn_input_looking_at (in, ")")
 	  || dyn_input_looking_at (in, ",")
 	  || dyn_input_looking_at (in, "|"))
 	dyn_error ("missing version in relation: %I", in);
 
       version_offset = dyn_input_off (in);
-      dyn_input_find (in, " \t\n),|");
+      dyn_input_find_set (in, version_delims);
       iter->version_len = dyn_input_off (in) - version_offset;
 	  
-      dyn_input_skip (in, " \t\n");
+      dyn_input_skip_set (in, blank_chars);
       if (!dyn_input_looking_at (in, ")"))
 	dyn_error ("missing parentheses in relation");
       dyn_input_advance (in, 1);
@@ -218,7 +227,7 @@ dpm_parse_lines_step (dpm_parse_lines *iter)
 
   while (1)
     {
-      dyn_input_skip (in, " \t");
+      dyn_input_skip_set (in, space_chars);
       if (dyn_input_looking_at (in, "\n"))
 	{
 	  dyn_input_advance (in, 1);
@@ -236,7 +245,7 @@ dpm_parse_lines_step (dpm_parse_lines *iter)
 	  if (n == max_line_fields)
 	    dyn_error ("too many fields");
 	  iter->fields[n] = dyn_input_pos (in);
-	  dyn_input_find (in, " \t\n");
+	  dyn_input_find_set (in, blank_chars);
 	  iter->field_lens[n] = dyn_input_pos (in) - iter->fields[n];
 	  iter->n_fields++;
 	}
@@ -252,7 +261,7 @@ dpm_parse_lines_done (dpm_parse_lines *iter)
 bool
 dpm_parse_looking_at_control (dyn_input in)
 {
-  dyn_input_skip (in, "\n");
+  dyn_input_skip_set (in, newline_chars);
   return (dyn_input_grow (in, 1) > 0);
 }
 
@@ -277,7 +286,7 @@ dpm_parse_control_fields_step (dpm_parse_control_fields *iter)
 
   dyn_input_set_mark (in);
 
-  while (dyn_input_find (in, ":\n")
+  while (dyn_input_find_set (in, field_delims)
 	 || dyn_input_pos (in) > dyn_input_mark (in))
     {
       if (dyn_input_pos (in) == dyn_input_mark (in))
@@ -308,10 +317,10 @@ dpm_parse_control_fields_step (dpm_parse_control_fields *iter)
 
 	  value_off = dyn_input_pos (in) - dyn_input_mark (in);
 
-	  dyn_input_find_after (in, "\n");
+	  dyn_input_find_after_set (in, newline_chars);
 	  while (dyn_input_looking_at (in, " ")
 		 || dyn_input_looking_at (in, "\t"))
-	    dyn_input_find_after (in, "\n");
+	    dyn_input_find_after_set (in, newline_chars);
 
 	  iter->value_len =
 	    dyn_input_pos (in) - dyn_input_mark (in) - value_off;
@@ -25,17 +25,19 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <zlib.h>
+#include <pthread.h>
+
 #include <sys/fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "dyn.h"
 #include "store.h"
 
 /* XXX - better support for unstored objects, including some form of
          garbage collection.
-
-       - Don't mmap MAX_SIZE for read-only stores.
  */
 
 /* Object layout 
@@ -44,7 +46,8 @@
  * more words, with tag and length stored in the first word.
  * 
  * Of the 32 bits of the first word, 1 is reserved for the garbage
- * collector, 7 are used for the tag, and 24 are for the length.
+ * collector, 7 are used for the tag, 1 marks unstored objects (see
+ * below), and 23 are for the length.
  *
  * There are two fundamental types of objects: blobs and records.
  *
@@ -53,36 +56,66 @@
  * boundaries: if a blob length is not a multiple of four, some bytes
  * go unused.
  *
+ * Compressed blobs have the tag SS_ZBLOB_TAG (0x73) and are laid out
+ * like blobs, with the uncompressed length in the second word and
+ * zlib data after that.  The length in the first word counts both, in
+ * bytes.  See ss_blob_new_compressed.
+ *
  * Records have a tag that is not SS_BLOB.  Clients can use different
  * tags as they see fit, the store treats them all the same.  The
  * length in the first word gives the number of fields.  Each field is
  * either a reference to another object or a small integer and is
  * represented as one word.  For references, that word contains the
- * offset to the referenced object in bytes, relative to the start of
- * this record.  A zero offset represents a NULL reference.  For small
- * integers, the word contains the integer shifted left by 2 bits and
- * the lower two bits are set.
+ * offset to the referenced object in words, relative to the start of
+ * this record, shifted left by 1 bit.  The offset is signed, so a
+ * reference can reach 4 GiB in either direction.  A zero offset
+ * represents a NULL reference.  For small integers, the word contains
+ * the integer shifted left by 2 bits and the lower two bits are set.
+ *
+ * (Version 0 of the format stored the offset in bytes, which limits
+ * stores to 2 GiB and is easy to get wrong on 64-bit hosts.  Such
+ * stores are converted when they are opened, see ss_upgrade.)
+ *
+ * Unstored records, which live in malloced memory and not in a store,
+ * can't use relative offsets since they might be arbitrarily far away
+ * from the objects they refer to.  Instead, their fields are full
+ * ss_val pointers, starting at the second 64-bit boundary.  Unstored
+ * blobs have the same layout as stored ones.  Unstored objects have
+ * the SS_UNSTORED_FLAG set in their first word.
  */
 
 #define SS_BLOB_TAG      0x7F
+#define SS_ZBLOB_TAG     0x73
 
 #define SS_WORD(o,i)          (((uint32_t *)o)[i])
 #define SS_SET_WORD(o,i,v)    (SS_WORD(o,i)=(v))
 
+#define SS_UNSTORED_FLAG      0x800000
+#define SS_MAX_LEN            0x7FFFFF
+
 #define SS_HEADER(o)          (SS_WORD(o,0))
-#define SS_TAG(o)             ((int)(SS_HEADER(o)>>24))
-#define SS_LEN(o)             ((int)(SS_HEADER(o)&0xFFFFFF))
+#define SS_TAG(o)             ((int)((SS_HEADER(o)>>24)&0x7F))
+#define SS_LEN(o)             ((int)(SS_HEADER(o)&SS_MAX_LEN))
 #define SS_SET_HEADER(o,t,l)  (SS_SET_WORD(o,0,((t)&0x7F) << 24 | (l)))
 
+#define SS_IS_UNSTORED(o)     (SS_HEADER(o)&SS_UNSTORED_FLAG)
+#define SS_UNSTORED_REFS(o)   ((ss_val *)(((uint32_t *)o)+2))
+
 #define SS_BLOB_LEN_TO_WORDS(l)  (((l)+3)>>2)
 
+/* Blobs and compressed blobs contain bytes instead of references.
+ */
+#define SS_IS_RAW(o)  (SS_TAG(o) == SS_BLOB_TAG || SS_TAG(o) == SS_ZBLOB_TAG)
+
 #define SS_IS_FORWARD(o)    (SS_HEADER(o)&0x80000000)
 #define SS_GET_FORWARD(o)   ((uint32_t)(SS_HEADER(o)&~0x80000000))
 #define SS_SET_FORWARD2(o,f) (ss_set_forward_carefully (o, (uint32_t)(f)))
 #define SS_SET_FORWARD(o,f) (SS_SET_WORD(o,0, 0x80000000 | (uint32_t)(f)))
 
-#define SS_OFFSET(ss,obj)      (((uint32_t)obj)-((uint32_t)((ss)->head)))
-#define SS_FROM_OFFSET(ss,off) ((ss_val)(((uint32_t)((ss)->head))+((uint32_t)off)))
+/* Offsets are in words, relative to the header.
+ */
+#define SS_OFFSET(ss,obj)      ((uint32_t)(((uint32_t *)(obj))-((uint32_t *)((ss)->head))))
+#define SS_FROM_OFFSET(ss,off) ((ss_val)(((uint32_t *)((ss)->head))+(off)))
 
 #if 0
 static void
@@ -94,33 +127,212 @@ ss_set_forward_carefully (void *o, uint32_t f)
 }
 #endif
 
-#define SS_IS_INT(o)    ((((uint32_t)o)&3)==3)
-#define SS_TO_INT(o)    (((uint32_t)o)>>2)
-#define SS_FROM_INT(i)  ((((uint32_t)i)<<2)|3)
+#define SS_IS_INT(o)    ((((uintptr_t)o)&3)==3)
+#define SS_TO_INT(o)    (((uint32_t)(uintptr_t)o)>>2)
+#define SS_FROM_INT(i)  ((uintptr_t)((((uint32_t)i)<<2)|3))
+
+/* Encoding and decoding references in stored objects.  FROM is the
+   address that the offset is relative to.
+ */
+
+static inline uint32_t
+ss_encode_ref (void *from, ss_val val)
+{
+  if (val == NULL || SS_IS_INT (val))
+    return (uint32_t)(uintptr_t)val;
+  else
+    return ((uint32_t)((uint32_t *)val - (uint32_t *)from)) << 1;
+}
+
+static inline ss_val
+ss_decode_ref (void *from, uint32_t word)
+{
+  if (word == 0 || (word & 1))
+    return (ss_val)(uintptr_t)word;
+  else
+    return (ss_val)((uint32_t *)from + (((int32_t)word) >> 1));
+}
 
 /* File format
 
    A struct-store file starts with a header that identifies the format
    and contains the root and various book keeping information.
+
+   Version 0 used byte offsets in references, version 1 uses word
+   offsets.  See "Object layout" above.
+
+   Version 2 has two slots for the root and the book keeping
+   information, and the valid one with the higher sequence number is
+   the current one.  A new root is committed by writing it into the
+   other slot, so that a crash in the middle of writing it leaves the
+   current one intact.  See ss_sync.
+
+   Version 3 has the same layout as version 2, but tables use a faster
+   hash function, see ss_hash_blob.  Version 2 stores keep using the
+   old one, since their tables would need to be rebuilt otherwise.
+
+   Version 4 can also contain compressed blobs.
+
+   Version 5 records in each slot how long the store was after its
+   last full collection, see ss_maybe_gc, a checksum of the words
+   that the slot has committed, see ss_sync, and how often the store
+   has been collected into a new file, see ss_export_delta.  The slots
+   are four words longer, and the objects start four words later for
+   each of them.  Versions 3 and 4 stores become version 5 ones in a full
+   garbage collection.
 */
 
 #define SS_MAGIC   0x42445453 /* STDB */
-#define SS_VERSION 0
+#define SS_VERSION 5
+
+struct ss_header_slot {
+  uint32_t seq;
+  uint32_t root;         // encoded like a reference, relative to header
+  uint32_t len;          // in words
+  uint32_t alloced;      // in words, since last gc, see ss_gc
+  uint32_t counts[16];
+  uint32_t full_len;     // in words, after the last full gc, or zero
+  uint32_t check_len;    // in words, at the end, covered by data_check
+  uint32_t data_check;   // crc32 of them
+  uint32_t generation;   // number of collections into a new file
+  uint32_t checksum;     // of the fields above
+};
 
 struct ss_header {
   uint32_t magic;
   uint32_t version;
 
-  uint32_t root;         // offset to start of header
-  uint32_t len;          // in words
-  uint32_t alloced;      // in words, since last gc
+  struct ss_header_slot slots[2];
+};
+
+/* The header of versions 2 to 4.
+ */
+struct ss_header_slot_v4 {
+  uint32_t seq;
+  uint32_t root;
+  uint32_t len;
+  uint32_t alloced;
+  uint32_t counts[16];
+  uint32_t checksum;
+};
+
+struct ss_header_v4 {
+  uint32_t magic;
+  uint32_t version;
+
+  struct ss_header_slot_v4 slots[2];
+};
+
+/* The header of versions 0 and 1.
+ */
+struct ss_header_v1 {
+  uint32_t magic;
+  uint32_t version;
+
+  uint32_t root;
+  uint32_t len;
+  uint32_t alloced;
   uint32_t counts[16];
 };
 
+static void
+ss_seal_slot (struct ss_header_slot *slot)
+{
+  slot->checksum = crc32 (0, (void *)slot,
+			  offsetof (struct ss_header_slot, checksum));
+}
+
+static bool
+ss_slot_valid (struct ss_header_slot *slot)
+{
+  return slot->checksum == crc32 (0, (void *)slot,
+				  offsetof (struct ss_header_slot, checksum));
+}
+
+static void
+ss_seal_slot_v4 (struct ss_header_slot_v4 *slot)
+{
+  slot->checksum = crc32 (0, (void *)slot,
+			  offsetof (struct ss_header_slot_v4, checksum));
+}
+
+static size_t
+ss_header_size (int version)
+{
+  return (version < 5
+	  ? sizeof (struct ss_header_v4)
+	  : sizeof (struct ss_header));
+}
+
+/* Copy slot INDEX of HEAD into SLOT, in the layout of version 5, and
+   return whether it is valid.
+ */
+static bool
+ss_get_slot (struct ss_header *head, int index, struct ss_header_slot *slot)
+{
+  if (head->version >= 5)
+    {
+      *slot = head->slots[index];
+      return ss_slot_valid (slot);
+    }
+  else
+    {
+      struct ss_header_v4 *head_v4 = (struct ss_header_v4 *)head;
+      struct ss_header_slot_v4 old = head_v4->slots[index];
+
+      slot->seq = old.seq;
+      slot->root = old.root;
+      slot->len = old.len;
+      slot->alloced = old.alloced;
+      for (int i = 0; i < 16; i++)
+	slot->counts[i] = old.counts[i];
+      slot->full_len = 0;
+      slot->check_len = 0;
+      slot->data_check = 0;
+      slot->generation = 0;
+      ss_seal_slot (slot);
+
+      return old.checksum == crc32 (0, (void *)&old,
+				    offsetof (struct ss_header_slot_v4,
+					      checksum));
+    }
+}
+
+/* Write SLOT as slot INDEX into the header of the file FD, in the
+   layout of VERSION.  Returns false on errors, with errno set.
+ */
+static bool
+ss_put_slot (int fd, int version, int index, struct ss_header_slot *slot)
+{
+  if (version >= 5)
+    return (pwrite (fd, slot, sizeof (*slot),
+		    offsetof (struct ss_header, slots[index]))
+	    == sizeof (*slot));
+  else
+    {
+      struct ss_header_slot_v4 old;
+
+      old.seq = slot->seq;
+      old.root = slot->root;
+      old.len = slot->len;
+      old.alloced = slot->alloced;
+      for (int i = 0; i < 16; i++)
+	old.counts[i] = slot->counts[i];
+      ss_seal_slot_v4 (&old);
+
+      return (pwrite (fd, &old, sizeof (old),
+		      offsetof (struct ss_header_v4, slots[index]))
+	      == sizeof (old));
+    }
+}
+
+#define SS_THREAD_LOCAL __thread __attribute__ ((tls_model ("initial-exec")))
+
 /* The ss_store type
  */
 
 static void ss_store_unref (dyn_type *, void *);
+static void ss_zcache_forget (ss_store ss);
 
 static int
 ss_store_equal (void *a, void *b)
@@ -136,24 +348,88 @@ struct ss_store_struct {
   char *filename;
 
   int fd;
+  int prot;
+  int version;
   size_t file_size;      // in bytes
+  size_t map_size;       // in bytes, how much of the file is mapped
+  size_t reserved_size;  // in bytes, address space reserved at head
   struct ss_header *head;
 
+  struct ss_header_slot slot;  // as committed when last looked
+  int slot_index;
+  bool pending;          // pending_root has not been committed yet
+  uint32_t pending_root;
   uint32_t *start;
   uint32_t *next;
   uint32_t *end;
   int alloced_words;
   uint32_t counts[16];
+  uint32_t full_len;
+  uint32_t generation;
+  uint32_t gc_backoff;   // see ss_maybe_gc_deferred
+
+  bool branch;           // see ss_branch
+  uint32_t base_len;     // in words, of the store that was branched
+  dev_t base_dev;
+  ino_t base_ino;
 };
 
 /* Opening stores.
+
+   A writable store reserves address space for MAX_SIZE bytes when it
+   is opened, but the file is only mapped into it in steps, as it
+   grows.  A read-only store only reserves what it needs.
+
+   References can reach 4 GiB, and that is the limit for a store on
+   64-bit hosts.  On 32-bit hosts, we can not reasonably reserve more
+   than 512 MiB.
  */
 
 static ss_store all_stores = NULL;
 
-#define MAX_SIZE    (512*1024*1024)
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define MAX_SIZE    ((size_t)4*1024*1024*1024)
+#else
+#define MAX_SIZE    ((size_t)512*1024*1024)
+#endif
 #define GROW_MASK   (2*1024*1024-1)
 //#define GROW_MASK    (4*1024-1)        // for testing
+#define PAGE_MASK   (4096-1)
+
+static void
+ss_reserve (ss_store ss, size_t size)
+{
+  size = (size + PAGE_MASK) & ~PAGE_MASK;
+  if (size == 0)
+    size = PAGE_MASK + 1;
+
+  ss->head = mmap (NULL, size, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ss->head == MAP_FAILED)
+    {
+      ss->head = NULL;
+      dyn_error ("Can't reserve memory for %s: %m", ss->filename);
+    }
+  ss->reserved_size = size;
+  ss->map_size = 0;
+}
+
+static void
+ss_map (ss_store ss, size_t size)
+{
+  size = (size + PAGE_MASK) & ~PAGE_MASK;
+  if (size > ss->reserved_size)
+    dyn_error ("%s has reached maximum size", ss->filename);
+
+  if (size > ss->map_size)
+    {
+      if (mmap ((char *)ss->head + ss->map_size, size - ss->map_size,
+		ss->prot, MAP_SHARED | MAP_FIXED, ss->fd, ss->map_size)
+	  == MAP_FAILED)
+	dyn_error ("Can't map %s: %m", ss->filename);
+      ss->map_size = size;
+    }
+}
 
 static void
 ss_grow (ss_store ss, size_t size)
@@ -162,54 +438,398 @@ ss_grow (ss_store ss, size_t size)
   if (size >= MAX_SIZE)
     dyn_error ("%s has reached maximum size", ss->filename);
 
-  if (size > ss->file_size)
+  if (size > ss->file_size && ss->branch)
+    {
+      if (mmap ((char *)ss->head + ss->map_size, size - ss->map_size,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+	  == MAP_FAILED)
+	dyn_error ("Can't grow %s: %m", ss->filename);
+      ss->file_size = ss->map_size = size;
+      ss->end = (uint32_t *)((char *)ss->head + ss->file_size);
+    }
+  else if (size > ss->file_size)
     {
       if (ftruncate (ss->fd, size) < 0)
 	dyn_error ("Can't grow %s: %m", ss->filename);
       ss->file_size = size;
+      ss_map (ss, size);
       ss->end = (uint32_t *)((char *)ss->head + ss->file_size);
     }
 }
 
+static void
+ss_lock (int fd, const char *filename)
+{
+  struct flock lock;
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 0;
+  lock.l_len = sizeof (struct ss_header);
+
+  if (fcntl (fd, F_SETLK, &lock) == -1)
+    dyn_error ("Can't lock %s: %m", filename);
+}
+
+/* Map all of the file of a read-only store again, after it has
+   grown.
+ */
+
+static void
+ss_remap (ss_store ss)
+{
+  struct stat buf;
+
+  munmap (ss->head, ss->reserved_size);
+  if (fstat (ss->fd, &buf) < 0)
+    dyn_error ("Can't stat %s: %m", ss->filename);
+  ss->file_size = buf.st_size;
+  ss_reserve (ss, ss->file_size);
+  ss_map (ss, ss->file_size);
+  ss->start = (uint32_t *)((char *)ss->head + ss_header_size (ss->version));
+  ss->end = (uint32_t *)((char *)ss->head + ss->file_size);
+}
+
+/* Whether the words that SLOT has committed are all there, see
+   ss_sync.
+ */
+
+static bool
+ss_slot_data_valid (ss_store ss, struct ss_header_slot *slot)
+{
+  uint32_t *end = ss->start + slot->len;
+
+  if (slot->check_len == 0)
+    return true;
+  if (slot->check_len > slot->len)
+    return false;
+
+  if (end > ss->end && !(ss->prot & PROT_WRITE))
+    ss_remap (ss);
+  if (end > ss->end)
+    return false;
+
+  end = ss->start + slot->len;
+  return slot->data_check == crc32 (0, (void *)(end - slot->check_len),
+				    slot->check_len * sizeof (uint32_t));
+}
+
+/* Find the current header slot and remember it.  A writer might be
+   busy with the other slot, and if it has been really busy, even
+   with the one we are looking at.  The checksum tells.  A slot whose
+   words didn't make it to the disk before a crash is not valid
+   either.
+ */
+
+static void
+ss_read_slot (ss_store ss)
+{
+  struct ss_header_slot a, b;
+
+  for (int tries = 0; tries < 1000; tries++)
+    {
+      bool a_valid = (ss_get_slot (ss->head, 0, &a)
+		      && ss_slot_data_valid (ss, &a));
+      bool b_valid = (ss_get_slot (ss->head, 1, &b)
+		      && ss_slot_data_valid (ss, &b));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+      if (a_valid && (!b_valid || (int32_t)(a.seq - b.seq) >= 0))
+	{
+	  ss->slot = a;
+	  ss->slot_index = 0;
+	  return;
+	}
+      else if (b_valid)
+	{
+	  ss->slot = b;
+	  ss->slot_index = 1;
+	  return;
+	}
+    }
+
+  dyn_error ("Corrupted struct-store header: %s", ss->filename);
+}
+
+/* Commit the new objects and ROOT_OFF.  The root is written into the
+   slot that is not current, with a plain pwrite instead of through
+   the read-only mapping, and synced together with the new objects.
+
+   A crash might still leave the slot on disk without all of the new
+   objects.  In version 5, the slot contains a checksum of them, and
+   is not valid when they don't match it.  In older versions, and
+   when there are more than SS_SYNC_CHECK_WORDS new words, the new
+   objects are synced on their own first instead, which costs another
+   round trip to the disk.
+
+   A branch only remembers the slot.
+ */
+
+#define SS_SYNC_CHECK_WORDS (256*1024)
+
 static void
 ss_sync (ss_store ss, uint32_t root_off)
 {
-  uint32_t *start = ss->start + ss->head->len;
+  uint32_t *start = ss->start + ss->slot.len;
   uint32_t *end = ss->next;
-  
-  if (end > start)
+  struct ss_header_slot slot;
+  int index = 1 - ss->slot_index;
+
+  slot.check_len = 0;
+  slot.data_check = 0;
+  if (ss->version >= 5 && end - start <= SS_SYNC_CHECK_WORDS)
+    {
+      slot.check_len = end - start;
+      slot.data_check = crc32 (0, (void *)start,
+			       slot.check_len * sizeof (uint32_t));
+    }
+  else if (end > start && !ss->branch)
     {
-      start = (uint32_t *)(((int)start) & ~4095);
+      start = (uint32_t *)(((uintptr_t)start) & ~PAGE_MASK);
 
       if (msync (start, (end - start)*sizeof(uint32_t), MS_SYNC) <0)
 	dyn_error ("Can't sync %s: %m", ss->filename);
     }
 
-  if (mmap (ss->head, sizeof (struct ss_header), PROT_READ | PROT_WRITE, 
-	    MAP_SHARED | MAP_FIXED, ss->fd, 0)
-      == MAP_FAILED)
-    dyn_error ("Can't write-enable header of %s: %m", ss->filename);
-  
-  ss->head->len = ss->next - ss->start;
-  ss->head->alloced = ss->alloced_words;
-  ss->head->root = root_off;
+  slot.seq = ss->slot.seq + 1;
+  slot.root = root_off;
+  slot.len = ss->next - ss->start;
+  slot.alloced = ss->alloced_words;
   for (int i = 0; i < 16; i++)
-    ss->head->counts[i] = ss->counts[i];
+    slot.counts[i] = ss->counts[i];
+  slot.full_len = ss->full_len;
+  slot.generation = ss->generation;
+  ss_seal_slot (&slot);
+
+  if (!ss->branch
+      && (!ss_put_slot (ss->fd, ss->version, index, &slot)
+	  || fdatasync (ss->fd) < 0))
+    dyn_error ("Can't commit %s: %m", ss->filename);
+
+  ss->slot = slot;
+  ss->slot_index = index;
+  ss->pending = false;
+}
+
+/* Upgrading from format versions 0 and 1.
+
+   For version 0, the references of all reachable objects are
+   rewritten from byte offsets to word offsets.  This happens in a
+   private mapping of the file.  Unreachable objects are left alone;
+   they will never be looked at.  The garbage collection bit is used
+   to mark objects that have been visited already.  Objects don't move
+   relative to each other, so dictionaries don't need to be rehashed.
+
+   The header of version 1 has only a single slot.  All objects are
+   moved up to make room for the second one, which only changes the
+   root, the other references are relative.
+
+   The result is assembled in memory.  A read-only store just keeps
+   using it, a writable store writes it to a new file which then
+   replaces the old one.
+ */
+
+static uint32_t *
+ss_upgrade_decode (ss_store ss, struct ss_header_v1 *old,
+		   void *from, uint32_t word)
+{
+  uint32_t *obj, *start = (uint32_t *)(old + 1);
+
+  if (word == 0 || (word & 3) == 3)
+    return NULL;
+
+  obj = (uint32_t *)((char *)from + (int32_t)word);
+  if (obj < start || obj >= start + old->len)
+    dyn_error ("Corrupted struct-store: %s", ss->filename);
+  return obj;
+}
+
+static void
+ss_upgrade_refs (ss_store ss, struct ss_header_v1 *old)
+{
+  uint32_t **objs = NULL;
+  int n_objs = 0, capacity = 0;
+
+  void mark (uint32_t *obj)
+  {
+    if (obj && !SS_IS_FORWARD (obj))
+      {
+	if (SS_IS_UNSTORED (obj))
+	  dyn_error ("Object too large for format version %d in %s",
+		     SS_VERSION, ss->filename);
+	obj[0] |= 0x80000000;
+	objs = dyn_mgrow (objs, &capacity, sizeof (uint32_t *), n_objs + 1);
+	objs[n_objs++] = obj;
+      }
+  }
+
+  uint32_t *root = ss_upgrade_decode (ss, old, old, old->root);
+  mark (root);
+
+  for (int i = 0; i < n_objs; i++)
+    {
+      uint32_t *obj = objs[i];
+      if (SS_TAG (obj) != SS_BLOB_TAG)
+	for (int j = 1; j <= SS_LEN (obj); j++)
+	  {
+	    uint32_t *ref = ss_upgrade_decode (ss, old, obj, obj[j]);
+	    if (ref)
+	      {
+		mark (ref);
+		obj[j] = ss_encode_ref (obj, (ss_val)ref);
+	      }
+	  }
+    }
+
+  for (int i = 0; i < n_objs; i++)
+    objs[i][0] &= ~0x80000000;
+  free (objs);
+
+  if (root)
+    old->root = ss_encode_ref (old, (ss_val)root);
+  old->version = 1;
+}
+
+static void
+ss_upgrade (ss_store ss, int mode)
+{
+  struct ss_header_v1 *old;
+  struct ss_header_v4 *head;
+  size_t data_size, size;
+  uint32_t shift;
+  char *newfile;
+  int fd;
 
-  if (msync (ss->head, sizeof (struct ss_header), MS_ASYNC) < 0)
-    dyn_error ("Can't sync %s header: %m", ss->filename);
+  if (ss->file_size < sizeof (struct ss_header_v1))
+    dyn_error ("Not a struct-store file: %s", ss->filename);
 
-  if (mmap (ss->head, sizeof (struct ss_header), PROT_READ, 
-	    MAP_SHARED | MAP_FIXED, ss->fd, 0)
+  if (mmap (ss->head, ss->map_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_FIXED, ss->fd, 0)
       == MAP_FAILED)
-    dyn_error ("Can't write-protect header of %s: %m", ss->filename);
+    dyn_error ("Can't disconnect from %s: %m", ss->filename);
+
+  old = (struct ss_header_v1 *)ss->head;
+  if (old->version == 0)
+    ss_upgrade_refs (ss, old);
+
+  data_size = ss->file_size - sizeof (struct ss_header_v1);
+  size = sizeof (struct ss_header_v4) + data_size;
+  shift = ((sizeof (struct ss_header_v4) - sizeof (struct ss_header_v1))
+	   / sizeof (uint32_t));
+
+  head = dyn_malloc (size);
+  memset (head, 0, sizeof (struct ss_header_v4));
+  head->magic = SS_MAGIC;
+  head->version = 2;
+  head->slots[0].root = old->root;
+  if (old->root != 0 && (old->root & 1) == 0)
+    head->slots[0].root += shift << 1;
+  head->slots[0].len = old->len;
+  head->slots[0].alloced = old->alloced;
+  for (int i = 0; i < 16; i++)
+    head->slots[0].counts[i] = old->counts[i];
+  ss_seal_slot_v4 (&head->slots[0]);
+  head->slots[1] = head->slots[0];
+  memcpy (head + 1, old + 1, data_size);
+
+  if (mode == SS_READ)
+    {
+      munmap (ss->head, ss->reserved_size);
+      ss_reserve (ss, size);
+      if (mprotect (ss->head, size, PROT_READ | PROT_WRITE) < 0)
+	dyn_error ("Can't map %s: %m", ss->filename);
+      memcpy (ss->head, head, size);
+      mprotect (ss->head, size, PROT_READ);
+      ss->map_size = ss->reserved_size;
+    }
+  else
+    {
+      asprintf (&newfile, "%s.upgrade", ss->filename);
+      fd = open (newfile, O_RDWR | O_CREAT | O_TRUNC, 0666);
+      if (fd < 0)
+	dyn_error ("Can't open %s: %m", newfile);
+      ss_lock (fd, newfile);
+
+      char *ptr = (char *)head;
+      size_t n = size;
+      while (n > 0)
+	{
+	  ssize_t w = write (fd, ptr, n);
+	  if (w < 0)
+	    dyn_error ("Can't write %s: %m", newfile);
+	  ptr += w;
+	  n -= w;
+	}
+
+      if (fsync (fd) < 0)
+	dyn_error ("Can't sync %s: %m", newfile);
+      if (rename (newfile, ss->filename) < 0)
+	dyn_error ("Can't rename %s to %s: %m", newfile, ss->filename);
+      free (newfile);
+
+      close (ss->fd);
+      ss->fd = fd;
+      ss->map_size = 0;
+      ss_map (ss, size);
+    }
+
+  free (head);
+  ss->file_size = size;
+  ss->start = (uint32_t *)((struct ss_header_v4 *)ss->head + 1);
+  ss->end = (uint32_t *)((char *)ss->head + ss->file_size);
 }
 
-ss_store 
-ss_open (const char *filename, int mode)
+/* Starting over with an empty file.  Readers might still be using
+   the old one, so it is replaced instead of truncated.
+ */
+
+static void
+ss_replace_file (ss_store ss)
+{
+  char *newfile;
+  int fd;
+
+  asprintf (&newfile, "%s.new", ss->filename);
+  fd = open (newfile, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    dyn_error ("Can't open %s: %m", newfile);
+  ss_lock (fd, newfile);
+  if (rename (newfile, ss->filename) < 0)
+    dyn_error ("Can't rename %s to %s: %m", newfile, ss->filename);
+  free (newfile);
+
+  close (ss->fd);
+  ss->fd = fd;
+}
+
+static bool ss_gc_deferred_adopt (const char *filename, int fd,
+				  bool *discarded);
+
+/* Readers and writers.
+
+   Any number of readers can have a store open while a single writer
+   modifies it.  Readers don't lock anything.
+
+   Objects are never modified once they are written, and a writer
+   only ever appends to the file.  A new root is written into the
+   header slot that is not current, and a reader takes a snapshot of
+   the current one when opening the store and never looks at the
+   header again.  Thus, a reader sees a consistent state, no matter
+   what the writer does in the meantime.
+
+   A garbage collection or ss_open with SS_TRUNC replaces the file with
+   a new one instead of modifying it, and readers keep using the old
+   one.
+ */
+
+/* New files get format version VERSION, which is 2 or later.
+ */
+
+static ss_store
+ss_open_version (const char *filename, int mode, int version)
 {
   struct stat buf;
-  int prot;
+  bool discarded = false;
 
   ss_store ss;
 
@@ -218,10 +838,16 @@ ss_open (const char *filename, int mode)
   ss->filename = dyn_strdup (filename);
   ss->head = NULL;
   ss->file_size = 0;
+  ss->map_size = 0;
+  ss->reserved_size = 0;
   ss->start = NULL;
   ss->next = NULL;
   ss->end = NULL;
   ss->alloced_words = 0;
+  ss->full_len = 0;
+  ss->generation = 0;
+  ss->gc_backoff = 0;
+  ss->pending = false;
 
   if (mode == SS_READ)
     ss->fd = open (filename, O_RDONLY);
@@ -232,35 +858,26 @@ ss_open (const char *filename, int mode)
     dyn_error ("Can't open %s: %m", filename);
 
   if (mode != SS_READ)
-    {
-      struct flock lock;
-      lock.l_type = F_WRLCK;
-      lock.l_whence = SEEK_SET;
-      lock.l_start = 0;
-      lock.l_len = sizeof (struct ss_header);
+    ss_lock (ss->fd, filename);
 
-      if (fcntl (ss->fd, F_SETLK, &lock) == -1)
-	dyn_error ("Can't lock %s: %m", filename);
+  if (mode == SS_WRITE && ss_gc_deferred_adopt (filename, ss->fd,
+						 &discarded))
+    {
+      close (ss->fd);
+      ss->fd = open (filename, O_RDWR);
+      if (ss->fd < 0)
+	dyn_error ("Can't open %s: %m", filename);
+      ss_lock (ss->fd, filename);
     }
 
   if (mode == SS_READ)
-    prot = PROT_READ;
+    ss->prot = PROT_READ;
   else
-    prot = PROT_READ | PROT_WRITE;
-
-  ss->head = mmap (NULL, MAX_SIZE, prot, MAP_SHARED,
-		   ss->fd, 0);
-  if (ss->head == MAP_FAILED)
-    dyn_error ("Can't map %s: %m", ss->filename);
+    ss->prot = PROT_READ | PROT_WRITE;
 
-#if 0
-  if (((unsigned long)ss->head) > (0x80000000 - MAX_SIZE))
-    dyn_error ("Map too high: %x", ss->head);
-#endif
-    
   if (mode == SS_TRUNC)
     {
-      ftruncate (ss->fd, 0);
+      ss_replace_file (ss);
       ss->file_size = 0;
     }
   else
@@ -269,41 +886,79 @@ ss_open (const char *filename, int mode)
       ss->file_size = buf.st_size;
     }
 
-  ss->start = (uint32_t *)(ss->head + 1);
+  if (mode == SS_READ)
+    ss_reserve (ss, ss->file_size);
+  else
+    ss_reserve (ss, MAX_SIZE);
+  ss_map (ss, ss->file_size);
+
   ss->end = (uint32_t *)((char *)ss->head + ss->file_size);
 
   if ((ss->file_size == 0 && mode == SS_WRITE) || mode == SS_TRUNC)
     {
-      ss_grow (ss, sizeof (struct ss_header));
-      memset (ss->head, 0, sizeof (struct ss_header));
+      ss_grow (ss, ss_header_size (version));
+      memset (ss->head, 0, ss_header_size (version));
 
       ss->head->magic = SS_MAGIC;
-      ss->head->version = SS_VERSION;
-      ss->head->root = 0;
-      ss->head->len = 0;
-      ss->head->alloced = 0;
-      for (int i = 0; i < 16; i++)
-	ss->head->counts[i] = 0;
-    }
+      ss->head->version = version;
+      if (version >= 5)
+	{
+	  ss_seal_slot (&ss->head->slots[0]);
+	  ss_seal_slot (&ss->head->slots[1]);
+	}
+      else
+	{
+	  struct ss_header_v4 *head_v4 = (struct ss_header_v4 *)ss->head;
+	  ss_seal_slot_v4 (&head_v4->slots[0]);
+	  ss_seal_slot_v4 (&head_v4->slots[1]);
+	}
+    }
   else
     {
-      if (ss->file_size < sizeof (struct ss_header)
+      if (ss->file_size < 2 * sizeof (uint32_t)
 	  || ss->head->magic != SS_MAGIC)
 	dyn_error ("Not a struct-store file: %s", ss->filename);
 
-      if (ss->head->version != SS_VERSION)
+      if (ss->head->version < 2)
+	ss_upgrade (ss, mode);
+      else if (ss->head->version > SS_VERSION)
 	dyn_error ("Unsupported struct-store format version in %s.  "
 		   "Found %d, expected %d.",
 		   ss->filename, ss->head->version, SS_VERSION);
+      else if (ss->file_size < ss_header_size (ss->head->version))
+	dyn_error ("Not a struct-store file: %s", ss->filename);
     }
 
-  ss->next = (uint32_t *)(((uint32_t)(ss->start + ss->head->len)+4095) & ~4095);
-  for (int i = 0; i < 16; i++)
-    ss->counts[i] = ss->head->counts[i];
+  ss->version = ss->head->version;
+  ss->start = (uint32_t *)((char *)ss->head + ss_header_size (ss->version));
+  ss_read_slot (ss);
 
-  if (mmap (ss->head, (uint32_t)ss->next - (uint32_t)ss->head, PROT_READ, 
-	    MAP_SHARED | MAP_FIXED, ss->fd, 0)
-      == MAP_FAILED)
+  if (mode == SS_READ
+      && (ss_header_size (ss->version) + ss->slot.len * sizeof (uint32_t)
+	  > ss->file_size))
+    {
+      /* The file has grown since we looked at its size.
+       */
+      ss_remap (ss);
+    }
+
+  /* The padding counts as allocated, so that the old generation
+     always ends at HEAD->LEN - HEAD->ALLOCED.  See ss_gc.
+  */
+  ss->next = (uint32_t *)((((uintptr_t)(ss->start + ss->slot.len))
+			   + PAGE_MASK) & ~PAGE_MASK);
+  ss->alloced_words = (ss->slot.alloced
+		       + (ss->next - (ss->start + ss->slot.len)));
+  for (int i = 0; i < 16; i++)
+    ss->counts[i] = ss->slot.counts[i];
+  ss->full_len = ss->slot.full_len;
+  ss->generation = ss->slot.generation;
+  if (discarded)
+    ss->gc_backoff = ss->alloced_words;
+
+  if (mode != SS_READ
+      && mprotect (ss->head, (char *)ss->next - (char *)ss->head, PROT_READ)
+      < 0)
     dyn_error ("Can't write-protect %s: %m", ss->filename);
 
   ss->next_store = all_stores;
@@ -312,6 +967,12 @@ ss_open (const char *filename, int mode)
   return ss;
 }
 
+ss_store 
+ss_open (const char *filename, int mode)
+{
+  return ss_open_version (filename, mode, SS_VERSION);
+}
+
 static void
 ss_store_unref (dyn_type *type, void *object)
 {
@@ -326,7 +987,10 @@ ss_store_unref (dyn_type *type, void *object)
       }
 
   if (ss->head)
-    munmap (ss->head, MAX_SIZE);
+    {
+      ss_zcache_forget (ss);
+      munmap (ss->head, ss->reserved_size);
+    }
 
   close (ss->fd);
   free (ss->filename);
@@ -338,7 +1002,7 @@ ss_find_object_store (ss_val o)
   ss_store ss;
 
   for (ss = all_stores; ss; ss = ss->next_store)
-    if ((char *)(ss->head + 1) <= (char *)o && (char *)o < (char *)ss->next)
+    if ((char *)ss->start <= (char *)o && (char *)o < (char *)ss->next)
       return ss;
   fprintf (stderr, "Object without store, aborting.\n");
   abort ();
@@ -350,37 +1014,44 @@ ss_find_object_store (ss_val o)
 ss_val 
 ss_get_root (ss_store ss)
 {
-  if (ss->head->root == 0 || SS_IS_INT (ss->head->root))
-    return (ss_val )ss->head->root;
-  else
-    return (ss_val )((char *)(ss->head) + ss->head->root);
+  if (ss->pending)
+    return ss_decode_ref (ss->head, ss->pending_root);
+  return ss_decode_ref (ss->head, ss->slot.root);
 }
 
 void
 ss_set_root (ss_store ss, ss_val root)
 {
-  uint32_t off;
+  ss_sync (ss, ss_encode_ref (ss->head, root));
+}
 
-  if (root == NULL || SS_IS_INT (root))
-    off = (uint32_t)root;
-  else
-    off = (char *)root - (char *)(ss->head);
+void
+ss_set_root_relaxed (ss_store ss, ss_val root)
+{
+  if (!(ss->prot & PROT_WRITE))
+    dyn_error ("%s is read-only", ss->filename);
+
+  ss->pending_root = ss_encode_ref (ss->head, root);
+  ss->pending = true;
+}
 
-  ss_sync (ss, off);
+void
+ss_flush (ss_store ss)
+{
+  if (ss->pending)
+    ss_sync (ss, ss->pending_root);
 }
 
 /* Allocating new objects.
  */
 
-static uint32_t *ss_alloc_unstored (size_t words);
-
 static uint32_t *
 ss_alloc (ss_store ss, size_t words)
 {
   uint32_t *obj, *new_next;
 
-  if (ss == NULL)
-    return ss_alloc_unstored (words);
+  if (!(ss->prot & PROT_WRITE))
+    dyn_error ("%s is read-only", ss->filename);
 
   new_next = ss->next + words;
   ss->alloced_words += words;
@@ -409,6 +1080,365 @@ ss_assert_in_store (ss_store ss, ss_val obj)
   dyn_error ("Rogue pointer.");
 }
     
+/* Branches
+
+   A branch has its own address space, like any open store, and the
+   file of the store that it branches from is mapped read-only at the
+   beginning of it, up to the end of the last page in use.  New objects
+   are allocated after that, in anonymous memory.  Thus, the old
+   objects have the same offsets in the branch as in the file, and
+   nothing needs to be copied, neither when making the branch nor when
+   promoting it.
+
+   The store that was branched can keep changing, since it only
+   appends to its file.  But its new objects are not visible in the
+   branch, and once it has allocated anything, the branch can no
+   longer be promoted: its new objects would need the same offsets.
+ */
+
+ss_store
+ss_branch (ss_store ss, ss_val root)
+{
+  struct stat buf;
+  ss_store br;
+  size_t base_size;
+
+  if (ss->branch)
+    dyn_error ("Can't branch %s", ss->filename);
+  if (root && !ss_is_int (root) && !ss_is_stored (ss, root))
+    dyn_error ("Root of branch is not in %s", ss->filename);
+
+  br = dyn_new (ss_store);
+  asprintf (&br->filename, "%s (branch)", ss->filename);
+  br->fd = dup (ss->fd);
+  if (br->fd < 0 || fstat (br->fd, &buf) < 0)
+    dyn_error ("Can't branch %s: %m", ss->filename);
+  br->base_dev = buf.st_dev;
+  br->base_ino = buf.st_ino;
+  br->branch = true;
+  br->prot = PROT_READ | PROT_WRITE;
+  br->version = ss->version;
+  br->base_len = ss->next - ss->start;
+
+  base_size = (((char *)ss->next - (char *)ss->head + PAGE_MASK)
+	       & ~PAGE_MASK);
+  ss_reserve (br, MAX_SIZE);
+  if (base_size > (size_t)buf.st_size
+      || mmap (br->head, base_size, PROT_READ, MAP_SHARED | MAP_FIXED,
+	       br->fd, 0) == MAP_FAILED)
+    dyn_error ("Can't branch %s: %m", ss->filename);
+
+  /* An upgraded store that hasn't been written back can't be
+     branched, its file is still in the old format.
+   */
+  if (memcmp (br->head, ss->head, ss_header_size (ss->version)) != 0)
+    dyn_error ("Can't branch %s", ss->filename);
+
+  br->file_size = br->map_size = base_size;
+  br->start = (uint32_t *)((char *)br->head + ss_header_size (br->version));
+  br->next = br->end = (uint32_t *)((char *)br->head + base_size);
+  br->alloced_words = ss->alloced_words + (br->next - br->start
+					   - br->base_len);
+  for (int i = 0; i < 16; i++)
+    br->counts[i] = ss->counts[i];
+  br->full_len = ss->full_len;
+  br->generation = ss->generation;
+
+  br->slot = ss->slot;
+  br->slot.root = ss_encode_ref (ss->head, root);
+  br->slot.len = br->next - br->start;
+  br->slot.alloced = br->alloced_words;
+
+  br->next_store = all_stores;
+  all_stores = br;
+
+  return br;
+}
+
+void
+ss_promote_branch (ss_store ss, ss_store br)
+{
+  struct stat buf;
+
+  if (!br->branch)
+    dyn_error ("%s is not a branch", br->filename);
+  if (!(ss->prot & PROT_WRITE))
+    dyn_error ("%s is read-only", ss->filename);
+  if (fstat (ss->fd, &buf) < 0
+      || buf.st_dev != br->base_dev || buf.st_ino != br->base_ino
+      || ss->next - ss->start != br->base_len)
+    dyn_error ("%s has changed since the branch was made", ss->filename);
+
+  /* The rest of the last page of SS is not part of the branch, it
+     becomes padding.
+   */
+  uint32_t *base_end = br->start + br->base_len;
+  uint32_t *new_start = (uint32_t *)(((uintptr_t)base_end + PAGE_MASK)
+				     & ~PAGE_MASK);
+
+  if (br->next > new_start)
+    {
+      size_t n_pad = new_start - base_end, n_new = br->next - new_start;
+      uint32_t *to = ss_alloc (ss, n_pad + n_new);
+      memset (to, 0, n_pad * sizeof (uint32_t));
+      memcpy (to + n_pad, new_start, n_new * sizeof (uint32_t));
+    }
+
+  for (int i = 0; i < 16; i++)
+    ss->counts[i] = br->counts[i];
+  ss_sync (ss, br->pending? br->pending_root : br->slot.root);
+}
+
+/* Deltas
+
+   A delta contains the objects that are reachable from a new root but
+   not from an old one, together with the new root.  Importing it into
+   a copy of the store that has the old root as its current root
+   brings that copy to the new root.
+
+   The objects keep their offsets, just like with branches: references
+   between them are relative and don't need to be touched, and
+   dictionaries, which hash objects by their offset, stay valid.  Thus
+   a delta is a list of runs of words, each with the offset where it
+   goes.  The importer only writes over words that are zero (unused)
+   or already have the same contents.  Objects that precede the old
+   end of the store are included when they are not reachable from the
+   old root, since the copy might not have them.
+
+   A collection into a new file moves objects, and a copy made before
+   it has them at other offsets.  Such a copy must not get any deltas
+   from after the collection, and the importer refuses them by
+   comparing the generations of both stores.  Minor collections in
+   place only append, and don't matter.
+
+   The file is compressed with zlib and looks like this:
+
+     struct ss_delta_header
+     uint32_t offset, len; uint32_t words[len];   repeated
+     uint32_t 0, 0;
+ */
+
+#define SS_DELTA_MAGIC 0x544C4453 /* SDLT */
+
+struct ss_delta_header {
+  uint32_t magic;
+  uint32_t version;      // of the store
+  uint32_t generation;   // of the store, see ss_header_slot
+  uint32_t base_root;    // encoded like a reference, relative to header
+  uint32_t base_check;   // crc32 of the words of the base root
+  uint32_t root;
+  uint32_t counts[16];
+};
+
+static uint32_t
+ss_delta_check (ss_val root)
+{
+  if (root == NULL || ss_is_int (root))
+    return 0;
+  return crc32 (0, (void *)root, (SS_LEN (root) + 1) * sizeof (uint32_t));
+}
+
+void
+ss_export_delta (ss_store ss, ss_val old_root, ss_val new_root,
+		 const char *filename)
+{
+  size_t n_words = ss->next - ss->start;
+  uint8_t *old = dyn_calloc (n_words / 8 + 1);
+  uint8_t *new = dyn_calloc (n_words / 8 + 1);
+  ss_val *stack = NULL;
+  int n_stack = 0, stack_capacity = 0;
+
+#define MARKED(m,i) ((m)[(i)>>3] & (1 << ((i)&7)))
+#define MARK(m,i)   ((m)[(i)>>3] |= (1 << ((i)&7)))
+
+  void mark (uint8_t *marks, uint8_t *except, ss_val root)
+  {
+    void push (ss_val v)
+    {
+      if (v == NULL || ss_is_int (v))
+	return;
+      if (!ss_is_stored (ss, v))
+	dyn_error ("Object not in %s", ss->filename);
+      size_t i = (uint32_t *)v - ss->start;
+      if (MARKED (marks, i) || (except && MARKED (except, i)))
+	return;
+      MARK (marks, i);
+      stack = dyn_mgrow (stack, &stack_capacity, sizeof (ss_val),
+			 n_stack + 1);
+      stack[n_stack++] = v;
+    }
+
+    push (root);
+    while (n_stack > 0)
+      {
+	ss_val v = stack[--n_stack];
+	if (!SS_IS_RAW (v))
+	  for (int i = 0; i < SS_LEN (v); i++)
+	    push (ss_ref (v, i));
+      }
+  }
+
+  mark (old, NULL, old_root);
+  mark (new, old, new_root);
+  free (stack);
+  free (old);
+
+  gzFile f = gzopen (filename, "wb");
+  if (f == NULL)
+    dyn_error ("Can't create %s: %m", filename);
+
+  void put (void *data, size_t size)
+  {
+    if (size > 0 && gzwrite (f, data, size) != (int)size)
+      dyn_error ("Can't write %s", filename);
+  }
+
+  struct ss_delta_header head;
+  head.magic = SS_DELTA_MAGIC;
+  head.version = ss->version;
+  head.generation = ss->generation;
+  head.base_root = ss_encode_ref (ss->head, old_root);
+  head.base_check = ss_delta_check (old_root);
+  head.root = ss_encode_ref (ss->head, new_root);
+  for (int i = 0; i < 16; i++)
+    head.counts[i] = ss->counts[i];
+  put (&head, sizeof (head));
+
+  size_t i = 0;
+  while (i < n_words)
+    {
+      if (!MARKED (new, i))
+	{
+	  i++;
+	  continue;
+	}
+
+      /* Collect objects that follow each other into one run.
+       */
+      uint32_t run[2];
+      run[0] = i;
+      while (i < n_words && MARKED (new, i))
+	{
+	  ss_val v = (ss_val)(ss->start + i);
+	  i += 1 + (SS_IS_RAW (v)
+		    ? SS_BLOB_LEN_TO_WORDS (SS_LEN (v))
+		    : SS_LEN (v));
+	}
+      run[1] = i - run[0];
+      put (run, sizeof (run));
+      put (ss->start + run[0], run[1] * sizeof (uint32_t));
+    }
+
+  uint32_t end[2] = { 0, 0 };
+  put (end, sizeof (end));
+  free (new);
+
+  if (gzclose (f) != Z_OK)
+    dyn_error ("Can't write %s", filename);
+
+#undef MARKED
+#undef MARK
+}
+
+void
+ss_import_delta (ss_store ss, const char *filename)
+{
+  struct ss_delta_header head;
+  uint32_t *buf = NULL;
+  int buf_capacity = 0;
+
+  if (!(ss->prot & PROT_WRITE) || ss->branch)
+    dyn_error ("%s is read-only", ss->filename);
+
+  gzFile f = gzopen (filename, "rb");
+  if (f == NULL)
+    dyn_error ("Can't open %s: %m", filename);
+
+  void get (void *data, size_t size)
+  {
+    if (gzread (f, data, size) != (int)size)
+      {
+	gzclose (f);
+	dyn_error ("Truncated or corrupted delta: %s", filename);
+      }
+  }
+
+  get (&head, sizeof (head));
+  if (head.magic != SS_DELTA_MAGIC || head.version != ss->version)
+    {
+      gzclose (f);
+      dyn_error ("Not a delta for %s: %s", ss->filename, filename);
+    }
+
+  if (head.generation != ss->generation)
+    {
+      gzclose (f);
+      dyn_error ("%s is from generation %d of its store, but %s is "
+		 "at generation %d; one of them has been collected",
+		 filename, head.generation, ss->filename, ss->generation);
+    }
+
+  ss_val root = ss_get_root (ss);
+  if (head.base_root != ss_encode_ref (ss->head, root)
+      || head.base_check != ss_delta_check (root))
+    {
+      gzclose (f);
+      dyn_error ("%s does not have the base root of %s",
+		 ss->filename, filename);
+    }
+
+  while (true)
+    {
+      uint32_t run[2];
+      get (run, sizeof (run));
+      if (run[1] == 0)
+	break;
+
+      uint32_t *to = ss->start + run[0];
+      if (to + run[1] > ss->start + (MAX_SIZE / sizeof (uint32_t)))
+	{
+	  gzclose (f);
+	  dyn_error ("Corrupted delta: %s", filename);
+	}
+
+      buf = dyn_mgrow (buf, &buf_capacity, sizeof (uint32_t), run[1]);
+      get (buf, run[1] * sizeof (uint32_t));
+
+      if (to + run[1] > ss->next)
+	{
+	  size_t n = to + run[1] - ss->next;
+	  memset (ss_alloc (ss, n), 0, n * sizeof (uint32_t));
+	}
+
+      for (uint32_t j = 0; j < run[1]; j++)
+	if (to[j] != 0 && to[j] != buf[j])
+	  {
+	    gzclose (f);
+	    dyn_error ("%s does not match %s", ss->filename, filename);
+	  }
+
+      /* The beginning of the run might be in the write-protected
+	 part of the mapping.
+       */
+      if (pwrite (ss->fd, buf, run[1] * sizeof (uint32_t),
+		  (char *)to - (char *)ss->head)
+	  != (ssize_t)(run[1] * sizeof (uint32_t)))
+	{
+	  gzclose (f);
+	  dyn_error ("Can't write %s: %m", ss->filename);
+	}
+    }
+
+  free (buf);
+  gzclose (f);
+
+  if (fdatasync (ss->fd) < 0)
+    dyn_error ("Can't sync %s: %m", ss->filename);
+  for (int i = 0; i < 16; i++)
+    ss->counts[i] = head.counts[i];
+  ss_sync (ss, head.root);
+}
+
 /* Collecting garbage
  *
  * We use a simple copying collector.  It uses a a lot of temporary
@@ -431,13 +1461,61 @@ ss_assert_in_store (ss_store ss, ss_val obj)
  * tables might not have a forwarding pointer yet (because copying has
  * been delayed).
  *
+ * Until an object in the to-store has been scanned, its references
+ * still point into the from-store, which might be further away than
+ * a reference can reach.  These references are stored as word
+ * offsets into the from-store instead, marked with the otherwise
+ * unused bit pattern 01 in the lowest two bits.
+ *
  * The GC then happens in three phases: first the root and all
  * referenced objects except tables and dictionaries with weak
- * references are copied; then a couple of rounds are made over the
- * dictionaries until the ripples have settled; then the delayed
+ * references are copied; then the ripples through the weak
+ * dictionaries are followed until they have settled; then the delayed
  * tables and dictionaries are copied.
+ *
+ * The entries of weak dictionaries are ephemerons: a weak key keeps
+ * its value alive, and an element of a weak set keeps its key alive,
+ * but only as long as the key or element is alive itself.  Each entry
+ * is looked at once, when its dictionary is delayed.  If it is still
+ * waiting for its key or element, it is remembered in a table and
+ * looked at again when that object is copied.  Thus, following the
+ * ripples takes time proportional to the number of entries, no matter
+ * how long the chains of dependencies are.
+ *
+ * The collector runs in the calling thread.  Only the sorting of the
+ * entries of big dictionaries is spread over a pool of worker threads,
+ * for all the dictionaries that are waiting to be rebuilt at the same
+ * time, see ss_gc_flush_rebuilds.
+ *
+ * Objects are copied depth-first as far as possible, see
+ * ss_gc_scan_object, so that objects that are used together end up
+ * close together.  Compressed blobs are delayed like weak tables,
+ * although they are not weak: they are big and rarely looked at, and
+ * copying them last keeps them out of the way.
+ *
+ * There are two generations.  Everything that survived the previous
+ * collection is in the old generation, and everything allocated since
+ * then is in the young generation.  The old generation is simply the
+ * beginning of the store, up to HEAD->LEN - HEAD->ALLOCED words.
+ *
+ * A minor collection only collects the young generation: the old
+ * generation stays where it is, and the copying stops at old objects.
+ * This is possible since objects can't be modified: old objects can't
+ * refer to young ones.  Since old objects don't move, dictionaries
+ * only need to rehash entries with young keys, and their nodes in the
+ * old generation are not copied at all.  Old objects are always
+ * considered alive by a minor collection, thus garbage in the old
+ * generation is only removed by a full collection.
+ *
+ * Normally, a minor collection appends the survivors to the store
+ * itself, see ss_gc_minor_in_place.  A deferred one can't do that and
+ * copies the old generation verbatim into a new file instead, at the
+ * same offsets.
  */
 
+#define SET_TAG                0x74
+#define SET_DISPATCH_TAG       0x75
+#define SET_SEARCH_TAG         0x76
 #define WEAK_SETS_DISPATCH_TAG 0x77
 #define WEAK_SETS_SEARCH_TAG   0x78
 #define WEAK_DICT_DISPATCH_TAG 0x79
@@ -446,21 +1524,133 @@ ss_assert_in_store (ss_store ss, ss_val obj)
 #define DICT_SEARCH_TAG        0x7C
 #define TAB_DISPATCH_TAG       0x7D
 #define TAB_SEARCH_TAG         0x7E
+#define VEC_TAG                SS_VEC_TAG
+
+#define BITS_PER_LEVEL 5
+#define LEVEL_MASK     ((1<<BITS_PER_LEVEL)-1)
+
+#define SS_GC_PENDING(off)       (((off) << 2) | 1)
+#define SS_IS_GC_PENDING(w)      (((w) & 3) == 1)
+#define SS_GC_PENDING_OFFSET(w)  ((w) >> 2)
 
-#define MAX_DELAYED 1024
+/* A hash table from objects in the from-store to ints, with zero
+   meaning absent.
+ */
+typedef struct {
+  int size, count;
+  ss_val *keys;
+  int *vals;
+} ss_gc_map;
+
+/* TARGET must be copied once TRIGGER has been.  NEXT links the
+   ephemerons with the same trigger, starting from the index in the
+   waiting map.  Indices are off by one.
+ */
+typedef struct {
+  ss_val target;
+  int next;
+} ss_gc_ephemeron;
 
 typedef struct {
   ss_store from_store;
   ss_store to_store;
+  bool minor;
+  uint32_t *old_end;    // end of the old generation in from_store
+  uint32_t *copy_start; // where the copies start in to_store
   int phase;
-  int again;
-  int n_delayed;
-  ss_val delayed[MAX_DELAYED];
+  size_t scanned;       // words of to_store that have been scanned
+
+  int n_delayed, delayed_capacity;
+  ss_val *delayed;
+  ss_gc_map delayed_map;
+  int n_registered;     // delayed dicts whose entries have been looked at
+
+  int n_ephemerons, ephemerons_capacity;
+  ss_gc_ephemeron *ephemerons;
+  ss_gc_map waiting;
+
+  int n_work, work_capacity;
+  ss_val *work;
+
+  int n_rebuilds, rebuilds_capacity;
+  struct ss_rehash_job *rebuilds;
+  ss_gc_map rebuild_map;
 } ss_gc_data;
 
+static int *
+ss_gc_map_ref (ss_gc_map *m, ss_val key)
+{
+  if (2 * (m->count + 1) > m->size)
+    {
+      ss_gc_map old = *m;
+
+      m->size = old.size? 2 * old.size : 256;
+      m->count = 0;
+      m->keys = dyn_calloc (m->size * sizeof (ss_val));
+      m->vals = dyn_calloc (m->size * sizeof (int));
+      for (int i = 0; i < old.size; i++)
+	if (old.keys[i])
+	  *ss_gc_map_ref (m, old.keys[i]) = old.vals[i];
+      free (old.keys);
+      free (old.vals);
+    }
+
+  uint32_t i = ((uintptr_t)key >> 2) * 0x9E3779B1;
+  while (true)
+    {
+      i &= m->size - 1;
+      if (m->keys[i] == key)
+	return &m->vals[i];
+      if (m->keys[i] == NULL)
+	{
+	  m->keys[i] = key;
+	  m->count++;
+	  return &m->vals[i];
+	}
+      i++;
+    }
+}
+
+static int
+ss_gc_map_get (ss_gc_map *m, ss_val key)
+{
+  if (m->size == 0)
+    return 0;
+
+  uint32_t i = ((uintptr_t)key >> 2) * 0x9E3779B1;
+  while (true)
+    {
+      i &= m->size - 1;
+      if (m->keys[i] == key)
+	return m->vals[i];
+      if (m->keys[i] == NULL)
+	return 0;
+      i++;
+    }
+}
+
+static void
+ss_gc_map_free (ss_gc_map *m)
+{
+  free (m->keys);
+  free (m->vals);
+}
+
+static int ss_gc_debug = 0;
+
+void
+ss_gc_set_debug (int flags)
+{
+  ss_gc_debug = flags;
+}
+
 static void ss_set (ss_val obj, int i, ss_val ref);
 static ss_val ss_dict_gc_copy (ss_gc_data *gc, ss_val dict);
 static ss_val ss_tab_gc_copy (ss_gc_data *gc, ss_val tab);
+static ss_val ss_set_gc_copy (ss_gc_data *gc, ss_val set, bool weak);
+static ss_val ss_set_add (ss_store ss, ss_val set, ss_val val);
+static ss_val ss_store_object (ss_store ss, ss_val obj);
+static uint32_t ss_id_hash (ss_store ss, ss_val o);
 
 int
 ss_id (ss_store ss, ss_val x)
@@ -473,47 +1663,116 @@ ss_id (ss_store ss, ss_val x)
 static int
 ss_gc_delay_p (ss_val obj)
 {
-  return (ss_is (obj, TAB_DISPATCH_TAG)
+  return ((SS_TAG (obj) == SS_ZBLOB_TAG
+	   && !(ss_gc_debug & SS_GC_DEBUG_BREADTH_FIRST))
+	  || ss_is (obj, TAB_DISPATCH_TAG)
 	  || ss_is (obj, TAB_SEARCH_TAG)
 	  || ss_is (obj, WEAK_DICT_DISPATCH_TAG)
 	  || ss_is (obj, WEAK_DICT_SEARCH_TAG)
 	  || ss_is (obj, WEAK_SETS_DISPATCH_TAG)
-	  || ss_is (obj, WEAK_SETS_SEARCH_TAG));
+	  || ss_is (obj, WEAK_SETS_SEARCH_TAG)
+	  || ss_is (obj, SS_WEAK_TAG));
 }
 
 static int
-ss_gc_alive_p (ss_gc_data *gc, ss_val obj)
+ss_gc_old_p (ss_gc_data *gc, ss_val obj)
 {
-  int i;
+  uint32_t *w = (uint32_t *)obj;
+  return gc->from_store->start <= w && w < gc->old_end;
+}
+
+static ss_val
+ss_gc_old_copy (ss_gc_data *gc, ss_val obj)
+{
+  return SS_FROM_OFFSET (gc->to_store, SS_OFFSET (gc->from_store, obj));
+}
+
+/* Whether OBJ is a copy made by this collection.  A minor collection
+   in place copies into the from-store, after everything else.
+ */
+static int
+ss_gc_copied_p (ss_gc_data *gc, ss_val obj)
+{
+  uint32_t *w = (uint32_t *)obj;
+
+  if (gc->to_store != gc->from_store)
+    return ss_is_stored (gc->to_store, obj);
+  return gc->copy_start <= w && w < gc->to_store->next;
+}
 
+static int
+ss_gc_alive_p (ss_gc_data *gc, ss_val obj)
+{
   if (obj == NULL || ss_is_int (obj))
     return 1;
 
+  if (ss_gc_old_p (gc, obj))
+    return 1;
+
   if (SS_IS_FORWARD (obj))
     return 1;
 
+  if (ss_gc_map_get (&gc->rebuild_map, obj))
+    return 1;
+
   if (!ss_gc_delay_p (obj))
     return 0;
 
-  for (i =0; i < gc->n_delayed; i++)
-    if (gc->delayed[i] == obj)
-      {
-	fprintf (stderr, "alive delayed\n");
-	return 1;
-      }
+  return ss_gc_map_get (&gc->delayed_map, obj);
+}
 
-  return 0;
+static void
+ss_gc_push_work (ss_gc_data *gc, ss_val obj)
+{
+  gc->work = dyn_mgrow (gc->work, &gc->work_capacity,
+			sizeof (ss_val), gc->n_work + 1);
+  gc->work[gc->n_work++] = obj;
 }
 
+/* Make TARGET alive once TRIGGER is.
+ */
+static void
+ss_gc_wait (ss_gc_data *gc, ss_val trigger, ss_val target)
+{
+  int *head = ss_gc_map_ref (&gc->waiting, trigger);
+
+  gc->ephemerons = dyn_mgrow (gc->ephemerons, &gc->ephemerons_capacity,
+			      sizeof (ss_gc_ephemeron), gc->n_ephemerons + 1);
+  gc->ephemerons[gc->n_ephemerons].target = target;
+  gc->ephemerons[gc->n_ephemerons].next = *head;
+  *head = ++gc->n_ephemerons;
+}
+
+/* OBJ has just been copied, wake up everything that waits for it.
+ */
+static void
+ss_gc_wake (ss_gc_data *gc, ss_val obj)
+{
+  int e = ss_gc_map_get (&gc->waiting, obj);
+
+  if (e > 0)
+    {
+      *ss_gc_map_ref (&gc->waiting, obj) = -1;
+      for (; e > 0; e = gc->ephemerons[e-1].next)
+	ss_gc_push_work (gc, gc->ephemerons[e-1].target);
+    }
+}
+
+static ss_val ss_gc_copy_object (ss_gc_data *gc, ss_val obj);
+static ss_val ss_weak_gc_copy (ss_gc_data *gc, ss_val obj);
+static ss_val ss_vec_gc_copy (ss_gc_data *gc, ss_val obj);
+
 static ss_val 
 ss_gc_copy (ss_gc_data *gc, ss_val obj)
 {
-  uint32_t len;
-  uint32_t *copy;
+  ss_val copy;
 
   if (obj == NULL || SS_IS_INT (obj))
     return obj;
 
+  if (ss_gc_old_p (gc, obj))
+    return ss_gc_old_copy (gc, obj);
+
   if (SS_IS_FORWARD (obj))
     {
       uint32_t off = SS_GET_FORWARD (obj);
@@ -523,31 +1782,61 @@ ss_gc_copy (ss_gc_data *gc, ss_val obj)
 	return SS_FROM_OFFSET (gc->to_store, off);
     }
 
-  if (ss_is_stored (gc->to_store, obj))
+  if (ss_gc_copied_p (gc, obj))
     return obj;
 
-  if (gc->phase == 0 && ss_gc_delay_p (obj))
-   {
-     if (gc->n_delayed >= MAX_DELAYED)
-       dyn_error ("too many weak tables");
-     gc->delayed[gc->n_delayed++] = obj;
-     return obj;
-   }
+  /* Queued dictionaries stay pending until the queue is flushed.
+   */
+  if (ss_gc_map_get (&gc->rebuild_map, obj))
+    return obj;
 
-  if (ss_is (obj, TAB_DISPATCH_TAG)
-      || ss_is (obj, TAB_SEARCH_TAG))
-    return ss_tab_gc_copy (gc, obj);
-  if (ss_is (obj, DICT_DISPATCH_TAG)
-      || ss_is (obj, DICT_SEARCH_TAG)
-      || ss_is (obj, WEAK_DICT_DISPATCH_TAG)
-      || ss_is (obj, WEAK_DICT_SEARCH_TAG)
-      || ss_is (obj, WEAK_SETS_DISPATCH_TAG)
-      || ss_is (obj, WEAK_SETS_SEARCH_TAG))
-    return ss_dict_gc_copy (gc, obj);
-  else
+  if (gc->phase < 2 && ss_gc_delay_p (obj))
+    {
+      int *delayed = ss_gc_map_ref (&gc->delayed_map, obj);
+      if (*delayed == 0)
+	{
+	  *delayed = 1;
+	  gc->delayed = dyn_mgrow (gc->delayed, &gc->delayed_capacity,
+				   sizeof (ss_val), gc->n_delayed + 1);
+	  gc->delayed[gc->n_delayed++] = obj;
+	  if (gc->phase == 1)
+	    ss_gc_wake (gc, obj);
+	}
+      return obj;
+    }
+
+  copy = ss_gc_copy_object (gc, obj);
+  if (gc->phase == 1)
+    ss_gc_wake (gc, obj);
+  return copy;
+}
+
+static ss_val
+ss_gc_copy_object (ss_gc_data *gc, ss_val obj)
+{
+  uint32_t len;
+  uint32_t *copy;
+
+  if (ss_is (obj, TAB_DISPATCH_TAG)
+      || ss_is (obj, TAB_SEARCH_TAG))
+    return ss_tab_gc_copy (gc, obj);
+  if (ss_is (obj, DICT_DISPATCH_TAG)
+      || ss_is (obj, DICT_SEARCH_TAG)
+      || ss_is (obj, WEAK_DICT_DISPATCH_TAG)
+      || ss_is (obj, WEAK_DICT_SEARCH_TAG)
+      || ss_is (obj, WEAK_SETS_DISPATCH_TAG)
+      || ss_is (obj, WEAK_SETS_SEARCH_TAG))
+    return ss_dict_gc_copy (gc, obj);
+  if (ss_is (obj, SET_TAG))
+    return ss_set_gc_copy (gc, obj, false);
+  if (ss_is (obj, SS_WEAK_TAG))
+    return ss_weak_gc_copy (gc, obj);
+  if (ss_is (obj, VEC_TAG))
+    return ss_vec_gc_copy (gc, obj);
+  else
     {
       len = SS_LEN (obj);
-      if (SS_TAG (obj) == SS_BLOB_TAG)
+      if (SS_IS_RAW (obj))
 	{
 	  len = SS_BLOB_LEN_TO_WORDS (len);
 	  copy = ss_alloc (gc->to_store, len + 1);
@@ -561,9 +1850,16 @@ ss_gc_copy (ss_gc_data *gc, ss_val obj)
 	  for (i = 0; i < len; i++)
 	    {
 	      ss_val val = ss_ref (obj, i);
-	      if (i == 0 && SS_TAG(obj) >= 64 && SS_TAG(obj) < 80)
+	      if (i == 0 && SS_TAG(obj) >= 64 && SS_TAG(obj) < 80
+		  && !gc->minor)
 		val = ss_from_int (gc->to_store->counts[SS_TAG(obj)-64]++);
-	      ss_set ((ss_val)copy, i, val);
+	      if (val == NULL || SS_IS_INT (val))
+		ss_set ((ss_val)copy, i, val);
+	      else if (ss_gc_old_p (gc, val))
+		ss_set ((ss_val)copy, i, ss_gc_old_copy (gc, val));
+	      else
+		SS_SET_WORD (copy, i+1,
+			     SS_GC_PENDING (SS_OFFSET (gc->from_store, val)));
 	    }
 	}
 
@@ -572,9 +1868,34 @@ ss_gc_copy (ss_gc_data *gc, ss_val obj)
     }
 }
 
-static void ss_dict_node_foreach (void (*func) (ss_val key, ss_val val),
-				  int dispatch_tag,
-				  ss_val node);
+/* Weak records are delayed until the last phase, like weak
+   dictionaries.  By then, everything that is alive has been reached,
+   and the remaining fields are cleared.
+ */
+static ss_val
+ss_weak_gc_copy (ss_gc_data *gc, ss_val obj)
+{
+  uint32_t len = SS_LEN (obj), i;
+  uint32_t *copy = ss_alloc (gc->to_store, len + 1);
+
+  copy[0] = SS_HEADER(obj);
+  for (i = 0; i < len; i++)
+    {
+      ss_val val = ss_ref (obj, i);
+      if (!ss_gc_alive_p (gc, val))
+	ss_set ((ss_val)copy, i, NULL);
+      else if (val == NULL || SS_IS_INT (val))
+	ss_set ((ss_val)copy, i, val);
+      else if (ss_gc_old_p (gc, val))
+	ss_set ((ss_val)copy, i, ss_gc_old_copy (gc, val));
+      else
+	SS_SET_WORD (copy, i+1,
+		     SS_GC_PENDING (SS_OFFSET (gc->from_store, val)));
+    }
+
+  SS_SET_FORWARD (obj, SS_OFFSET (gc->to_store, copy));
+  return (ss_val)copy;
+}
 
 static int
 ss_dict_weak_kind (ss_val node)
@@ -608,261 +1929,1480 @@ ss_dict_dispatch_tag (int weak)
     abort ();
 }
 
+/* Copying an object that is part of a table, dictionary or set.  The
+   object is scanned right away, so that it is laid out together with
+   what it refers to, instead of together with its siblings.
+ */
+
+static void ss_gc_scan_object (ss_gc_data *gc, ss_val obj, int depth);
+
+#define SS_GC_DEPTH 16
+
 static ss_val
-ss_dict_gc_copy (ss_gc_data *gc, ss_val node)
+ss_gc_copy_deep (ss_gc_data *gc, ss_val obj)
 {
-  ss_val copy;
-  int weak = ss_dict_weak_kind (node);
-  ss_dict *d = ss_dict_init (gc->to_store, NULL, weak);
+  uint32_t *fresh = gc->to_store->next;
+  ss_val copy = ss_gc_copy (gc, obj);
 
-  dyn_foreach_x ((ss_val key, ss_val val),
-		 ss_dict_node_foreach, ss_dict_dispatch_tag (weak), node)
+  if (copy != obj && (uint32_t *)copy >= fresh
+      && !(ss_gc_debug & SS_GC_DEBUG_BREADTH_FIRST))
+    ss_gc_scan_object (gc, copy, SS_GC_DEPTH);
+  return copy;
+}
+
+static ss_val ss_gc_settle (ss_gc_data *gc, ss_val obj);
+
+/* Like ss_gc_copy_deep, for objects whose copy is needed right away,
+   even when they are dictionaries that are queued for rebuilding.
+ */
+static ss_val
+ss_gc_copy_now (ss_gc_data *gc, ss_val obj)
+{
+  return ss_gc_settle (gc, ss_gc_copy_deep (gc, obj));
+}
+
+/* Copying a dispatch node.  COPY_CHILD is called for each child,
+   and children that disappear are removed from the copy.
+ */
+
+static ss_val
+ss_gc_copy_dispatch (ss_gc_data *gc, ss_val node,
+		     ss_val (*copy_child) (ss_val child))
+{
+  int len = ss_len (node), i, pos, n;
+  uint32_t map;
+  ss_val vals[len];
+      
+  map = ss_to_int (ss_ref (node, 0)) | 0xC0000000;
+  pos = 1;
+  n = 1;
+  for (i = 0; i < 32; i++)
     {
-      if (weak == SS_DICT_STRONG)
-	{
-	  ss_dict_set (d, ss_gc_copy (gc, key), ss_gc_copy (gc, val));
-	}
-      else if (weak == SS_DICT_WEAK_KEYS)
-	{
-	  if (ss_gc_alive_p (gc, key))
-	    ss_dict_set (d, ss_gc_copy (gc, key), ss_gc_copy (gc, val));
-	}
-      else if (weak == SS_DICT_WEAK_SETS)
+      uint32_t bit = (1U << i);
+      if (map & bit)
 	{
-	  if (val)
-	    {
-	      int len = ss_len (val), n = 0;
-	      ss_val new_elts[len];
-	      for (int i = 0; i < len; i++)
-		{
-		  ss_val elt = ss_ref (val, i);
-		  if (elt && ss_gc_alive_p (gc, elt))
-		    new_elts[n++] = ss_gc_copy (gc, elt);
-		}
-	      if (n > 0)
-		ss_dict_set (d, ss_gc_copy (gc, key),
-			     ss_newv (gc->to_store,
-				      ss_tag (val), n,
-				      new_elts));
-	    }
+	  ss_val x = ss_ref (node, pos++);
+	  ss_val y = x? copy_child (x) : NULL;
+	  if (y == NULL && i < 30)
+	    map &= ~bit;
+	  else
+	    vals[n++] = y;
 	}
-      else
-	abort ();
     }
 
-  copy = ss_dict_finish (d);
-  if (node)
+  if (map == 0xC0000000 && vals[1] == NULL && vals[2] == NULL)
+    return NULL;
+
+  vals[0] = ss_from_int (map);
+  return ss_newv (gc->to_store, ss_tag (node), n, vals);
+}
+
+/* Copying a dictionary.  Entries whose keys don't move keep their
+   place in the trie, the others are collected in MOVED and inserted
+   again afterwards.
+ */
+
+typedef struct {
+  int weak;
+  int search_tag;
+  int dispatch_tag;
+  int n_moved;
+  int moved_capacity;
+  ss_val *moved;
+} ss_dict_gc_data;
+
+/* Copying a large set.  It is a hash trie of addresses, and is built
+   again from scratch.  If WEAK is true, dead elements are left out.
+ */
+
+static ss_val
+ss_set_gc_copy (ss_gc_data *gc, ss_val set, bool weak)
+{
+  ss_val copy = NULL;
+
+  dyn_foreach (elt, ss_elts, set)
+    if (!weak || (elt && ss_gc_alive_p (gc, elt)))
+      copy = ss_set_add (gc->to_store, copy, ss_gc_copy_now (gc, elt));
+  copy = ss_store_object (gc->to_store, copy);
+
+  if (!weak)
+    SS_SET_FORWARD (set, copy? SS_OFFSET (gc->to_store, copy) : 0);
+  return copy;
+}
+
+/* Copying a vector.  A full collection gives new ids to the keys, so
+   the vector is built again from its entries.  A minor collection
+   keeps the ids, and only the young nodes need to be copied.
+ */
+
+static ss_val ss_vec_node_set (ss_val node, int id, ss_val key, ss_val val);
+static void ss_vec_node_foreach (void (*func) (ss_val key, ss_val val),
+				 ss_val node);
+
+static ss_val
+ss_vec_gc_copy_node (ss_gc_data *gc, ss_val node)
+{
+  if (node == NULL)
+    return NULL;
+
+  if (ss_gc_old_p (gc, node))
+    return ss_gc_old_copy (gc, node);
+
+  int len = ss_len (node), level = ss_ref_int (node, 0);
+  ss_val vals[len];
+
+  vals[0] = ss_ref (node, 0);
+  for (int i = 1; i < len; i++)
     {
-      if (copy)
-	SS_SET_FORWARD (node, SS_OFFSET (gc->to_store, copy));
-      else
-	SS_SET_FORWARD (node, 0);
+      ss_val x = ss_ref (node, i);
+      vals[i] = (level > 0
+		 ? ss_vec_gc_copy_node (gc, x)
+		 : ss_gc_copy_now (gc, x));
     }
-  return copy;
+  return ss_newv (gc->to_store, VEC_TAG, len, vals);
 }
 
 static ss_val
-ss_tab_gc_copy (ss_gc_data *gc, ss_val node)
+ss_vec_gc_copy (ss_gc_data *gc, ss_val vec)
 {
-  ss_val copy;
+  ss_val copy = NULL;
 
-  if (ss_is (node, TAB_SEARCH_TAG))
+  if (gc->minor)
+    copy = ss_vec_gc_copy_node (gc, vec);
+  else
     {
-      int len = ss_len (node), i, n;
-      ss_val vals[len];
+      void add (ss_val key, ss_val val)
+      {
+	key = ss_gc_copy_now (gc, key);
+	val = ss_gc_copy_now (gc, val);
+	copy = ss_vec_node_set (copy, ss_ref_int (key, 0), key, val);
+      }
 
-      n = 1;
-      vals[0] = ss_ref (node, 0);
-      for (i = 1; i < len; i++)
+      ss_vec_node_foreach (add, vec);
+      copy = ss_store_object (gc->to_store, copy);
+    }
+
+  SS_SET_FORWARD (vec, copy? SS_OFFSET (gc->to_store, copy) : 0);
+  return copy;
+}
+
+static ss_val
+ss_dict_gc_copy_val (ss_gc_data *gc, int weak, ss_val val)
+{
+  if (weak == SS_DICT_WEAK_SETS && ss_is (val, SET_TAG)
+      && !ss_gc_old_p (gc, val))
+    return ss_set_gc_copy (gc, val, true);
+  else if (weak == SS_DICT_WEAK_SETS && val && !ss_gc_old_p (gc, val))
+    {
+      int len = ss_len (val), n = 0;
+      ss_val new_elts[len];
+      for (int i = 0; i < len; i++)
 	{
-	  ss_val x = ss_ref (node, i);
-	  if (ss_gc_alive_p (gc, x))
-	    vals[n++] = ss_gc_copy (gc, x);
+	  ss_val elt = ss_ref (val, i);
+	  if (elt && ss_gc_alive_p (gc, elt))
+	    new_elts[n++] = ss_gc_copy_now (gc, elt);
 	}
-
-      if (n > 1)
-	copy = ss_newv (gc->to_store, TAB_SEARCH_TAG, n, vals);
+      if (n > 0)
+	return ss_newv (gc->to_store, ss_tag (val), n, new_elts);
       else
-	copy = NULL;
+	return NULL;
+    }
+  else
+    return ss_gc_copy_deep (gc, val);
+}
+
+static ss_val
+ss_dict_gc_copy_node (ss_gc_data *gc, ss_dict_gc_data *dd, ss_val node)
+{
+  if (node == NULL)
+    return NULL;
+
+  if (ss_gc_old_p (gc, node))
+    return ss_gc_old_copy (gc, node);
+
+  if (ss_is (node, dd->dispatch_tag))
+    {
+      ss_val copy_child (ss_val child)
+      {
+	return ss_dict_gc_copy_node (gc, dd, child);
+      }
+
+      return ss_gc_copy_dispatch (gc, node, copy_child);
     }
   else
     {
-      int len = ss_len (node), i, pos, n;
-      uint32_t map;
+      int len = ss_len (node), n = 1;
       ss_val vals[len];
-      
-      map = ss_to_int (ss_ref (node, 0)) | 0xC0000000;
-      pos = 1;
-      n = 1;
-      for (i = 0; i < 32; i++)
+
+      vals[0] = ss_ref (node, 0);
+      for (int i = 1; i < len; i += 2)
 	{
-	  int bit = (1 << i);
-	  if (map & bit)
+	  ss_val key = ss_ref (node, i), val = ss_ref (node, i+1);
+
+	  if (dd->weak == SS_DICT_WEAK_KEYS && !ss_gc_alive_p (gc, key))
+	    continue;
+
+	  val = ss_dict_gc_copy_val (gc, dd->weak, val);
+	  if (val == NULL)
+	    continue;
+
+	  if (key == NULL || ss_is_int (key) || ss_gc_old_p (gc, key))
 	    {
-	      ss_val x = ss_ref (node, pos++);
-	      ss_val y = x? ss_tab_gc_copy (gc, x) : NULL;
-	      if (y == NULL && i < 30)
-		map &= ~bit;
-	      else
-		vals[n++] = y;
+	      vals[n++] = ss_gc_copy_now (gc, key);
+	      vals[n++] = ss_gc_settle (gc, val);
+	    }
+	  else
+	    {
+	      dd->moved = dyn_mgrow (dd->moved, &dd->moved_capacity,
+				     sizeof (ss_val), dd->n_moved + 2);
+	      dd->moved[dd->n_moved++] = ss_gc_copy_deep (gc, key);
+	      dd->moved[dd->n_moved++] = val;
 	    }
 	}
 
-      if (map == 0xC0000000 && vals[1] == NULL && vals[2] == NULL)
-	copy = NULL;
+      if (n > 1)
+	return ss_newv (gc->to_store, dd->search_tag, n, vals);
       else
+	return NULL;
+    }
+}
+
+static int
+ss_dict_search_tag (int weak)
+{
+  if (weak == SS_DICT_STRONG)
+    return DICT_SEARCH_TAG;
+  else if (weak == SS_DICT_WEAK_KEYS)
+    return WEAK_DICT_SEARCH_TAG;
+  else if (weak == SS_DICT_WEAK_SETS)
+    return WEAK_SETS_SEARCH_TAG;
+  else
+    abort ();
+}
+
+/* The worker pool.
+
+   The workers are started the first time they are needed and then
+   wait for more work for as long as the process lives, so that a
+   collection doesn't pay for starting threads.  Ss_pool_run calls
+   FUNC for each index below N, spread over up to N_THREADS threads
+   including the calling one, and returns when all calls have
+   returned.  FUNC must not throw and must not touch a store; the
+   workers only ever compute.
+
+   Only one thread at a time can hand work to the pool; when it is
+   busy, the caller does all the work itself.  The child of a fork
+   has no workers, and starts its own when it needs them.
+ */
+
+#define POOL_MAX_THREADS 16
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  pthread_mutex_t user;   // held by the thread that hands out work
+  int n_workers;
+  unsigned batch;         // counts the batches handed out
+  int limit;              // how many workers may join this batch
+  int n_active;           // how many have joined and not yet left
+  void (*func) (void *data, int i);
+  void *data;
+  int n, next;
+} ss_pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+  .user = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_once_t ss_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+ss_pool_work ()
+{
+  int i;
+
+  while ((i = __sync_fetch_and_add (&ss_pool.next, 1)) < ss_pool.n)
+    ss_pool.func (ss_pool.data, i);
+}
+
+static void *
+ss_pool_worker (void *first_batch)
+{
+  unsigned seen = (uintptr_t)first_batch;
+
+  pthread_mutex_lock (&ss_pool.lock);
+  while (true)
+    {
+      while (ss_pool.batch == seen)
+	pthread_cond_wait (&ss_pool.work, &ss_pool.lock);
+      seen = ss_pool.batch;
+      if (ss_pool.n_active < ss_pool.limit)
 	{
-	  vals[0] = ss_from_int (map);
-	  copy = ss_newv (gc->to_store, TAB_DISPATCH_TAG, n, vals);
+	  ss_pool.n_active++;
+	  pthread_mutex_unlock (&ss_pool.lock);
+	  ss_pool_work ();
+	  pthread_mutex_lock (&ss_pool.lock);
+	  if (--ss_pool.n_active == 0)
+	    pthread_cond_signal (&ss_pool.done);
 	}
     }
+  return NULL;
+}
+
+static void
+ss_pool_forget ()
+{
+  pthread_mutex_init (&ss_pool.lock, NULL);
+  pthread_mutex_init (&ss_pool.user, NULL);
+  pthread_cond_init (&ss_pool.work, NULL);
+  pthread_cond_init (&ss_pool.done, NULL);
+  ss_pool.n_workers = 0;
+  ss_pool.n_active = 0;
+}
+
+static void
+ss_pool_setup ()
+{
+  pthread_atfork (NULL, NULL, ss_pool_forget);
+}
+
+static void
+ss_pool_run (int n_threads, void (*func) (void *data, int i), void *data,
+	     int n)
+{
+  if (n_threads > POOL_MAX_THREADS)
+    n_threads = POOL_MAX_THREADS;
+
+  if (n_threads < 2 || n < 2 || pthread_mutex_trylock (&ss_pool.user) != 0)
+    {
+      for (int i = 0; i < n; i++)
+	func (data, i);
+      return;
+    }
+
+  pthread_once (&ss_pool_once, ss_pool_setup);
+  pthread_mutex_lock (&ss_pool.lock);
+
+  /* If a worker can't be started, the others just do more work.
+   */
+  while (ss_pool.n_workers < n_threads - 1)
+    {
+      pthread_attr_t attr;
+      pthread_t thread;
+      int res;
+
+      pthread_attr_init (&attr);
+      pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+      res = pthread_create (&thread, &attr, ss_pool_worker,
+			    (void *)(uintptr_t)ss_pool.batch);
+      pthread_attr_destroy (&attr);
+      if (res != 0)
+	break;
+      ss_pool.n_workers++;
+    }
+
+  ss_pool.func = func;
+  ss_pool.data = data;
+  ss_pool.n = n;
+  ss_pool.next = 0;
+  ss_pool.limit = n_threads - 1;
+  ss_pool.batch++;
+  pthread_cond_broadcast (&ss_pool.work);
+  pthread_mutex_unlock (&ss_pool.lock);
+
+  ss_pool_work ();
+
+  pthread_mutex_lock (&ss_pool.lock);
+  while (ss_pool.n_active > 0)
+    pthread_cond_wait (&ss_pool.done, &ss_pool.lock);
+  pthread_mutex_unlock (&ss_pool.lock);
+  pthread_mutex_unlock (&ss_pool.user);
+}
+
+static int ss_gc_threads = 0;
+
+void
+ss_gc_set_threads (int n)
+{
+  ss_gc_threads = n;
+}
+
+static int
+ss_gc_n_threads ()
+{
+  int n = ss_gc_threads;
+
+  if (n <= 0)
+    n = sysconf (_SC_NPROCESSORS_ONLN);
+  return n < 1? 1 : n;
+}
+
+/* Rebuilding a dictionary whose entries have all moved.
+
+   Inserting the entries one by one produces the same trie no matter
+   in which order they come, except that entries with equal hashes end
+   up in insertion order.  So the trie can just as well be built
+   directly from the entries sorted in trie order, and stored bottom-up
+   in the same order in which ss_store_object would store it.  The
+   result is identical, byte for byte, but no unstored nodes are
+   created.
+
+   Trie order compares the lowest 5 bits of the hash first, then the
+   next 5, and so on.  Sorting is done with a stable radix sort: one
+   pass over the first two levels splits the entries into buckets, and
+   the buckets are then sorted independently.
+
+   Big dictionaries are not rebuilt right away.  They are queued, and
+   the references to them stay pending, like those to delayed objects.
+   Once the scan has caught up, ss_gc_flush_rebuilds sorts the entries
+   of all queued dictionaries at the same time on the worker pool, and
+   then stores them one after the other, in the order in which they
+   were queued.  Thus, independent dictionaries, such as the ones of
+   the origins of a Dpm database, are sorted concurrently, and the
+   result doesn't depend on the number of threads.  Whatever needs the
+   copy of a queued dictionary right away, such as a vector that has
+   it as a value, flushes the queue first, see ss_gc_settle.
+
+   Only the sorting happens in other threads, the store itself is only
+   touched from the calling thread.
+ */
+
+typedef struct {
+  uint32_t key;    // hash with the levels reversed, see ss_trie_order
+  uint32_t hash;
+  int pos;         // index of the key in the moved array
+} ss_rehash_entry;
+
+#define REHASH_BUCKET_BITS     10
+#define REHASH_BUCKETS         (1 << REHASH_BUCKET_BITS)
+#define REHASH_QUEUE_MIN       1024
+#define REHASH_PARALLEL_MIN    (1 << 14)
+
+typedef struct ss_rehash_job {
+  ss_val node;               // the dictionary in the from-store
+  ss_dict_gc_data dd;
+  ss_rehash_entry *entries;  // followed by as many for scratch
+  int bucket_start[REHASH_BUCKETS+1];
+} ss_rehash_job;
+
+typedef struct {
+  ss_gc_data *gc;
+  ss_rehash_job *jobs;
+} ss_rehash_batch;
+
+static uint32_t
+ss_trie_order (uint32_t hash)
+{
+  uint32_t key = 0;
+  for (int shift = 0; shift < 30; shift += BITS_PER_LEVEL)
+    key = (key << BITS_PER_LEVEL) | ((hash >> shift) & LEVEL_MASK);
+  return key;
+}
+
+/* Hash the keys of job K and split them into buckets by the top bits,
+   from the scratch half into ENTRIES.
+ */
+static void
+ss_rehash_split (void *data, int k)
+{
+  ss_rehash_batch *batch = data;
+  ss_rehash_job *job = batch->jobs + k;
+  int n = job->dd.n_moved / 2;
+  ss_rehash_entry *entries = job->entries, *scratch = entries + n;
+  int *bucket_start = job->bucket_start;
+  int fill[REHASH_BUCKETS];
+
+  for (int i = 0; i < n; i++)
+    {
+      uint32_t h = ss_id_hash (batch->gc->to_store, job->dd.moved[2*i]);
+      scratch[i].key = ss_trie_order (h);
+      scratch[i].hash = h;
+      scratch[i].pos = 2*i;
+    }
+
+  memset (bucket_start, 0, (REHASH_BUCKETS+1) * sizeof (int));
+  for (int i = 0; i < n; i++)
+    bucket_start[(scratch[i].key >> 20) + 1]++;
+  for (int b = 0; b < REHASH_BUCKETS; b++)
+    bucket_start[b+1] += bucket_start[b];
+  memcpy (fill, bucket_start, sizeof (fill));
+  for (int i = 0; i < n; i++)
+    entries[fill[scratch[i].key >> 20]++] = scratch[i];
+}
+
+/* Sort bucket I % REHASH_BUCKETS of job I / REHASH_BUCKETS by the low
+   20 bits of the key, in two stable passes.
+ */
+static void
+ss_rehash_sort_bucket (void *data, int i)
+{
+  ss_rehash_batch *batch = data;
+  ss_rehash_job *job = batch->jobs + i / REHASH_BUCKETS;
+  int b = i % REHASH_BUCKETS, n = job->dd.n_moved / 2;
+  int lo = job->bucket_start[b], hi = job->bucket_start[b+1];
+  ss_rehash_entry *src = job->entries + lo, *dst = job->entries + n + lo;
+
+  if (hi - lo < 2)
+    return;
+
+  for (int shift = 0; shift < 20; shift += REHASH_BUCKET_BITS)
+    {
+      int count[REHASH_BUCKETS+1];
+      memset (count, 0, sizeof (count));
+      for (int i = 0; i < hi - lo; i++)
+	count[((src[i].key >> shift) & (REHASH_BUCKETS-1)) + 1]++;
+      for (int d = 0; d < REHASH_BUCKETS; d++)
+	count[d+1] += count[d];
+      for (int i = 0; i < hi - lo; i++)
+	dst[count[(src[i].key >> shift) & (REHASH_BUCKETS-1)]++] = src[i];
+
+      ss_rehash_entry *t = src; src = dst; dst = t;
+    }
+}
+
+/* Sort the entries of the N_JOBS jobs, on the worker pool when there
+   are enough of them.
+ */
+static void
+ss_rehash_sort (ss_gc_data *gc, ss_rehash_job *jobs, int n_jobs)
+{
+  ss_rehash_batch batch = { gc, jobs };
+  int n_threads = ss_gc_n_threads (), total = 0;
+
+  for (int k = 0; k < n_jobs; k++)
+    {
+      int n = jobs[k].dd.n_moved / 2;
+      jobs[k].entries = dyn_malloc (2 * n * sizeof (ss_rehash_entry));
+      total += n;
+    }
+  if (total < REHASH_PARALLEL_MIN)
+    n_threads = 1;
+
+  ss_pool_run (n_threads, ss_rehash_split, &batch, n_jobs);
+  ss_pool_run (n_threads, ss_rehash_sort_bucket, &batch,
+	       n_jobs * REHASH_BUCKETS);
+}
+
+static ss_val
+ss_rehash_build (ss_gc_data *gc, ss_dict_gc_data *dd,
+		 ss_rehash_entry *entries, int lo, int hi, int shift)
+{
+  if (entries[lo].hash == entries[hi-1].hash)
+    {
+      int n = 1 + 2*(hi - lo);
+      ss_val vals[n];
+
+      vals[0] = ss_from_int (entries[lo].hash);
+      for (int i = lo; i < hi; i++)
+	{
+	  vals[1 + 2*(i-lo)] = dd->moved[entries[i].pos];
+	  vals[2 + 2*(i-lo)] = dd->moved[entries[i].pos + 1];
+	}
+      return ss_newv (gc->to_store, dd->search_tag, n, vals);
+    }
+  else
+    {
+      ss_val children[32];
+      uint32_t map = 0xC0000000;
+      ss_val vals[33];
+      int n = 1;
+
+      children[30] = children[31] = NULL;
+      for (int i = lo; i < hi; )
+	{
+	  int index = (entries[i].hash >> shift) & LEVEL_MASK, j = i + 1;
+	  while (j < hi && ((entries[j].hash >> shift) & LEVEL_MASK) == index)
+	    j++;
+	  children[index] = ss_rehash_build (gc, dd, entries, i, j,
+					     shift + BITS_PER_LEVEL);
+	  map |= 1U << index;
+	  i = j;
+	}
+
+      for (int i = 0; i < 32; i++)
+	if (map & (1U << i))
+	  vals[n++] = children[i];
+      vals[0] = ss_from_int (map);
+      return ss_newv (gc->to_store, dd->dispatch_tag, n, vals);
+    }
+}
+
+/* Store the dictionary of JOB, whose entries have been sorted unless
+   the insertion debug mode is on, and forget its entries.
+ */
+static ss_val
+ss_rehash_finish (ss_gc_data *gc, ss_rehash_job *job, bool insert)
+{
+  ss_dict_gc_data *dd = &job->dd;
+  ss_val copy;
+
+  for (int i = 1; i < dd->n_moved; i += 2)
+    dd->moved[i] = ss_gc_settle (gc, dd->moved[i]);
+
+  if (insert)
+    {
+      ss_dict *d = ss_dict_init (gc->to_store, NULL, dd->weak);
+      for (int i = 0; i < dd->n_moved; i += 2)
+	ss_dict_set (d, dd->moved[i], dd->moved[i+1]);
+      copy = ss_dict_finish (d);
+    }
+  else
+    copy = ss_rehash_build (gc, dd, job->entries, 0, dd->n_moved / 2, 0);
+
+  free (job->entries);
+  free (dd->moved);
+  return copy;
+}
+
+static void
+ss_gc_flush_rebuilds (ss_gc_data *gc)
+{
+  bool insert = (ss_gc_debug & SS_GC_DEBUG_INSERT);
+  ss_rehash_job *jobs = gc->rebuilds;
+  int n_jobs = gc->n_rebuilds;
+
+  if (n_jobs == 0)
+    return;
+
+  /* Nothing is queued while the queue is flushed, since only values
+     are copied, and those have all been copied already.
+   */
+  gc->n_rebuilds = 0;
+  gc->rebuilds = NULL;
+  gc->rebuilds_capacity = 0;
+
+  if (!insert)
+    ss_rehash_sort (gc, jobs, n_jobs);
+
+  /* Dictionaries are queued after their values, so the values have
+     been stored when their dictionary is.
+   */
+  for (int k = 0; k < n_jobs; k++)
+    {
+      ss_val copy = ss_rehash_finish (gc, jobs + k, insert);
+      SS_SET_FORWARD (jobs[k].node, SS_OFFSET (gc->to_store, copy));
+    }
+
+  free (jobs);
+}
+
+static ss_val
+ss_gc_settle (ss_gc_data *gc, ss_val obj)
+{
+  if (obj && !SS_IS_INT (obj) && ss_gc_map_get (&gc->rebuild_map, obj)
+      && !ss_gc_copied_p (gc, obj))
+    {
+      if (!SS_IS_FORWARD (obj))
+	ss_gc_flush_rebuilds (gc);
+      return ss_gc_copy (gc, obj);
+    }
+  return obj;
+}
+
+static ss_val
+ss_dict_gc_copy (ss_gc_data *gc, ss_val node)
+{
+  bool insert = (ss_gc_debug & SS_GC_DEBUG_INSERT);
+  ss_val copy, base;
+  ss_rehash_job job;
+  ss_dict_gc_data *dd = &job.dd;
+
+  job.node = node;
+  job.entries = NULL;
+
+  dd->weak = ss_dict_weak_kind (node);
+  dd->dispatch_tag = ss_dict_dispatch_tag (dd->weak);
+  dd->search_tag = ss_dict_search_tag (dd->weak);
+  dd->n_moved = 0;
+  dd->moved_capacity = 0;
+  dd->moved = NULL;
+
+  base = ss_dict_gc_copy_node (gc, dd, node);
+
+  /* The keys are hashed by their place in the to-store.
+   */
+  for (int i = 0; i < dd->n_moved; i += 2)
+    dd->moved[i] = ss_gc_settle (gc, dd->moved[i]);
+
+  if (base == NULL && dd->n_moved >= 2 * REHASH_QUEUE_MIN
+      && node && gc->phase < 2)
+    {
+      gc->rebuilds = dyn_mgrow (gc->rebuilds, &gc->rebuilds_capacity,
+				sizeof (ss_rehash_job), gc->n_rebuilds + 1);
+      gc->rebuilds[gc->n_rebuilds++] = job;
+      *ss_gc_map_ref (&gc->rebuild_map, node) = 1;
+      return node;
+    }
+
+  if (base == NULL && dd->n_moved > 0)
+    {
+      if (!insert)
+	ss_rehash_sort (gc, &job, 1);
+      copy = ss_rehash_finish (gc, &job, insert);
+    }
+  else
+    {
+      for (int i = 1; i < dd->n_moved; i += 2)
+	dd->moved[i] = ss_gc_settle (gc, dd->moved[i]);
+
+      ss_dict *d = ss_dict_init (gc->to_store, base, dd->weak);
+      for (int i = 0; i < dd->n_moved; i += 2)
+	ss_dict_set (d, dd->moved[i], dd->moved[i+1]);
+      copy = ss_dict_finish (d);
+      free (dd->moved);
+    }
+
+  if (node)
+    {
+      if (copy)
+	SS_SET_FORWARD (node, SS_OFFSET (gc->to_store, copy));
+      else
+	SS_SET_FORWARD (node, 0);
+    }
+  return copy;
+}
+
+static ss_val
+ss_tab_gc_copy (ss_gc_data *gc, ss_val node)
+{
+  ss_val copy;
+
+  if (ss_gc_old_p (gc, node))
+    return ss_gc_old_copy (gc, node);
+
+  if (ss_is (node, TAB_SEARCH_TAG))
+    {
+      int len = ss_len (node), i, n;
+      ss_val vals[len];
+
+      n = 1;
+      vals[0] = ss_ref (node, 0);
+      for (i = 1; i < len; i++)
+	{
+	  ss_val x = ss_ref (node, i);
+	  if (ss_gc_alive_p (gc, x))
+	    vals[n++] = ss_gc_copy (gc, x);
+	}
+
+      if (n > 1)
+	copy = ss_newv (gc->to_store, TAB_SEARCH_TAG, n, vals);
+      else
+	copy = NULL;
+    }
+  else
+    {
+      ss_val copy_child (ss_val child)
+      {
+	return ss_tab_gc_copy (gc, child);
+      }
+
+      copy = ss_gc_copy_dispatch (gc, node, copy_child);
+    }
+
+  if (copy)
+    SS_SET_FORWARD (node, SS_OFFSET (gc->to_store, copy));
+  else
+    SS_SET_FORWARD (node, 0);
+
+  return copy;
+}
+
+/* Scanning an object copies its children right behind it, and scans
+   them in turn, up to DEPTH levels deep.  Thus, objects are laid out
+   depth-first: a version record is followed by its relations, their
+   alternatives, etc.  What is left pending is picked up by the
+   breadth-first scan in ss_gc_scan.
+ */
+
+static void
+ss_gc_scan_object (ss_gc_data *gc, ss_val obj, int depth)
+{
+  uint32_t len = SS_LEN (obj), i;
+
+  if (SS_IS_RAW (obj))
+    return;
+
+  for (i = 0; i < len; i++)
+    {
+      uint32_t w = SS_WORD (obj, i+1);
+      if (SS_IS_GC_PENDING (w))
+	{
+	  ss_val val = SS_FROM_OFFSET (gc->from_store,
+				       SS_GC_PENDING_OFFSET (w));
+	  uint32_t *fresh = gc->to_store->next;
+	  ss_val copy = ss_gc_copy (gc, val);
+
+	  /* Delayed objects stay pending until the last phase.
+	   */
+	  if (copy != val)
+	    {
+	      ss_set (obj, i, copy);
+	      if (depth > 0 && (uint32_t *)copy >= fresh)
+		ss_gc_scan_object (gc, copy, depth - 1);
+	    }
+	}
+    }
+}
+
+static ss_val 
+ss_gc_scan_and_advance (ss_gc_data *gc, ss_val obj)
+{
+  uint32_t len = SS_LEN (obj);
+
+  ss_gc_scan_object (gc, obj, ((ss_gc_debug & SS_GC_DEBUG_BREADTH_FIRST)
+				? 0 : SS_GC_DEPTH));
+  if (SS_IS_RAW (obj))
+    len = SS_BLOB_LEN_TO_WORDS (len);
+  
+  return (ss_val )(((uint32_t *)obj) + len + 1);
+}
+
+/* Scan everything that has been copied since the last scan.
+ */
+static void
+ss_gc_scan (ss_gc_data *gc)
+{
+  ss_val to_ptr;
+  for (to_ptr = (ss_val)(gc->to_store->start + gc->scanned);
+       to_ptr < (ss_val)gc->to_store->next;
+       to_ptr = ss_gc_scan_and_advance (gc, to_ptr))
+    ;
+  gc->scanned = (uint32_t *)to_ptr - gc->to_store->start;
+}
+
+static ss_val
+ss_gc_copy_phase (ss_gc_data *gc, ss_val root, int phase)
+{
+  /* Only the copies need to be scanned.  The last phase scans all of
+     them again, to resolve the references to the delayed objects.
+   */
+  if (phase == 0 || phase == 2)
+    gc->scanned = gc->copy_start - gc->to_store->start;
+
+  gc->phase = phase;
+  root = ss_gc_copy (gc, root);
+  ss_gc_scan (gc);
+  ss_gc_flush_rebuilds (gc);
+  return ss_gc_settle (gc, root);
+}
+
+/* Like ss_dict_node_foreach, but skips the old generation.  Old
+   nodes only refer to old keys and values, which are all alive.
+ */
+
+static void
+ss_gc_dict_foreach (void (*func) (ss_val key, ss_val val),
+		    ss_gc_data *gc, int dispatch_tag, ss_val node)
+{
+  if (node == NULL || ss_gc_old_p (gc, node))
+    ;
+  else if (!ss_is (node, dispatch_tag))
+    {
+      int len = ss_len(node), i;
+      for (i = 1; i < len; i += 2)
+	func (ss_ref (node, i), ss_ref (node, i+1));
+    }
+  else
+    {
+      int len = ss_len(node), i;
+      for (i = 1; i < len; i++)
+	ss_gc_dict_foreach (func, gc, dispatch_tag, ss_ref (node, i));
+    }
+}
+
+/* Look at the entries of the weak dictionary D.  Those whose key or
+   elements are alive already are put to work, the others have to
+   wait for them.
+ */
+static void
+ss_gc_register_ephemerons (ss_gc_data *gc, ss_val d)
+{
+  if (ss_is (d, WEAK_DICT_DISPATCH_TAG)
+      || ss_is (d, WEAK_DICT_SEARCH_TAG))
+    {
+      dyn_foreach_x ((ss_val key, ss_val val),
+		     ss_gc_dict_foreach, gc, WEAK_DICT_DISPATCH_TAG, d)
+	{
+	  /* If the key is alive, the value is, too.
+	   */
+	  if (ss_gc_alive_p (gc, val))
+	    ;
+	  else if (ss_gc_alive_p (gc, key))
+	    ss_gc_push_work (gc, val);
+	  else
+	    ss_gc_wait (gc, key, val);
+	}
+    }
+  else if (ss_is (d, WEAK_SETS_DISPATCH_TAG)
+	   || ss_is (d, WEAK_SETS_SEARCH_TAG))
+    {
+      dyn_foreach_x ((ss_val key, ss_val val),
+		     ss_gc_dict_foreach, gc, WEAK_SETS_DISPATCH_TAG, d)
+	{
+	  /* If any of the values are alive, the key is, too.
+	   */
+	  if (val && !ss_gc_alive_p (gc, key))
+	    {
+	      dyn_foreach (elt, ss_elts, val)
+		if (elt == NULL)
+		  ;
+		else if (ss_gc_alive_p (gc, elt))
+		  {
+		    ss_gc_push_work (gc, key);
+		    break;
+		  }
+		else
+		  ss_gc_wait (gc, elt, key);
+	    }
+	}
+    }
+}
+
+static void
+ss_gc_ripple_dicts (ss_gc_data *gc)
+{
+  gc->phase = 1;
+  while (true)
+    {
+      /* Copying can delay more dictionaries.
+       */
+      while (gc->n_registered < gc->n_delayed)
+	ss_gc_register_ephemerons (gc, gc->delayed[gc->n_registered++]);
+
+      if (gc->n_work == 0)
+	break;
+
+      while (gc->n_work > 0)
+	ss_gc_copy (gc, gc->work[--gc->n_work]);
+      ss_gc_scan (gc);
+      ss_gc_flush_rebuilds (gc);
+    }
+}
+
+/* Run the three phases of a collection, see above.
+ */
+static ss_val
+ss_gc_run (ss_gc_data *gc)
+{
+  ss_val root;
+
+  root = ss_gc_copy_phase (gc, ss_get_root (gc->from_store), 0);
+  ss_gc_ripple_dicts (gc);
+  root = ss_gc_copy_phase (gc, root, 2);
+
+  free (gc->delayed);
+  ss_gc_map_free (&gc->delayed_map);
+  free (gc->ephemerons);
+  ss_gc_map_free (&gc->waiting);
+  free (gc->work);
+  ss_gc_map_free (&gc->rebuild_map);
+
+  return root;
+}
+
+/* Collect SS into a new file.  A full collection turns version 3 and
+   4 stores into version 5 ones, a minor one copies the old generation
+   verbatim and thus needs to keep the format.
+ */
+static ss_store 
+ss_gc_collect (ss_store ss, bool minor)
+{
+  ss_gc_data gc;
+  ss_val root;
+  char *newfile;
+  int version = ss->version;
+
+  if (ss->branch)
+    dyn_error ("Can't collect %s", ss->filename);
+
+  /* Disconnect old store from file.
+   */
+  if (mmap (ss->head, ss->map_size, PROT_READ | PROT_WRITE, 
+	    MAP_PRIVATE | MAP_FIXED, ss->fd, 0)
+      == MAP_FAILED)
+    dyn_error ("Can't disconnect from %s: %m", ss->filename);
+
+  memset (&gc, 0, sizeof (gc));
+  gc.minor = minor && ss->slot.alloced <= ss->slot.len;
+  if (!gc.minor && (version == 3 || version == 4))
+    version = SS_VERSION;
+
+  asprintf (&newfile, "%s.gc", ss->filename);
+  gc.from_store = ss;
+  gc.to_store = ss_open_version (newfile, SS_TRUNC, version);
+  free (newfile);
+  gc.old_end = ss->start;
+
+  if (gc.minor)
+    {
+      ss_store to = gc.to_store;
+      size_t old_len = ss->slot.len - ss->slot.alloced;
+
+      /* Copy the old generation verbatim, including the padding at
+	 the beginning, so that it has the same offsets.
+      */
+      if (mprotect (to->head, (char *)to->next - (char *)to->head,
+		    PROT_READ | PROT_WRITE) < 0)
+	dyn_error ("Can't write-enable %s: %m", to->filename);
+      to->next = to->start;
+      ss_alloc (to, old_len);
+      memcpy (to->start, ss->start, old_len * sizeof (uint32_t));
+      for (int i = 0; i < 16; i++)
+	to->counts[i] = ss->counts[i];
+      to->full_len = ss->full_len;
+
+      gc.old_end = ss->start + old_len;
+    }
+  gc.copy_start = gc.to_store->next;
+
+  root = ss_gc_run (&gc);
+
+  if (!gc.minor)
+    gc.to_store->full_len = gc.to_store->next - gc.to_store->start;
+  gc.to_store->generation = ss->generation + 1;
+  gc.to_store->alloced_words = 0;
+  ss_set_root (gc.to_store, root);
+
+  return gc.to_store;
+}
+
+static ss_store
+ss_gc_replace (ss_store ss, ss_store to_store)
+{
+  if (rename (to_store->filename, ss->filename) < 0)
+    dyn_error ("Can't rename %s to %s: %m",
+	      to_store->filename, ss->filename);
+
+  free (to_store->filename);
+  to_store->filename = ss->filename;
+  ss->filename = NULL;
+
+  return to_store;
+}
+
+/* A minor collection in place.
+
+   The survivors are appended to the store, starting on a fresh page,
+   and the new root is committed through the header slots like any
+   other.  The young generation stays where it is as garbage, for the
+   readers that might still be using it, and becomes part of the old
+   generation, which a full collection will clean up eventually.  Only
+   the young generation is read and only the survivors are written.
+
+   While collecting, the pages of the young generation are mapped
+   privately, so that the forwarding pointers don't end up in the
+   file.
+ */
+
+static void
+ss_gc_map_young (ss_store ss, char *start, size_t size, bool private)
+{
+  if (size > 0
+      && mmap (start, size,
+	       private? PROT_READ | PROT_WRITE : PROT_READ,
+	       (private? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED,
+	       ss->fd, start - (char *)ss->head) == MAP_FAILED)
+    {
+      if (private)
+	dyn_error ("Can't disconnect from %s: %m", ss->filename);
+
+      /* The young generation is now inaccessible.
+       */
+      fprintf (stderr, "Can't reconnect to %s, aborting.\n", ss->filename);
+      abort ();
+    }
+}
+
+static void
+ss_gc_minor_in_place (ss_store ss)
+{
+  ss_gc_data gc;
+  ss_val root;
+  uint32_t *young = ss->start + ss->slot.len - ss->slot.alloced;
+  char *young_page = (char *)((uintptr_t)young & ~PAGE_MASK);
+  uint32_t *old_next = ss->next;
+  int old_alloced = ss->alloced_words;
+  uint32_t *fresh_page = (uint32_t *)(((uintptr_t)ss->next + PAGE_MASK)
+				      & ~PAGE_MASK);
+  size_t young_size;
+
+  ss_alloc (ss, fresh_page - ss->next);
+  young_size = (char *)ss->next - young_page;
+
+  memset (&gc, 0, sizeof (gc));
+  gc.from_store = ss;
+  gc.to_store = ss;
+  gc.minor = true;
+  gc.old_end = young;
+  gc.copy_start = ss->next;
+
+  void reconnect (int for_throw, void *data)
+  {
+    ss_gc_map_young (ss, young_page, young_size, false);
+    if (for_throw)
+      {
+	ss->next = old_next;
+	ss->alloced_words = old_alloced;
+      }
+  }
+
+  dyn_block
+    {
+      ss_gc_map_young (ss, young_page, young_size, true);
+      dyn_on_unwind (reconnect, NULL);
+      root = ss_gc_run (&gc);
+    }
+
+  ss->alloced_words = 0;
+  ss->gc_backoff = 0;
+  ss_set_root (ss, root);
+}
+
+ss_store 
+ss_gc (ss_store ss)
+{
+  return ss_gc_replace (ss, ss_gc_collect (ss, false));
+}
+
+ss_store 
+ss_gc_minor (ss_store ss)
+{
+  if (ss->branch)
+    dyn_error ("Can't collect %s", ss->filename);
+
+  if (ss->slot.alloced > ss->slot.len)
+    return ss_gc (ss);
+
+  ss_gc_minor_in_place (ss);
+  return ss;
+}
+
+/* When to collect.
+
+   A collection is due when SS_GC_YOUNG_WORDS words have been
+   allocated since the last one.  It is a full collection when the
+   store has grown to more than SS_GC_FULL_FACTOR times the size that
+   it had after the last full collection, or when that size is not
+   known.  Minor collections leave the young garbage in the file, and
+   survivors that die later are only found by a full collection, so
+   this keeps the file within a constant factor of the live data,
+   while the cost of the full collections is spread over the
+   allocations that made them necessary.
+ */
+
+#define SS_GC_YOUNG_WORDS  (5*1024*1024)
+#define SS_GC_FULL_FACTOR  2
+
+static int ss_gc_young_words = SS_GC_YOUNG_WORDS;
+
+void
+ss_gc_set_young_words (int n)
+{
+  ss_gc_young_words = n > 0? n : SS_GC_YOUNG_WORDS;
+}
+
+static bool
+ss_gc_due (ss_store ss)
+{
+  return ((ss->prot & PROT_WRITE) && !ss->branch
+	  && ss->slot.alloced > (uint32_t)ss_gc_young_words);
+}
+
+static bool
+ss_gc_full_due (ss_store ss)
+{
+  return (ss->slot.full_len == 0
+	  || ss->slot.alloced > ss->slot.len
+	  || ss->slot.len > SS_GC_FULL_FACTOR * (size_t)ss->slot.full_len);
+}
+
+/* Deferred collections
+
+   A deferred collection runs in a detached process, from the root that
+   is committed when it is started.  A full one collects into FILE.gc,
+   just like a normal one.  A minor one collects the young generation
+   in place, but in a branch, so that FILE isn't touched, and writes
+   the survivors to FILE.gc.
+
+   Either way, a struct ss_gc_result is appended to FILE.gc.  It
+   records the header and inode of FILE as they were when the
+   collection started, and what to do with the words before it.  Then
+   FILE.gc is renamed to FILE.gcnew.  Thus, FILE.gcnew is always
+   complete and describes itself, and a newer result replaces an older
+   one atomically.  Collectors lock FILE.gc, so only one of them runs
+   at a time.
+
+   The next time that FILE is opened for writing, the result is used
+   if FILE still has the recorded header and inode, i.e., if no new
+   root has been committed in the meantime.  The store file of a full
+   collection replaces FILE, and the survivors of a minor one are
+   appended to FILE at the recorded offset and committed with the
+   recorded slot, exactly like the collector did in its branch.
+   Otherwise, the result is outdated and is thrown away.
+ */
+
+#define SS_GC_RESULT_MAGIC 0x52434753 /* SGCR */
+
+struct ss_gc_result {
+  uint32_t magic;
+  uint32_t minor;
+  uint64_t size;         // in bytes, of the file before this
+  uint64_t base_dev;
+  uint64_t base_ino;
+  struct ss_header base; // only the header of its version is used
+  uint32_t offset;       // in words, where a minor result goes
+  uint32_t slot_index;   // which slot a minor result commits
+  struct ss_header_slot slot;
+};
+
+static char *
+ss_gc_deferred_file (const char *filename, const char *suffix)
+{
+  char *name;
+  asprintf (&name, "%s%s", filename, suffix);
+  return name;
+}
+
+static void
+ss_gc_deferred_run (ss_store ss, struct ss_gc_result *res)
+{
+  char *gcfile, *newfile = ss_gc_deferred_file (ss->filename, ".gcnew");
+  int fd;
+
+  if (res->minor)
+    {
+      ss_store br = ss_branch (ss, ss_get_root (ss));
+      uint32_t *fresh = br->next;
+
+      ss_gc_minor_in_place (br);
+      res->size = (char *)br->next - (char *)fresh;
+      res->offset = fresh - br->start;
+      res->slot_index = br->slot_index;
+      res->slot = br->slot;
+
+      gcfile = ss_gc_deferred_file (ss->filename, ".gc");
+      fd = open (gcfile, O_RDWR | O_CREAT, 0666);
+      if (fd < 0)
+	dyn_error ("Can't create %s: %m", gcfile);
+      ss_lock (fd, gcfile);
+      if (ftruncate (fd, 0) < 0
+	  || write (fd, fresh, res->size) != (ssize_t)res->size)
+	dyn_error ("Can't write %s: %m", gcfile);
+    }
+  else
+    {
+      ss_store to_store = ss_gc_collect (ss, false);
+      gcfile = to_store->filename;
+      fd = to_store->fd;
+      res->size = to_store->file_size;
+    }
 
-  if (copy)
-    SS_SET_FORWARD (node, SS_OFFSET (gc->to_store, copy));
-  else
-    SS_SET_FORWARD (node, 0);
+  if (pwrite (fd, res, sizeof (*res), res->size) != sizeof (*res)
+      || fsync (fd) < 0)
+    dyn_error ("Can't write %s: %m", gcfile);
 
-  return copy;
+  if (rename (gcfile, newfile) < 0)
+    dyn_error ("Can't rename %s to %s: %m", gcfile, newfile);
 }
 
-static ss_val 
-ss_gc_scan_and_advance (ss_gc_data *gc, ss_val obj)
+/* Whether a collector is working on FILENAME right now.
+ */
+static bool
+ss_gc_deferred_running (const char *filename)
 {
-  uint32_t len = SS_LEN (obj), i;
+  char *gcfile = ss_gc_deferred_file (filename, ".gc");
+  struct flock lock;
+  bool running = false;
+  int fd;
 
-  if (SS_TAG (obj) != SS_BLOB_TAG)
+  fd = open (gcfile, O_RDONLY);
+  if (fd >= 0)
     {
-      for (i = 0; i < len; i++)
-	ss_set (obj, i, ss_gc_copy (gc, ss_ref (obj, i)));
+      lock.l_type = F_WRLCK;
+      lock.l_whence = SEEK_SET;
+      lock.l_start = 0;
+      lock.l_len = sizeof (struct ss_header);
+      running = (fcntl (fd, F_GETLK, &lock) == 0
+		 && lock.l_type != F_UNLCK);
+      close (fd);
     }
-  else
-    len = SS_BLOB_LEN_TO_WORDS (len);
-  
-  return (ss_val )(((uint32_t *)obj) + len + 1);
+
+  free (gcfile);
+  return running;
 }
 
 static void
-ss_gc_scan (ss_gc_data *gc)
+ss_gc_deferred_start (ss_store ss, bool full)
 {
-  ss_val to_ptr;
-  for (to_ptr = (ss_val)gc->to_store->start;
-       to_ptr < (ss_val)gc->to_store->next;
-       to_ptr = ss_gc_scan_and_advance (gc, to_ptr))
-    ;
+  struct ss_gc_result res;
+  char *newfile;
+  struct stat buf;
+  pid_t pid;
+
+  if (ss->branch)
+    dyn_error ("Can't collect %s", ss->filename);
+
+  ss_flush (ss);
+  if (fstat (ss->fd, &buf) < 0)
+    dyn_error ("Can't stat %s: %m", ss->filename);
+
+  memset (&res, 0, sizeof (res));
+  res.magic = SS_GC_RESULT_MAGIC;
+  res.minor = !full && ss->slot.alloced <= ss->slot.len;
+  res.base_dev = buf.st_dev;
+  res.base_ino = buf.st_ino;
+  memcpy (&res.base, ss->head, ss_header_size (ss->version));
+
+  /* Whatever result there is, it is about to be outdated.
+   */
+  newfile = ss_gc_deferred_file (ss->filename, ".gcnew");
+  unlink (newfile);
+  free (newfile);
+
+  void collect (void *data)
+  {
+    ss_gc_deferred_run (ss, &res);
+  }
+
+  /* Fork twice so that nobody needs to wait for the collector.  The
+     collector doesn't run any unwind handlers or exit hooks of its
+     parent.
+  */
+
+  fflush (NULL);
+  pid = fork ();
+  if (pid < 0)
+    dyn_error ("Can't fork: %m");
+  else if (pid == 0)
+    {
+      if (fork () == 0)
+	{
+	  nice (10);
+	  _exit (dyn_catch_error (collect, NULL) != NULL);
+	}
+      _exit (0);
+    }
+  else
+    waitpid (pid, NULL, 0);
 }
 
-static ss_val
-ss_gc_copy_phase (ss_gc_data *gc, ss_val root, int phase)
+void
+ss_gc_deferred (ss_store ss)
 {
-  gc->phase = phase;
-  root = ss_gc_copy (gc, root);
-  ss_gc_scan (gc);
-  return root;
+  ss_gc_deferred_start (ss, false);
 }
 
-static void
-ss_gc_ripple_dicts (ss_gc_data *gc)
-{
-  int i;
+/* A deferred collection is not started while another one is still
+   running.  And when the result of one had to be thrown away while
+   opening SS, the next one waits until another young generation has
+   been allocated, instead of being started right away again when SS
+   is done.
+ */
 
-  gc->phase = 1;
-  do {
-    gc->again = 0;
-    for (i = 0; i < gc->n_delayed; i++)
-      {
-	ss_val d = gc->delayed[i];
-	if (ss_is (d, WEAK_DICT_DISPATCH_TAG)
-	    || ss_is (d, WEAK_DICT_SEARCH_TAG))
-	  {
-	    dyn_foreach_x ((ss_val key, ss_val val),
-			   ss_dict_node_foreach, WEAK_DICT_DISPATCH_TAG, d)
-	      {
-		/* If the key is alive, we make sure that the value is
-		   alive, too.  Since the value might be used in
-		   another dict, we need to scan again.
-		*/
-		if (ss_gc_alive_p (gc, key)
-		    && !ss_gc_alive_p (gc, val))
-		  {
-		    ss_gc_copy (gc, val);
-		    gc->again = 1;
-		  }
-	      }
-	  }
-	else if (ss_is (d, WEAK_SETS_DISPATCH_TAG)
-		 || ss_is (d, WEAK_SETS_SEARCH_TAG))
-	  {
-	    dyn_foreach_x ((ss_val key, ss_val val),
-			   ss_dict_node_foreach, WEAK_SETS_DISPATCH_TAG, d)
-	      {
-		/* If any of the values are alive, we make sure that
-		   the key is alive, too.  Since the key might be used
-		   in another dict, we need to scan again.
-		*/
-		if (val && !ss_gc_alive_p (gc, key))
-		  {
-		    int len = ss_len (val);
-		    for (int i = 0; i < len; i++)
-		      if (ss_gc_alive_p (gc, ss_ref (val, i)))
-			{
-			  ss_gc_copy (gc, key);
-			  gc->again = 1;
-			  break;
-			}
-		  }
-	      }
-	  }
-      }
-  } while (gc->again);
+void
+ss_maybe_gc_deferred (ss_store ss)
+{
+  if (ss_gc_due (ss)
+      && ss->slot.alloced > ss->gc_backoff + (uint32_t)ss_gc_young_words
+      && !ss_gc_deferred_running (ss->filename))
+    ss_gc_deferred_start (ss, ss_gc_full_due (ss));
 }
 
-ss_store 
-ss_gc (ss_store ss)
-{
-  ss_gc_data gc;
-  ss_val root;
-  char *newfile;
+/* Install the result of a deferred collection for FILENAME, if there
+   is one and it is still current.  FD is a locked descriptor for
+   FILENAME.  Returns true when FILENAME has been replaced.  DISCARDED
+   is set when an outdated result has been thrown away.
+ */
 
-  /* Disconnect old store from file.
-   */
-  if (mmap (ss->head, ss->file_size, PROT_READ | PROT_WRITE, 
-	    MAP_PRIVATE | MAP_FIXED, ss->fd, 0)
-      == MAP_FAILED)
-    dyn_error ("Can't disconnect from %s: %m", ss->filename);
+static bool
+ss_gc_deferred_adopt (const char *filename, int fd, bool *discarded)
+{
+  char *newfile = ss_gc_deferred_file (filename, ".gcnew");
+  struct ss_gc_result res;
+  struct ss_header head;
+  struct stat buf, new_buf;
+  size_t head_size;
+  bool valid, current, replaced = false;
+  int new_fd;
 
-  asprintf (&newfile, "%s.gc", ss->filename);
-  gc.from_store = ss;
-  gc.to_store = ss_open (newfile, SS_TRUNC);
-  gc.n_delayed = 0;
+  *discarded = false;
 
-  root = ss_gc_copy_phase (&gc, ss_get_root (ss), 0);
-  ss_gc_ripple_dicts (&gc);
-  root = ss_gc_copy_phase (&gc, root, 2);
+  new_fd = open (newfile, O_RDWR);
+  if (new_fd < 0)
+    {
+      free (newfile);
+      return false;
+    }
 
-  gc.to_store->alloced_words = 0;
-  ss_set_root (gc.to_store, root);
+  valid = (fstat (new_fd, &new_buf) == 0
+	   && new_buf.st_size >= (off_t)sizeof (res)
+	   && pread (new_fd, &res, sizeof (res),
+		     new_buf.st_size - sizeof (res)) == sizeof (res)
+	   && res.magic == SS_GC_RESULT_MAGIC
+	   && res.size == new_buf.st_size - sizeof (res)
+	   && res.base.magic == SS_MAGIC
+	   && res.base.version >= 2 && res.base.version <= SS_VERSION);
+
+  head_size = valid? ss_header_size (res.base.version) : 0;
+  current = (valid
+	     && fstat (fd, &buf) == 0
+	     && buf.st_dev == res.base_dev && buf.st_ino == res.base_ino
+	     && pread (fd, &head, head_size, 0) == (ssize_t)head_size
+	     && memcmp (&head, &res.base, head_size) == 0);
+
+  if (current && !res.minor)
+    {
+      if (ftruncate (new_fd, res.size) < 0 || fsync (new_fd) < 0)
+	dyn_error ("Can't truncate %s: %m", newfile);
+      if (rename (newfile, filename) < 0)
+	dyn_error ("Can't rename %s to %s: %m", newfile, filename);
+      replaced = true;
+    }
+  else if (current)
+    {
+      void *words = NULL;
 
-  /* Rename file
-   */
-  if (rename (gc.to_store->filename, ss->filename) < 0)
-    dyn_error ("Can't rename %s to %s: %m",
-	      gc.to_store->filename, ss->filename);
+      if (res.size > 0)
+	{
+	  words = mmap (NULL, res.size, PROT_READ, MAP_SHARED, new_fd, 0);
+	  if (words == MAP_FAILED)
+	    dyn_error ("Can't map %s: %m", newfile);
+	}
 
-  free (gc.to_store->filename);
-  gc.to_store->filename = ss->filename;
-  ss->filename = NULL;
+      if ((res.size > 0
+	   && pwrite (fd, words, res.size,
+		      head_size + res.offset * sizeof (uint32_t))
+	   != (ssize_t)res.size)
+	  || fdatasync (fd) < 0
+	  || !ss_put_slot (fd, res.base.version, res.slot_index, &res.slot)
+	  || fdatasync (fd) < 0)
+	dyn_error ("Can't commit %s: %m", filename);
+
+      if (words)
+	munmap (words, res.size);
+    }
+  else
+    *discarded = valid;
 
-  return gc.to_store;
+  close (new_fd);
+  if (!replaced)
+    unlink (newfile);
+  free (newfile);
+  return replaced;
 }
 
 ss_store 
 ss_maybe_gc (ss_store ss)
 {
-  if (ss->head->alloced > 5*1024*1024)
+  if (ss_gc_due (ss))
     {
       fprintf (stderr, "(Garbage collecting...");
       fflush (stderr);
-      ss = ss_gc (ss);
+      if (ss_gc_full_due (ss))
+	ss = ss_gc (ss);
+      else
+	ss = ss_gc_minor (ss);
       fprintf (stderr, ")\n");
     }
 
@@ -905,19 +3445,24 @@ ss_to_int (ss_val obj)
 int
 ss_tag (ss_val obj)
 {
+  if (SS_TAG(obj) == SS_ZBLOB_TAG)
+    return SS_BLOB_TAG;
   return SS_TAG(obj);
 }
 
 int
 ss_len (ss_val obj)
 {
+  if (SS_TAG(obj) == SS_ZBLOB_TAG)
+    return SS_WORD(obj,1);
   return SS_LEN(obj);
 }
 
 int
 ss_is (ss_val obj, int tag)
 {
-  return obj && SS_TAG(obj) == tag;
+  return obj && (SS_TAG(obj) == tag
+		 || (tag == SS_BLOB_TAG && SS_TAG(obj) == SS_ZBLOB_TAG));
 }
 
 void
@@ -932,11 +3477,10 @@ ss_assert (ss_val obj, int tag, int min_len)
 ss_val 
 ss_ref (ss_val obj, int i)
 {
-  uint32_t val = SS_WORD(obj,i+1);
-  if (val == 0 || SS_IS_INT (val))
-    return (ss_val )val;
+  if (SS_IS_UNSTORED (obj))
+    return SS_UNSTORED_REFS(obj)[i];
   else
-    return (ss_val )((uint32_t *)obj + (val>>2));
+    return ss_decode_ref (obj, SS_WORD(obj,i+1));
 }
 
 int
@@ -948,22 +3492,47 @@ ss_ref_int (ss_val obj, int i)
 void
 ss_set (ss_val obj, int i, ss_val val)
 {
-  if (val == NULL || SS_IS_INT (val))
-    SS_SET_WORD (obj, i+1, (uint32_t)val);
+  if (SS_IS_UNSTORED (obj))
+    SS_UNSTORED_REFS(obj)[i] = val;
+  else
+    SS_SET_WORD (obj, i+1, ss_encode_ref (obj, val));
+}
+
+static uint32_t *ss_alloc_unstored (size_t bytes);
+
+#define SS_UNSTORED_RECORD_SIZE(len) (2*sizeof(uint32_t)+(len)*sizeof(ss_val))
+
+static uint32_t *
+ss_alloc_record (ss_store ss, int tag, int len)
+{
+  uint32_t *w;
+
+  if (len < 0 || len > SS_MAX_LEN)
+    dyn_error ("Record too large: %d fields", len);
+
+  if (ss == NULL)
+    {
+      w = ss_alloc_unstored (SS_UNSTORED_RECORD_SIZE (len));
+      SS_SET_HEADER (w, tag, len | SS_UNSTORED_FLAG);
+    }
   else
-    SS_SET_WORD (obj, i+1, ((uint32_t *)val - (uint32_t *)obj) << 2);
+    {
+      w = ss_alloc (ss, len + 1);
+      SS_SET_HEADER (w, tag, len);
+    }
+
+  return w;
 }
 
 ss_val 
 ss_newv (ss_store ss, int tag, int len, ss_val *vals)
 {
-  uint32_t *w = ss_alloc (ss, len + 1);
+  uint32_t *w = ss_alloc_record (ss, tag, len);
   int i;
 
   if (tag >= 64 && tag < 80 && len > 0)
     vals[0] = ss_from_int (ss->counts[tag-64]++);
 
-  SS_SET_HEADER (w, tag, len);
   for (i = 0; i < len; i++)
     {
       ss_assert_in_store (ss, vals[i]);
@@ -976,12 +3545,11 @@ ss_newv (ss_store ss, int tag, int len, ss_val *vals)
 ss_val 
 ss_new (ss_store ss, int tag, int len, ...)
 {
-  uint32_t *w = ss_alloc (ss, len + 1);
+  uint32_t *w = ss_alloc_record (ss, tag, len);
   va_list ap;
   int i;
 
   va_start (ap, len);
-  SS_SET_HEADER (w, tag, len);
   for (i = 0; i < len; i++)
     {
       ss_val val = va_arg (ap, ss_val);
@@ -999,10 +3567,9 @@ ss_val
 ss_make (ss_store ss, int tag, int len, ss_val init)
 {
   int i;
-  uint32_t *w = ss_alloc (ss, len + 1);
+  uint32_t *w = ss_alloc_record (ss, tag, len);
 
   ss_assert_in_store (ss, init);
-  SS_SET_HEADER (w, tag, len);
   for (i = 0; i < len; i++)
     {
       ss_val val = init;
@@ -1017,26 +3584,204 @@ ss_make (ss_store ss, int tag, int len, ss_val init)
 int
 ss_is_blob (ss_val o)
 {
-  return SS_TAG(o) == SS_BLOB_TAG;
+  return SS_IS_RAW(o);
+}
+
+/* Compressed blobs are decompressed into a small cache, and the
+   SS_ZCACHE_SIZE most recently decompressed ones are kept.  Each
+   thread has its own cache.
+
+   When a store is closed, the objects in its address range might be
+   replaced by others at the same addresses, and their entries must
+   go.  Ss_zcache_forget records the range of the closed store in a
+   log, and each cache drops the entries in the ranges that have been
+   logged since it last looked, the next time it is used.  A cache
+   that has fallen behind by more than SS_ZCACHE_CLOSED stores is
+   emptied.
+ */
+
+#define SS_ZCACHE_SIZE   16
+#define SS_ZCACHE_CLOSED 16
+
+typedef struct {
+  struct {
+    ss_val obj;
+    void *data;
+    int capacity;
+  } entries[SS_ZCACHE_SIZE];
+  int next;
+  uint32_t n_closed;     // how many closed stores have been looked at
+} ss_zcache;
+
+static SS_THREAD_LOCAL ss_zcache *ss_zcache_current;
+
+static pthread_mutex_t ss_zcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  char *start, *end;
+} ss_zcache_closed[SS_ZCACHE_CLOSED];
+static uint32_t ss_zcache_n_closed;
+static pthread_key_t ss_zcache_key;
+static pthread_once_t ss_zcache_key_once = PTHREAD_ONCE_INIT;
+
+static void
+ss_zcache_free (void *data)
+{
+  ss_zcache *c = data;
+  for (int i = 0; i < SS_ZCACHE_SIZE; i++)
+    free (c->entries[i].data);
+  free (c);
+}
+
+static void
+ss_zcache_make_key ()
+{
+  pthread_key_create (&ss_zcache_key, ss_zcache_free);
+}
+
+static void
+ss_zcache_forget (ss_store ss)
+{
+  pthread_mutex_lock (&ss_zcache_lock);
+  uint32_t n = ss_zcache_n_closed;
+  ss_zcache_closed[n % SS_ZCACHE_CLOSED].start = (char *)ss->head;
+  ss_zcache_closed[n % SS_ZCACHE_CLOSED].end = ((char *)ss->head
+						+ ss->reserved_size);
+  __atomic_store_n (&ss_zcache_n_closed, n + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&ss_zcache_lock);
+}
+
+static void
+ss_zcache_catch_up (ss_zcache *c)
+{
+  pthread_mutex_lock (&ss_zcache_lock);
+  uint32_t n = ss_zcache_n_closed;
+  for (int i = 0; i < SS_ZCACHE_SIZE; i++)
+    {
+      char *obj = (char *)c->entries[i].obj;
+      if (obj == NULL)
+	continue;
+      if (n - c->n_closed > SS_ZCACHE_CLOSED)
+	c->entries[i].obj = NULL;
+      else
+	for (uint32_t k = c->n_closed; k != n; k++)
+	  if (ss_zcache_closed[k % SS_ZCACHE_CLOSED].start <= obj
+	      && obj < ss_zcache_closed[k % SS_ZCACHE_CLOSED].end)
+	    c->entries[i].obj = NULL;
+    }
+  c->n_closed = n;
+  pthread_mutex_unlock (&ss_zcache_lock);
+}
+
+static ss_zcache *
+ss_zcache_get ()
+{
+  ss_zcache *c = ss_zcache_current;
+
+  if (c == NULL)
+    {
+      c = dyn_calloc (sizeof (ss_zcache));
+      c->n_closed = __atomic_load_n (&ss_zcache_n_closed, __ATOMIC_ACQUIRE);
+      pthread_once (&ss_zcache_key_once, ss_zcache_make_key);
+      pthread_setspecific (ss_zcache_key, c);
+      ss_zcache_current = c;
+    }
+  else if (c->n_closed != __atomic_load_n (&ss_zcache_n_closed,
+					   __ATOMIC_ACQUIRE))
+    ss_zcache_catch_up (c);
+
+  return c;
+}
+
+static void *
+ss_zblob_start (ss_val b)
+{
+  ss_zcache *c = ss_zcache_get ();
+  int i;
+
+  for (i = 0; i < SS_ZCACHE_SIZE; i++)
+    if (c->entries[i].obj == b)
+      return c->entries[i].data;
+
+  i = c->next;
+  c->next = (i + 1) % SS_ZCACHE_SIZE;
+  c->entries[i].obj = NULL;
+  c->entries[i].data = dyn_mgrow (c->entries[i].data,
+				  &c->entries[i].capacity,
+				  1, SS_WORD (b, 1));
+
+  uLongf len = SS_WORD (b, 1);
+  if (uncompress (c->entries[i].data, &len,
+		  (Bytef *)(((uint32_t *)b) + 2), SS_LEN (b) - 4) != Z_OK
+      || len != SS_WORD (b, 1))
+    dyn_error ("Corrupted compressed blob");
+
+  c->entries[i].obj = b;
+  return c->entries[i].data;
 }
 
 void *
 ss_blob_start (ss_val b)
 {
+  if (SS_TAG(b) == SS_ZBLOB_TAG)
+    return ss_zblob_start (b);
   return ((uint32_t *)b) + 1;
 }
 
 ss_val 
 ss_blob_new (ss_store ss, int len, void *blob)
 {
-  uint32_t *w = ss_alloc (ss, SS_BLOB_LEN_TO_WORDS(len) + 1);
+  uint32_t *w;
 
-  SS_SET_HEADER(w, SS_BLOB_TAG, len);
+  if (len < 0 || len > SS_MAX_LEN)
+    dyn_error ("Blob too large: %d bytes", len);
+
+  if (ss == NULL)
+    {
+      w = ss_alloc_unstored (sizeof (uint32_t) + len);
+      SS_SET_HEADER(w, SS_BLOB_TAG, len | SS_UNSTORED_FLAG);
+    }
+  else
+    {
+      w = ss_alloc (ss, SS_BLOB_LEN_TO_WORDS(len) + 1);
+      SS_SET_HEADER(w, SS_BLOB_TAG, len);
+    }
   memcpy (w+1, blob, len);
 
   return (ss_val )w;
 }
 
+/* Blobs of at least SS_ZBLOB_MIN_LEN bytes are compressed when that
+   saves at least an eighth of their size.
+ */
+
+#define SS_ZBLOB_MIN_LEN 256
+
+ss_val
+ss_blob_new_compressed (ss_store ss, int len, void *blob)
+{
+  if (ss == NULL || ss->version < 4 || len < SS_ZBLOB_MIN_LEN)
+    return ss_blob_new (ss, len, blob);
+
+  uLongf zlen = compressBound (len);
+  Bytef *zbuf = dyn_malloc (zlen);
+  ss_val b;
+
+  if (compress (zbuf, &zlen, blob, len) != Z_OK
+      || zlen + 4 > len - len / 8)
+    b = ss_blob_new (ss, len, blob);
+  else
+    {
+      uint32_t *w = ss_alloc (ss, SS_BLOB_LEN_TO_WORDS (zlen + 4) + 1);
+      SS_SET_HEADER (w, SS_ZBLOB_TAG, zlen + 4);
+      w[1] = len;
+      memcpy (w+2, zbuf, zlen);
+      b = (ss_val )w;
+    }
+
+  free (zbuf);
+  return b;
+}
+
 ss_val 
 ss_copy (ss_store ss, ss_val obj)
 {
@@ -1061,72 +3806,317 @@ ss_copy (ss_store ss, ss_val obj)
    observe transactions etc.  No stored object can refer to an
    unstored object, of course.
 
-   Unstored objects have the same layout as stored objects so that
-   they can be used interchangeably with the stored objects.  They
-   also support modifying their content and efficiently changing their
-   size in small steps.
+   Unstored objects can be used interchangeably with the stored
+   objects, although their fields are full pointers instead of
+   offsets.  They also support modifying their content and efficiently
+   changing their size in small steps.
 
    The idea is that you create your data structure incrementally until
    all objects are in place and have the right size, and then ou store
    the whole thing in one go.  This is advantagous to doing it all in
    the store itself since much less garbage is created.
 
-   (Creating a lot of garbage in a store is a problem since it can not
-   be collected on-demand, only when the store is otherwise unused.)
+   (Creating a lot of garbage in a store is a problem since it can not
+   be collected on-demand, only when the store is otherwise unused.)
+
+   A unstored object is created when using NULL as the store with any
+   of the object creation functions.
+
+   The following mutation functions are capable of operating on both
+   stored and unstored objects.  They generally create a new object
+   that is the modified version of the input object.  If the input
+   object is unstored, the functions will destroy it.
+ */
+
+/* Each unstored object is preceded by a ss_unstored_prefix that
+   records how many bytes are reserved for it, so that it can grow in
+   place, and where its memory comes from.
+
+   Tables, dictionaries and vectors allocate the nodes of their tries
+   from an arena while they are being changed, see ss_arena_enter.  An arena
+   hands out blocks from big chunks, keeps freed blocks in one free
+   list per size, and gives all its memory back at once when the trie
+   has been stored or is abandoned.  Other unstored objects, and big
+   ones, are malloced individually.
+ */
+
+typedef struct {
+  uint32_t size;
+  uint32_t arena;    // arena id << 4 | size class, or 0 when malloced
+} ss_unstored_prefix;
+
+#define SS_PREFIX(obj)  (((ss_unstored_prefix *)(obj)) - 1)
+
+#define SS_ARENA_CHUNK_SIZE  (64*1024)
+#define SS_ARENA_N_CLASSES   8
+#define SS_ARENA_BLOCK(c)    (32 << (c))
+
+typedef struct ss_arena_chunk {
+  struct ss_arena_chunk *next;
+  uint64_t padding;
+} ss_arena_chunk;
+
+typedef struct {
+  uint32_t id;
+  ss_arena_chunk *chunks;
+  char *next, *end;
+  ss_unstored_prefix *free[SS_ARENA_N_CLASSES];
+} ss_arena;
+
+/* Each thread has its own current arena and its own counters.  Arena
+   ids are unique over all threads, so that a block of an arena is
+   never mistaken for one of another.  The counters of threads that
+   have exited are reused by new threads, and ss_get_unstored_stats
+   adds them all up.
+ */
+
+typedef struct ss_stats_block {
+  struct ss_stats_block *next, *next_idle;
+  ss_unstored_stats stats;
+} ss_stats_block;
+
+static SS_THREAD_LOCAL ss_arena *ss_current_arena;
+static uint32_t ss_arena_next_id = 1;
+
+static SS_THREAD_LOCAL ss_stats_block *ss_stats;
+static pthread_mutex_t ss_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ss_stats_block *all_stats, *idle_stats;
+static pthread_key_t ss_stats_key;
+static pthread_once_t ss_stats_key_once = PTHREAD_ONCE_INIT;
+
+static void
+ss_stats_release (void *data)
+{
+  ss_stats_block *b = data;
+  pthread_mutex_lock (&ss_stats_lock);
+  b->next_idle = idle_stats;
+  idle_stats = b;
+  pthread_mutex_unlock (&ss_stats_lock);
+}
+
+static void
+ss_stats_make_key ()
+{
+  pthread_key_create (&ss_stats_key, ss_stats_release);
+}
+
+static ss_unstored_stats *
+ss_stats_get ()
+{
+  if (ss_stats == NULL)
+    {
+      ss_stats_block *b;
+
+      pthread_mutex_lock (&ss_stats_lock);
+      b = idle_stats;
+      if (b)
+	idle_stats = b->next_idle;
+      pthread_mutex_unlock (&ss_stats_lock);
+
+      if (b == NULL)
+	{
+	  b = dyn_calloc (sizeof (ss_stats_block));
+	  pthread_mutex_lock (&ss_stats_lock);
+	  b->next = all_stats;
+	  all_stats = b;
+	  pthread_mutex_unlock (&ss_stats_lock);
+	}
+
+      pthread_once (&ss_stats_key_once, ss_stats_make_key);
+      pthread_setspecific (ss_stats_key, b);
+      ss_stats = b;
+    }
+  return &ss_stats->stats;
+}
+
+/* The counters are read by other threads in ss_get_unstored_stats.
+ */
+#define SS_COUNT(field) \
+  do { \
+    ss_unstored_stats *_s = ss_stats_get (); \
+    __atomic_store_n (&_s->field, _s->field + 1, __ATOMIC_RELAXED); \
+  } while (0)
+
+void
+ss_get_unstored_stats (ss_unstored_stats *stats)
+{
+  memset (stats, 0, sizeof (*stats));
+
+  pthread_mutex_lock (&ss_stats_lock);
+  for (ss_stats_block *b = all_stats; b; b = b->next)
+    {
+      ss_unstored_stats *s = &b->stats;
+      stats->mallocs += __atomic_load_n (&s->mallocs, __ATOMIC_RELAXED);
+      stats->arena_allocs += __atomic_load_n (&s->arena_allocs,
+					      __ATOMIC_RELAXED);
+      stats->arena_reused += __atomic_load_n (&s->arena_reused,
+					      __ATOMIC_RELAXED);
+      stats->arena_chunks += __atomic_load_n (&s->arena_chunks,
+					      __ATOMIC_RELAXED);
+      stats->grown_in_place += __atomic_load_n (&s->grown_in_place,
+						__ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&ss_stats_lock);
+}
+
+static void
+ss_arena_init (ss_arena *a)
+{
+  memset (a, 0, sizeof (*a));
+  do
+    a->id = (__atomic_fetch_add (&ss_arena_next_id, 1, __ATOMIC_RELAXED)
+	     & 0x0FFFFFFF);
+  while (a->id == 0);
+}
+
+static void
+ss_arena_release (ss_arena *a)
+{
+  if (ss_current_arena == a)
+    ss_current_arena = NULL;
+
+  while (a->chunks)
+    {
+      ss_arena_chunk *c = a->chunks;
+      a->chunks = c->next;
+      free (c);
+    }
+  ss_arena_init (a);
+}
+
+/* Make A the arena for unstored objects until ss_arena_leave.  This
+   is only done around changes to a trie that don't call out to code
+   outside of this file, so that no object from the arena can end up
+   anywhere else.
+ */
+
+static void
+ss_arena_enter (ss_arena *a)
+{
+  ss_current_arena = a;
+}
+
+static void
+ss_arena_leave ()
+{
+  ss_current_arena = NULL;
+}
+
+static ss_unstored_prefix *
+ss_arena_alloc (ss_arena *a, int class)
+{
+  size_t size = SS_ARENA_BLOCK (class);
+  ss_unstored_prefix *p;
 
-   A unstored object is created when using NULL as the store with any
-   of the object creation functions.
+  SS_COUNT (arena_allocs);
+  if (a->free[class])
+    {
+      p = a->free[class];
+      a->free[class] = *(ss_unstored_prefix **)(p + 1);
+      SS_COUNT (arena_reused);
+    }
+  else
+    {
+      if (a->next + size > a->end)
+	{
+	  ss_arena_chunk *c = dyn_malloc (SS_ARENA_CHUNK_SIZE);
+	  c->next = a->chunks;
+	  a->chunks = c;
+	  a->next = (char *)(c + 1);
+	  a->end = (char *)c + SS_ARENA_CHUNK_SIZE;
+	  SS_COUNT (arena_chunks);
+	}
+      p = (ss_unstored_prefix *)a->next;
+      a->next += size;
+    }
 
-   The following mutation functions are capable of operating on both
-   stored and unstored objects.  They generally create a new object
-   that is the modified version of the input object.  If the input
-   object is unstored, the functions will destroy it.
- */
+  p->size = size - sizeof (ss_unstored_prefix);
+  p->arena = a->id << 4 | class;
+  return p;
+}
 
 static size_t
-round_up_len (size_t n)
+round_up_size (size_t n)
 {
-  if (n > 128)
-    return (n + 1023) & ~1023;
-  else if (n > 16)
-    return 128;
+  if (n > 512)
+    return (n + 4095) & ~4095;
+  else if (n > 64)
+    return 512;
   else
-    return 16;
+    return 64;
 }
 
-static ss_val
-ss_realloc_unstored (ss_val obj, size_t words)
+static void
+ss_free_unstored (ss_val obj)
 {
-  /* Hopefully dyn_realloc will do the right thing quickly if the size
-     doesn't actually change.  XXX - check that.
-   */
-  ss_val new_obj = dyn_realloc (obj, sizeof(uint32_t)*round_up_len (words));
-  if (obj && new_obj != obj && SS_TAG (new_obj) != SS_BLOB_TAG)
+  ss_unstored_prefix *p = SS_PREFIX (obj);
+  ss_arena *a = ss_current_arena;
+
+  if (p->arena == 0)
+    free (p);
+  else if (a && p->arena >> 4 == a->id)
     {
-      /* Need to relocate all references.
+      /* Blocks of other arenas are just forgotten, they go away with
+	 their arena.
        */
-      uint32_t off = (char *)new_obj - (char *)obj;
-      int len = SS_LEN (new_obj);
-      uint32_t *elts = ((uint32_t *)new_obj) + 1;
-      for (int i = 0; i < len; i++)
-	{
-	  if (elts[i] && !ss_is_int ((ss_val)elts[i]))
-	    elts[i] -= off;
-	}
+      int class = p->arena & 0xF;
+      *(ss_unstored_prefix **)(p + 1) = a->free[class];
+      a->free[class] = p;
     }
-  return new_obj;
 }
 
-static uint32_t *
-ss_alloc_unstored (size_t words)
+static ss_val
+ss_realloc_unstored (ss_val obj, size_t bytes)
 {
-  return (uint32_t *)ss_realloc_unstored (NULL, words);
+  ss_unstored_prefix *p = obj? SS_PREFIX (obj) : NULL;
+  ss_arena *a = ss_current_arena;
+  size_t size = bytes + sizeof (ss_unstored_prefix);
+
+  if (p && bytes <= p->size)
+    {
+      SS_COUNT (grown_in_place);
+      return obj;
+    }
+
+  if (a && size <= SS_ARENA_BLOCK (SS_ARENA_N_CLASSES - 1))
+    {
+      int class = 0;
+      while (SS_ARENA_BLOCK (class) < size)
+	class++;
+      ss_unstored_prefix *n = ss_arena_alloc (a, class);
+      if (p)
+	{
+	  memcpy (n + 1, obj, p->size);
+	  ss_free_unstored (obj);
+	}
+      return (ss_val)(n + 1);
+    }
+  else
+    {
+      size = round_up_size (size);
+      SS_COUNT (mallocs);
+      if (p && p->arena == 0)
+	p = dyn_realloc (p, size);
+      else
+	{
+	  ss_unstored_prefix *n = dyn_malloc (size);
+	  if (p)
+	    {
+	      memcpy (n + 1, obj, p->size);
+	      ss_free_unstored (obj);
+	    }
+	  p = n;
+	}
+      p->size = size - sizeof (ss_unstored_prefix);
+      p->arena = 0;
+      return (ss_val)(p + 1);
+    }
 }
 
-static void
-ss_free_unstored (ss_val obj)
+static uint32_t *
+ss_alloc_unstored (size_t bytes)
 {
-  free (obj);
+  return (uint32_t *)ss_realloc_unstored (NULL, bytes);
 }
 
 static void
@@ -1145,16 +4135,15 @@ ss_deep_free_unstored (ss_store ss, ss_val obj)
   ss_free_unstored (obj);
 }
 
+/* Unstored objects carry SS_UNSTORED_FLAG in their header, which
+   stored objects never have, so this doesn't need to look at the open
+   stores.
+ */
+
 static int
 ss_is_unstored (ss_val obj)
 {
-  // XXX - makes this faster (but we usually have at most two stores,
-  //       so this is not that horrible)
-
-  for (ss_store s = all_stores; s; s = s->next_store)
-    if (ss_is_stored (s, obj))
-      return 0;
-  return 1;
+  return SS_IS_UNSTORED (obj) != 0;
 }
 
 static ss_val 
@@ -1188,10 +4177,12 @@ ss_insert_many (ss_store ss, ss_val obj, int index, int n, ...)
   if (ss == NULL && obj_is_unstored)
     {
       int len = ss_len (obj);
-      obj = ss_realloc_unstored (obj, len + n);
-      SS_SET_HEADER (obj, SS_TAG (obj), len + n);
-      uint32_t *elts = ((uint32_t *)obj)+1;
-      memmove (elts + index + n, elts + index, sizeof(uint32_t)*(len-index));
+      if (len + n > SS_MAX_LEN)
+	dyn_error ("Record too large: %d fields", len + n);
+      obj = ss_realloc_unstored (obj, SS_UNSTORED_RECORD_SIZE (len + n));
+      SS_SET_HEADER (obj, SS_TAG (obj), (len + n) | SS_UNSTORED_FLAG);
+      ss_val *elts = SS_UNSTORED_REFS (obj);
+      memmove (elts + index + n, elts + index, sizeof(ss_val)*(len-index));
       
       va_list ap;
       va_start (ap, n);
@@ -1255,9 +4246,9 @@ ss_remove_many (ss_store ss, ss_val obj, int index, int n)
   if (ss == NULL && obj_is_unstored)
     {
       int len = ss_len (obj);
-      SS_SET_HEADER (obj, SS_TAG (obj), len - n);
-      uint32_t *elts = ((uint32_t *)obj)+1;
-      memmove (elts + index, elts + index + n, sizeof(uint32_t)*(len-index-n));
+      SS_SET_HEADER (obj, SS_TAG (obj), (len - n) | SS_UNSTORED_FLAG);
+      ss_val *elts = SS_UNSTORED_REFS (obj);
+      memmove (elts + index, elts + index + n, sizeof(ss_val)*(len-index-n));
       return obj;
     }
   else
@@ -1298,19 +4289,68 @@ ss_unstore_object (ss_store ss, ss_val obj)
 /* Hashing and equality
  */
 
+/* The hash function for blobs of format version 2 and earlier.
+ */
+
 static uint32_t
-ss_hash_blob (int len, void *blob)
+ss_hash_blob_bytewise (int len, const void *blob)
 {
   uint32_t h = 0;
-  char *mem = (char *)blob;
+  const char *mem = blob;
 
   while (len-- > 0)
     h = *mem++ + h*37;
-  return h & 0x3FFFFFFF;
+  return h;
+}
+
+/* The hash function for blobs of format version 3.  It consumes eight
+   bytes per step and mixes them in with a multiplication, in the
+   style of splitmix64.  The result depends on the byte order, but so
+   does the rest of a store.
+ */
+
+static inline uint64_t
+ss_hash_mix (uint64_t h, uint64_t w)
+{
+  h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+  return h ^ (h >> 31);
+}
+
+static uint32_t
+ss_hash_blob_wordwise (int len, const void *blob)
+{
+  const char *mem = blob;
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ len, w;
+
+  while (len >= 8)
+    {
+      memcpy (&w, mem, 8);
+      h = ss_hash_mix (h, w);
+      mem += 8;
+      len -= 8;
+    }
+  if (len > 0)
+    {
+      w = 0;
+      memcpy (&w, mem, len);
+      h = ss_hash_mix (h, w);
+    }
+
+  h *= 0x94D049BB133111EBULL;
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint32_t
+ss_hash_blob (ss_store ss, int len, const void *blob)
+{
+  if (ss->version >= 3)
+    return ss_hash_blob_wordwise (len, blob) & 0x3FFFFFFF;
+  else
+    return ss_hash_blob_bytewise (len, blob) & 0x3FFFFFFF;
 }
 
 uint32_t
-ss_hash (ss_val o)
+ss_hash (ss_store ss, ss_val o)
 {
   if (o == NULL)
     return 0;
@@ -1319,13 +4359,20 @@ ss_hash (ss_val o)
     return ss_to_int (o);
 
   if (ss_is_blob (o))
-    return ss_hash_blob (ss_len (o), ss_blob_start (o));
+    return ss_hash_blob (ss, ss_len (o), ss_blob_start (o));
+  else if (ss->version >= 3)
+    {
+      uint64_t h = ss_len (o);
+      for (int i = 0; i < ss_len (o); i++)
+	h = ss_hash_mix (h, ss_hash (ss, ss_ref (o, i)));
+      return (uint32_t)(h ^ (h >> 32)) & 0x3FFFFFFF;
+    }
   else
     {
       uint32_t h = 0;
       int len = ss_len (o), i;
       for (i = 0; i < len; i++)
-	h = (h<<8) + ss_hash (ss_ref (o, i));
+	h = (h<<8) + ss_hash (ss, ss_ref (o, i));
       return h & 0x3FFFFFFF;
     }
 }
@@ -1333,7 +4380,7 @@ ss_hash (ss_val o)
 static uint32_t
 ss_id_hash (ss_store ss, ss_val o)
 {
-  return ((uint32_t)o - (uint32_t)(ss->start)) & 0x3FFFFFFF;
+  return ((uint32_t)((char *)o - (char *)ss->start)) & 0x3FFFFFFF;
 }
 
 static bool
@@ -1442,11 +4489,61 @@ ss_mapvec_set (ss_store ss, ss_val vec, int index, ss_val val)
   return new_vec;
 }
 
+/* Iterating over the fields of a record, or the elements of a set.
+   For a large set, we walk its trie like ss_tab_entries does, and
+   LEVEL is -1 when done.  LEVEL is -2 for a plain record.
+ */
+
+static void
+ss_elts_micro_step (ss_elts *iter)
+{
+  ss_val n = iter->node[iter->level];
+
+  if (iter->index[iter->level] >= ss_len (n))
+    {
+      iter->level -= 1;
+      if (iter->level >= 0)
+	iter->index[iter->level] += 1;
+    }
+  else if (ss_is (n, SET_DISPATCH_TAG))
+    {
+      ss_val c = ss_ref (n, iter->index[iter->level]);
+      if (c)
+	{
+	  iter->level += 1;
+	  iter->node[iter->level] = c;
+	  iter->index[iter->level] = 1;
+	}
+      else
+	iter->index[iter->level] += 1;
+    }
+  else
+    iter->index[iter->level] += 1;
+}
+
+static void
+ss_elts_advance (ss_elts *iter)
+{
+  while (iter->level >= 0
+	 && (iter->index[iter->level] >= ss_len (iter->node[iter->level])
+	     || ss_is (iter->node[iter->level], SET_DISPATCH_TAG)))
+    ss_elts_micro_step (iter);
+}
+
 void
 ss_elts_init (ss_elts *iter, ss_val rec)
 {
   iter->rec = rec;
   iter->i = 0;
+  if (ss_is (rec, SET_TAG))
+    {
+      iter->node[0] = ss_ref (rec, 1);
+      iter->index[0] = 1;
+      iter->level = iter->node[0]? 0 : -1;
+      ss_elts_advance (iter);
+    }
+  else
+    iter->level = -2;
 }
 
 void
@@ -1457,19 +4554,31 @@ ss_elts_fini (ss_elts *iter)
 void
 ss_elts_step (ss_elts *iter)
 {
-  iter->i++;
+  if (iter->level == -2)
+    iter->i++;
+  else
+    {
+      ss_elts_micro_step (iter);
+      ss_elts_advance (iter);
+    }
 }
 
 bool
 ss_elts_done (ss_elts *iter)
 {
-  return iter->rec == NULL || iter->i >= ss_len (iter->rec);
+  if (iter->level == -2)
+    return iter->rec == NULL || iter->i >= ss_len (iter->rec);
+  else
+    return iter->level < 0;
 }
 
 ss_val
 ss_elts_elt (ss_elts *iter)
 {
-  return ss_ref (iter->rec, iter->i);
+  if (iter->level == -2)
+    return ss_ref (iter->rec, iter->i);
+  else
+    return ss_ref (iter->node[iter->level], iter->index[iter->level]);
 }
 
 /* Hash tables
@@ -1492,8 +4601,6 @@ ss_elts_elt (ss_elts *iter)
    (See Phil Bagwell's paper "Ideal Hash Trees" for more about this.)
  */
 
-#define BITS_PER_LEVEL 5
-#define LEVEL_MASK     ((1<<BITS_PER_LEVEL)-1)
 
 static ss_val 
 ss_hash_node_lookup (int dispatch_tag,
@@ -1551,6 +4658,138 @@ ss_hash_node_lookup (int dispatch_tag,
     }
 }
 
+/* Doing many lookups in one walk.  The lookups are sorted by their
+   hashes in the order in which the levels of the trie use them, so
+   that all lookups that go through the same child of a dispatch node
+   are next to each other.  Each node is then visited once for the
+   whole batch instead of once per lookup.  Lookups with the same hash
+   are done in the order they were given.
+ */
+
+typedef struct {
+  int hash;
+  void *data;
+} ss_hash_batch_op;
+
+/* Larger batches are split so that their bookkeeping fits on the
+   stack.
+ */
+#define SS_HASH_BATCH_MAX 4096
+
+/* Sort OPS by the hash in the order of ss_trie_order, keeping ops
+   with the same hash in their original order.  Larger batches are
+   sorted one level of the trie after the other, starting with the
+   deepest.
+ */
+static void
+ss_hash_batch_sort (ss_hash_batch_op *ops, int n)
+{
+  if (n <= 16)
+    {
+      /* Few ops are quicker to sort by insertion.
+       */
+      for (int i = 1; i < n; i++)
+	{
+	  ss_hash_batch_op op = ops[i];
+	  uint32_t order = ss_trie_order (op.hash);
+	  int j = i;
+	  while (j > 0 && ss_trie_order (ops[j-1].hash) > order)
+	    {
+	      ops[j] = ops[j-1];
+	      j--;
+	    }
+	  ops[j] = op;
+	}
+      return;
+    }
+
+  ss_hash_batch_op scratch[n], *from = ops, *to = scratch;
+
+  for (int shift = 25; shift >= 0; shift -= BITS_PER_LEVEL)
+    {
+      int start[LEVEL_MASK+2];
+      memset (start, 0, sizeof (start));
+      for (int i = 0; i < n; i++)
+	start[((from[i].hash >> shift) & LEVEL_MASK) + 1]++;
+      for (int b = 0; b <= LEVEL_MASK; b++)
+	start[b+1] += start[b];
+      for (int i = 0; i < n; i++)
+	to[start[(from[i].hash >> shift) & LEVEL_MASK]++] = from[i];
+      ss_hash_batch_op *t = from; from = to; to = t;
+    }
+
+  /* Six passes leave the result in OPS.
+   */
+}
+
+static ss_val
+ss_hash_node_lookup_batch (int dispatch_tag,
+			   ss_val (*action) (ss_store ss, ss_val node,
+					     int hash, void *data),
+			   ss_store ss,
+			   ss_val node, int shift,
+			   ss_hash_batch_op *ops, int n)
+{
+  if (n == 0)
+    return node;
+  if (n == 1)
+    return ss_hash_node_lookup (dispatch_tag, action, ss, node, shift,
+				ops[0].hash, ops[0].data);
+
+  bool was_null = (node == NULL);
+
+  if (node == NULL || !ss_is (node, dispatch_tag))
+    {
+      /* The ops are sorted, so they all have the same hash when the
+	 first and last one do.  Then they all go to this search node.
+       */
+      if (ops[0].hash == ops[n-1].hash
+	  && (node == NULL || ss_to_int (ss_ref (node, 0)) == ops[0].hash))
+	{
+	  for (int i = 0; i < n; i++)
+	    node = action (ss, node, ops[i].hash, ops[i].data);
+	  return node;
+	}
+
+      ss_val new_node = ss_mapvec_new (dispatch_tag);
+      if (node)
+	{
+	  int node_index = ss_to_int (ss_ref (node, 0)) >> shift & LEVEL_MASK;
+	  new_node = ss_mapvec_set (ss, new_node, node_index, node);
+	}
+      node = new_node;
+    }
+
+  int i = 0;
+  while (i < n)
+    {
+      int index = (ops[i].hash >> shift) & LEVEL_MASK, j = i + 1;
+      while (j < n && ((ops[j].hash >> shift) & LEVEL_MASK) == index)
+	j++;
+
+      ss_val entry = ss_mapvec_get (node, index);
+      ss_val new_entry = ss_hash_node_lookup_batch (dispatch_tag, action,
+						    ss, entry,
+						    shift + BITS_PER_LEVEL,
+						    ops + i, j - i);
+      if (new_entry != entry)
+	node = ss_mapvec_set (ss, node, index, new_entry);
+      i = j;
+    }
+
+  /* Lookups that don't add anything leave no trace.
+   */
+  if (was_null
+      && ss_to_int (ss_ref (node, 0)) == 0
+      && ss_ref (node, 1) == NULL && ss_ref (node, 2) == NULL)
+    {
+      ss_free_unstored (node);
+      return NULL;
+    }
+
+  return node;
+}
+
 /* Object tables
  */
 
@@ -1589,6 +4828,7 @@ typedef struct {
   int len;
   void *blob;
   ss_val obj;
+  ss_val (*blob_new) (ss_store ss, int len, void *blob);
 } ss_tab_intern_blob_data;
 
 ss_val
@@ -1598,7 +4838,7 @@ ss_tab_intern_blob_action (ss_store ss, ss_val node, int hash, void *data)
 
   if (node == NULL)
     {
-      d->obj = ss_blob_new (ss, d->len, d->blob);
+      d->obj = d->blob_new (ss, d->len, d->blob);
       return ss_new (NULL, TAB_SEARCH_TAG, 2, ss_from_int (hash), d->obj);
     }
   else
@@ -1612,7 +4852,7 @@ ss_tab_intern_blob_action (ss_store ss, ss_val node, int hash, void *data)
 	    d->obj = ss_ref (node, i);
 	    return node;
 	  }
-      d->obj = ss_blob_new (ss, d->len, d->blob);
+      d->obj = d->blob_new (ss, d->len, d->blob);
       return ss_insert (NULL, node, len, d->obj);
     }
 }
@@ -1640,6 +4880,7 @@ ss_tab_intern_soft_action (ss_store ss, ss_val node, int hash, void *data)
 struct ss_tab {
   ss_store store;
   ss_val root;
+  ss_arena arena;
 };
 
 ss_tab *
@@ -1648,6 +4889,7 @@ ss_tab_init (ss_store ss, ss_val root)
   ss_tab *ot = dyn_malloc (sizeof (ss_tab));
   ot->store = ss;
   ot->root = root;
+  ss_arena_init (&ot->arena);
   return ot;
 }
 
@@ -1655,6 +4897,7 @@ ss_val
 ss_tab_store (ss_tab *ot)
 {
   ot->root = ss_store_object (ot->store, ot->root);
+  ss_arena_release (&ot->arena);
   return ot->root;
 }
 
@@ -1662,6 +4905,7 @@ void
 ss_tab_abort (ss_tab *ot)
 {
   ss_deep_free_unstored (ot->store, ot->root);
+  ss_arena_release (&ot->arena);
   free (ot);
 }
 
@@ -1676,7 +4920,7 @@ ss_tab_finish (ss_tab *ot)
 ss_val 
 ss_tab_intern (ss_tab *ot, ss_val obj)
 {
-  return ss_tab_intern_x (ot, obj, ss_hash (obj), ss_equal);
+  return ss_tab_intern_x (ot, obj, ss_hash (ot->store, obj), ss_equal);
 }
 
 ss_val 
@@ -1685,34 +4929,89 @@ ss_tab_intern_x (ss_tab *ot, ss_val obj,
 {
   ss_tab_intern_data d = { obj, equal };
   hash &= 0x3FFFFFFF;
+  ss_arena_enter (&ot->arena);
   ot->root = ss_hash_node_lookup (TAB_DISPATCH_TAG,
 				  ss_tab_intern_action,
 				  ot->store, ot->root, 0, hash, &d);
+  ss_arena_leave ();
   return d.obj;
 }
 
-ss_val 
-ss_tab_intern_blob (ss_tab *ot, int len, void *blob)
+static ss_val
+ss_tab_intern_blob_with (ss_tab *ot, int len, void *blob,
+			 ss_val (*blob_new) (ss_store ss, int len, void *blob))
 {
-  ss_tab_intern_blob_data d = { len, blob, NULL };
-  uint32_t h = ss_hash_blob (len, blob);
+  ss_tab_intern_blob_data d = { len, blob, NULL, blob_new };
+  uint32_t h = ss_hash_blob (ot->store, len, blob);
+  ss_arena_enter (&ot->arena);
   ot->root = ss_hash_node_lookup (TAB_DISPATCH_TAG,
 				  ss_tab_intern_blob_action,
 				  ot->store, ot->root, 0, h, &d);
+  ss_arena_leave ();
   return d.obj;
 }
 
+ss_val 
+ss_tab_intern_blob (ss_tab *ot, int len, void *blob)
+{
+  return ss_tab_intern_blob_with (ot, len, blob, ss_blob_new);
+}
+
+ss_val 
+ss_tab_intern_blob_compressed (ss_tab *ot, int len, void *blob)
+{
+  return ss_tab_intern_blob_with (ot, len, blob, ss_blob_new_compressed);
+}
+
 ss_val 
 ss_tab_intern_soft (ss_tab *ot, int len, void *blob)
 {
-  ss_tab_intern_blob_data d = { len, blob, NULL };
-  uint32_t h = ss_hash_blob (len, blob);
+  ss_tab_intern_blob_data d = { len, blob, NULL, NULL };
+  uint32_t h = ss_hash_blob (ot->store, len, blob);
+  ss_arena_enter (&ot->arena);
   ot->root = ss_hash_node_lookup (TAB_DISPATCH_TAG,
 				  ss_tab_intern_soft_action,
 				  ot->store, ot->root, 0, h, &d);
+  ss_arena_leave ();
   return d.obj;
 }
 
+void
+ss_tab_intern_batch (ss_tab *ot, int n, ss_tab_intern_op *ops)
+{
+  while (n > SS_HASH_BATCH_MAX)
+    {
+      ss_tab_intern_batch (ot, SS_HASH_BATCH_MAX, ops);
+      ops += SS_HASH_BATCH_MAX;
+      n -= SS_HASH_BATCH_MAX;
+    }
+
+  ss_tab_intern_blob_data data[n];
+  ss_hash_batch_op batch[n];
+
+  for (int i = 0; i < n; i++)
+    {
+      data[i].len = ops[i].len;
+      data[i].blob = ops[i].blob;
+      data[i].obj = NULL;
+      data[i].blob_new = (ops[i].compressed
+			  ? ss_blob_new_compressed
+			  : ss_blob_new);
+      batch[i].hash = ss_hash_blob (ot->store, ops[i].len, ops[i].blob);
+      batch[i].data = &data[i];
+    }
+  ss_hash_batch_sort (batch, n);
+
+  ss_arena_enter (&ot->arena);
+  ot->root = ss_hash_node_lookup_batch (TAB_DISPATCH_TAG,
+					ss_tab_intern_blob_action,
+					ot->store, ot->root, 0, batch, n);
+  ss_arena_leave ();
+
+  for (int i = 0; i < n; i++)
+    ops[i].val = data[i].obj;
+}
+
 static void
 ss_tab_node_foreach (void (*func) (ss_val val), ss_val node)
 {
@@ -1795,7 +5094,7 @@ ss_tab_entries_hit (ss_tab_entries *iter)
 void
 ss_tab_entries_init (ss_tab_entries *iter, ss_tab *t)
 {
-  iter->tab = dyn_ref (t);
+  iter->tab = t;
   if (t->root)
     {
       iter->level = 0;
@@ -1813,7 +5112,6 @@ ss_tab_entries_init (ss_tab_entries *iter, ss_tab *t)
 void
 ss_tab_entries_fini (ss_tab_entries *iter)
 {
-  dyn_unref (iter->tab);
 }
 
 void
@@ -1912,6 +5210,7 @@ struct ss_dict {
   int dispatch_tag;
   int search_tag;
   ss_val root;
+  ss_arena arena;
 };
 
 typedef struct {
@@ -1983,20 +5282,150 @@ ss_dict_set_action (ss_store ss, ss_val node, int hash, void *data)
     }
 }
 
+/* Sets
+
+   The values in dictionaries that are changed with ss_dict_add and
+   ss_dict_del are sets.  Small sets are records with the elements as
+   their fields, and finding an element is a linear search.
+
+   A set that grows beyond SET_FLAT_MAX elements is turned into a hash
+   trie of its elements, just like a table, with a SET_TAG record on
+   top that holds the number of elements and the root of the trie.
+   It is turned back into a record when it shrinks to half that size.
+   The elements are hashed by their address, and the garbage collector
+   builds the tries again, see ss_set_gc_copy.
+
+   The new sets are unstored.  Elements that go into a trie are stored
+   in SS first, since their hash value is their offset in SS.
+ */
+
+#define SET_FLAT_MAX 32
+
+static uint32_t
+ss_set_hash (ss_store ss, ss_val val)
+{
+  if (val == NULL || ss_is_int (val))
+    return ((uint32_t)(uintptr_t)val) & 0x3FFFFFFF;
+  else
+    return ((uint32_t)((uint32_t *)val - ss->start) * 0x9E3779B1U) >> 2;
+}
+
+typedef struct {
+  ss_val val;
+  bool changed;
+} ss_set_action_data;
+
+static ss_val
+ss_set_add_action (ss_store ss, ss_val node, int hash, void *data)
+{
+  ss_set_action_data *d = (ss_set_action_data *)data;
+
+  if (node == NULL)
+    {
+      d->changed = true;
+      return ss_new (NULL, SET_SEARCH_TAG, 2, ss_from_int (hash), d->val);
+    }
+  else
+    {
+      int len = ss_len (node), i;
+      for (i = 1; i < len; i++)
+	if (ss_ref (node, i) == d->val)
+	  return node;
+      d->changed = true;
+      return ss_insert (NULL, node, len, d->val);
+    }
+}
+
+static ss_val
+ss_set_rem_action (ss_store ss, ss_val node, int hash, void *data)
+{
+  ss_set_action_data *d = (ss_set_action_data *)data;
+
+  if (node)
+    {
+      int len = ss_len (node), i;
+      for (i = 1; i < len; i++)
+	if (ss_ref (node, i) == d->val)
+	  {
+	    d->changed = true;
+	    if (len == 2)
+	      return NULL;
+	    return ss_remove_many (NULL, node, i, 1);
+	  }
+    }
+  return node;
+}
+
+static ss_val
+ss_set_update_trie (ss_store ss, ss_val set,
+		    ss_val (*action) (ss_store ss, ss_val node,
+				      int hash, void *data),
+		    ss_val val, int delta)
+{
+  ss_set_action_data d = { val, false };
+  ss_val root = ss_ref (set, 1);
+
+  root = ss_hash_node_lookup (SET_DISPATCH_TAG, action, ss, root, 0,
+			      ss_set_hash (ss, val), &d);
+  if (root != ss_ref (set, 1) || d.changed)
+    {
+      set = ss_unstore_object (ss, set);
+      if (d.changed)
+	ss_set (set, 0, ss_from_int (ss_to_int (ss_ref (set, 0)) + delta));
+      ss_set (set, 1, root);
+    }
+  return set;
+}
+
 static ss_val
 ss_set_add (ss_store ss, ss_val set, ss_val val)
 {
-  // XXX - quadratic complexity warning
+  if (set == NULL)
+    return ss_new (NULL, 0, 1, val);
+
+  if (ss_is (set, SET_TAG))
+    {
+      val = ss_store_object (ss, val);
+      return ss_set_update_trie (ss, set, ss_set_add_action, val, 1);
+    }
+
   int len = ss_len (set), i;
   for (i = 0; i < len; i++)
     if (ss_ref (set, i) == val)
       return set;
-  return ss_append (ss, set, val);
+
+  if (len < SET_FLAT_MAX)
+    return ss_append (NULL, set, val);
+
+  ss_val trie = ss_new (NULL, SET_TAG, 2, ss_from_int (0), NULL);
+  for (i = 0; i < len; i++)
+    trie = ss_set_add (ss, trie, ss_ref (set, i));
+  if (!ss_is_stored (ss, set))
+    ss_free_unstored (set);
+  return ss_set_add (ss, trie, val);
 }
 
 static ss_val
 ss_set_rem (ss_store ss, ss_val set, ss_val val)
 {
+  if (ss_is (set, SET_TAG))
+    {
+      set = ss_set_update_trie (ss, set, ss_set_rem_action, val, -1);
+
+      int len = ss_to_int (ss_ref (set, 0)), n = 0;
+      if (len <= SET_FLAT_MAX / 2)
+	{
+	  ss_val vals[len];
+	  dyn_foreach (elt, ss_elts, set)
+	    vals[n++] = elt;
+	  ss_deep_free_unstored (ss, ss_ref (set, 1));
+	  if (!ss_is_stored (ss, set))
+	    ss_free_unstored (set);
+	  return n > 0? ss_newv (NULL, 0, n, vals) : NULL;
+	}
+      return set;
+    }
+
   int len = ss_len (set), i;
   for (i = 0; i < len; i++)
     if (ss_ref (set, i) == val)
@@ -2004,11 +5433,22 @@ ss_set_rem (ss_store ss, ss_val set, ss_val val)
 	if (len == 1)
 	  return NULL;
 	else
-	  return ss_remove_many (ss, set, i, 1);
+	  return ss_remove_many (NULL, set, i, 1);
       }
   return set;
 }
 
+int
+ss_set_len (ss_val set)
+{
+  if (set == NULL)
+    return 0;
+  else if (ss_is (set, SET_TAG))
+    return ss_to_int (ss_ref (set, 0));
+  else
+    return ss_len (set);
+}
+
 ss_val
 ss_dict_add_action (ss_store ss, ss_val node, int hash, void *data)
 {
@@ -2027,7 +5467,7 @@ ss_dict_add_action (ss_store ss, ss_val node, int hash, void *data)
 	if (ss_ref (node, i) == d->key)
 	  {
 	    ss_val set = ss_ref (node, i+1);
-	    ss_val new_set = ss_set_add (NULL, set, d->val);
+	    ss_val new_set = ss_set_add (ss, set, d->val);
 	    if (new_set != set)
 	      {
 		node = ss_unstore_object (ss, node);
@@ -2053,7 +5493,7 @@ ss_dict_del_action (ss_store ss, ss_val node, int hash, void *data)
 	if (ss_ref (node, i) == d->key)
 	  {
 	    ss_val set = ss_ref (node, i+1);
-	    ss_val new_set = ss_set_rem (NULL, set, d->val);
+	    ss_val new_set = ss_set_rem (ss, set, d->val);
 	    if (new_set != set)
 	      {
 		if (new_set)
@@ -2099,6 +5539,7 @@ ss_dict_init (ss_store ss, ss_val root, int weak)
     abort ();
 
   d->root = root;
+  ss_arena_init (&d->arena);
   return d;
 }
 
@@ -2106,6 +5547,7 @@ ss_val
 ss_dict_store (ss_dict *d)
 {
   d->root = ss_store_object (d->store, d->root);
+  ss_arena_release (&d->arena);
   return d->root;
 }
 
@@ -2113,6 +5555,7 @@ void
 ss_dict_abort (ss_dict *d)
 {
   ss_deep_free_unstored (d->store, d->root);
+  ss_arena_release (&d->arena);
   free (d);
 }
 
@@ -2129,8 +5572,14 @@ ss_dict_get (ss_dict *d, ss_val key)
 {
   ss_dict_action_data ad = { d, key, NULL };
   uint32_t h = ss_id_hash (d->store, key);
+
+  /* The lookup might create nodes that are thrown away, leave them in
+     the arena.
+   */
+  ss_arena_enter (&d->arena);
   ss_hash_node_lookup (d->dispatch_tag, ss_dict_get_action,
 		       d->store, d->root, 0, h, &ad);
+  ss_arena_leave ();
   return ad.val;
 }
 
@@ -2139,8 +5588,10 @@ ss_dict_set (ss_dict *d, ss_val key, ss_val val)
 {
   ss_dict_action_data ad = { d, key, val };
   uint32_t h = ss_id_hash (d->store, key);
+  ss_arena_enter (&d->arena);
   d->root = ss_hash_node_lookup (d->dispatch_tag, ss_dict_set_action,
 				 d->store, d->root, 0, h, &ad);
+  ss_arena_leave ();
 }
 
 void
@@ -2148,8 +5599,10 @@ ss_dict_add (ss_dict *d, ss_val key, ss_val val)
 {
   ss_dict_action_data ad = { d, key, val };
   uint32_t h = ss_id_hash (d->store, key);
+  ss_arena_enter (&d->arena);
   d->root = ss_hash_node_lookup (d->dispatch_tag, ss_dict_add_action,
 				 d->store, d->root, 0, h, &ad);
+  ss_arena_leave ();
 }
 
 void
@@ -2157,8 +5610,63 @@ ss_dict_del (ss_dict *d, ss_val key, ss_val val)
 {
   ss_dict_action_data ad = { d, key, val };
   uint32_t h = ss_id_hash (d->store, key);
+  ss_arena_enter (&d->arena);
   d->root = ss_hash_node_lookup (d->dispatch_tag, ss_dict_del_action,
 				 d->store, d->root, 0, h, &ad);
+  ss_arena_leave ();
+}
+
+typedef struct {
+  int op;
+  ss_dict_action_data ad;
+} ss_dict_batch_data;
+
+static ss_val
+ss_dict_batch_action (ss_store ss, ss_val node, int hash, void *data)
+{
+  ss_dict_batch_data *d = (ss_dict_batch_data *)data;
+
+  switch (d->op)
+    {
+    case SS_DICT_OP_SET:
+      return ss_dict_set_action (ss, node, hash, &d->ad);
+    case SS_DICT_OP_ADD:
+      return ss_dict_add_action (ss, node, hash, &d->ad);
+    case SS_DICT_OP_DEL:
+      return ss_dict_del_action (ss, node, hash, &d->ad);
+    default:
+      abort ();
+    }
+}
+
+void
+ss_dict_apply_batch (ss_dict *d, int n, ss_dict_op *ops)
+{
+  while (n > SS_HASH_BATCH_MAX)
+    {
+      ss_dict_apply_batch (d, SS_HASH_BATCH_MAX, ops);
+      ops += SS_HASH_BATCH_MAX;
+      n -= SS_HASH_BATCH_MAX;
+    }
+
+  ss_dict_batch_data data[n];
+  ss_hash_batch_op batch[n];
+
+  for (int i = 0; i < n; i++)
+    {
+      data[i].op = ops[i].op;
+      data[i].ad.d = d;
+      data[i].ad.key = ops[i].key;
+      data[i].ad.val = ops[i].val;
+      batch[i].hash = ss_id_hash (d->store, ops[i].key);
+      batch[i].data = &data[i];
+    }
+  ss_hash_batch_sort (batch, n);
+
+  ss_arena_enter (&d->arena);
+  d->root = ss_hash_node_lookup_batch (d->dispatch_tag, ss_dict_batch_action,
+				       d->store, d->root, 0, batch, n);
+  ss_arena_leave ();
 }
 
 static void
@@ -2249,7 +5757,7 @@ ss_dict_entries_hit (ss_dict_entries *iter)
 void
 ss_dict_entries_init (ss_dict_entries *iter, ss_dict *d)
 {
-  iter->dict = dyn_ref (d);
+  iter->dict = d;
   if (d->root)
     {
       iter->level = 0;
@@ -2275,7 +5783,6 @@ ss_dict_entries_init (ss_dict_entries *iter, ss_dict *d)
 void
 ss_dict_entries_fini (ss_dict_entries *iter)
 {
-  dyn_unref (iter->dict);
 }
 
 void
@@ -2303,21 +5810,30 @@ ss_dict_entries_done (ss_dict_entries *iter)
   return iter->level < 0;
 }
 
+static void
+ss_dict_entry_members_find (ss_dict_entry_members *iter)
+{
+  while (!ss_dict_entries_done (&iter->entries))
+    {
+      if (!ss_elts_done (&iter->elts))
+	{
+	  iter->key = iter->entries.key;
+	  iter->val = ss_elts_elt (&iter->elts);
+	  return;
+	}
+      ss_dict_entries_step (&iter->entries);
+      if (!ss_dict_entries_done (&iter->entries))
+	ss_elts_init (&iter->elts, iter->entries.val);
+    }
+}
+
 void
 ss_dict_entry_members_init (ss_dict_entry_members *iter, ss_dict *d)
 {
   ss_dict_entries_init (&iter->entries, d);
-
-  while (!ss_dict_entries_done (&iter->entries)
-	 && ss_len (iter->entries.val) == 0)
-    ss_dict_entries_step (&iter->entries);
-
   if (!ss_dict_entries_done (&iter->entries))
-    {
-      iter->index = 0;
-      iter->key = iter->entries.key;
-      iter->val = ss_ref (iter->entries.val, 0);
-    }
+    ss_elts_init (&iter->elts, iter->entries.val);
+  ss_dict_entry_members_find (iter);
 }
 
 void
@@ -2329,22 +5845,8 @@ ss_dict_entry_members_fini (ss_dict_entry_members *iter)
 void
 ss_dict_entry_members_step (ss_dict_entry_members *iter)
 {
-  iter->index++;
-  if (iter->index >= ss_len (iter->entries.val))
-    {
-      do {
-	ss_dict_entries_step (&iter->entries);
-      } while (!ss_dict_entries_done (&iter->entries)
-	       && ss_len (iter->entries.val) == 0);
-
-      if (ss_dict_entries_done (&iter->entries))
-	return;
-
-      iter->index = 0;
-    }
-  
-  iter->key = iter->entries.key;
-  iter->val = ss_ref (iter->entries.val, 0);
+  ss_elts_step (&iter->elts);
+  ss_dict_entry_members_find (iter);
 }
 
 bool
@@ -2416,16 +5918,9 @@ ss_dict_foreach_member (void (*func) (ss_val key, ss_val val),
   dyn_foreach_x ((ss_val key, ss_val val),
 		 ss_dict_foreach, d)
     {
-      if (val)
-	{
-	  int len = ss_len (val);
-	  for (int i = 0; i < len; i++)
-	    {
-	      ss_val member = ss_ref (val, i);
-	      if (member)
-		func (key, member);
-	    }
-	}
+      dyn_foreach (member, ss_elts, val)
+	if (member)
+	  func (key, member);
     }
 }
 
@@ -2440,7 +5935,34 @@ update_members (ss_val key, ss_val val, void *data)
 {
   struct update_members_data *umd = data;
 
-  if (val)
+  if (ss_is (val, SET_TAG))
+    {
+      /* Collect the changes first, the trie can't be modified while
+	 we walk it.
+       */
+      int n = 0, capacity = 0;
+      ss_val *changes = NULL;
+
+      dyn_foreach (member, ss_elts, val)
+	if (member)
+	  {
+	    ss_val new_member = umd->func (key, member, umd->data);
+	    if (new_member != member)
+	      {
+		changes = dyn_mgrow (changes, &capacity, sizeof (ss_val), n + 2);
+		changes[n++] = member;
+		changes[n++] = new_member;
+	      }
+	  }
+
+      for (int i = 0; i < n && val; i += 2)
+	val = ss_set_rem (umd->ss, val, changes[i]);
+      for (int i = 1; i < n; i += 2)
+	if (changes[i])
+	  val = ss_set_add (umd->ss, val, changes[i]);
+      free (changes);
+    }
+  else if (val)
     {
       int len = ss_len (val);
       for (int i = 0; i < len; i++)
@@ -2481,6 +6003,186 @@ ss_dict_update_members (ss_dict *d,
   ss_dict_update (d, update_members, &umd);
 }
 
+/* Vectors
+
+   A vector is a radix tree with 32 children per node, indexed by the
+   id of its keys.  Each node has its level in field 0.  The nodes of
+   level 0 have 32 pairs of key and value, the others have 32
+   children.  The key is kept next to its value to check that the slot
+   really belongs to it, and so that a collection can move the entry
+   to the new id of the key.
+
+   Like dictionaries, vectors are changed by making unstored copies of
+   the nodes on the path to the entry, and these copies are then
+   changed in place until the vector is stored.  Setting the entries
+   in order of their ids thus copies each node only once.  The copies
+   come from the arena of the vector.
+ */
+
+#define SS_VEC_MAX_LEVEL 5
+
+struct ss_vec {
+  ss_store store;
+  ss_val root;
+  ss_arena arena;
+};
+
+static ss_val
+ss_vec_new_node (int level)
+{
+  int len = 1 + (level > 0? 1 : 2) * (1 << BITS_PER_LEVEL);
+  ss_val vals[len];
+
+  vals[0] = ss_from_int (level);
+  for (int i = 1; i < len; i++)
+    vals[i] = NULL;
+  return ss_newv (NULL, VEC_TAG, len, vals);
+}
+
+static ss_val
+ss_vec_unstored (ss_val node)
+{
+  return ss_is_unstored (node)? node : ss_copy (NULL, node);
+}
+
+static bool
+ss_vec_fits (ss_val node, int id)
+{
+  int level = ss_ref_int (node, 0);
+  return (level >= SS_VEC_MAX_LEVEL
+	  || (id >> (BITS_PER_LEVEL * (level + 1))) == 0);
+}
+
+static ss_val
+ss_vec_node_set (ss_val root, int id, ss_val key, ss_val val)
+{
+  root = root? ss_vec_unstored (root) : ss_vec_new_node (0);
+  while (!ss_vec_fits (root, id))
+    {
+      ss_val r = ss_vec_new_node (ss_ref_int (root, 0) + 1);
+      ss_set (r, 1, root);
+      root = r;
+    }
+
+  ss_val node = root;
+  for (int level = ss_ref_int (root, 0); level > 0; level--)
+    {
+      int i = 1 + ((id >> (BITS_PER_LEVEL * level)) & LEVEL_MASK);
+      ss_val child = ss_ref (node, i);
+      child = child? ss_vec_unstored (child) : ss_vec_new_node (level - 1);
+      ss_set (node, i, child);
+      node = child;
+    }
+
+  int i = 1 + 2 * (id & LEVEL_MASK);
+  ss_set (node, i, val? key : NULL);
+  ss_set (node, i+1, val);
+  return root;
+}
+
+static ss_val
+ss_vec_node_get (ss_val node, ss_val key)
+{
+  if (node == NULL || key == NULL || ss_is_int (key))
+    return NULL;
+
+  int id = ss_ref_int (key, 0);
+  if (!ss_vec_fits (node, id))
+    return NULL;
+
+  for (int level = ss_ref_int (node, 0); level > 0 && node; level--)
+    node = ss_ref (node, 1 + ((id >> (BITS_PER_LEVEL * level)) & LEVEL_MASK));
+
+  int i = 1 + 2 * (id & LEVEL_MASK);
+  if (node && ss_ref (node, i) == key)
+    return ss_ref (node, i+1);
+  return NULL;
+}
+
+static void
+ss_vec_node_foreach (void (*func) (ss_val key, ss_val val), ss_val node)
+{
+  if (node == NULL)
+    return;
+
+  int len = ss_len (node);
+  if (ss_ref_int (node, 0) == 0)
+    {
+      for (int i = 1; i < len; i += 2)
+	if (ss_ref (node, i))
+	  func (ss_ref (node, i), ss_ref (node, i+1));
+    }
+  else
+    {
+      for (int i = 1; i < len; i++)
+	ss_vec_node_foreach (func, ss_ref (node, i));
+    }
+}
+
+ss_vec *
+ss_vec_init (ss_store ss, ss_val root)
+{
+  if (root && !ss_is (root, VEC_TAG))
+    dyn_error ("Not a vector.");
+
+  ss_vec *v = dyn_malloc (sizeof (ss_vec));
+  v->store = ss;
+  v->root = root;
+  ss_arena_init (&v->arena);
+  return v;
+}
+
+ss_val
+ss_vec_store (ss_vec *v)
+{
+  v->root = ss_store_object (v->store, v->root);
+  ss_arena_release (&v->arena);
+  return v->root;
+}
+
+void
+ss_vec_abort (ss_vec *v)
+{
+  ss_deep_free_unstored (v->store, v->root);
+  ss_arena_release (&v->arena);
+  free (v);
+}
+
+ss_val
+ss_vec_finish (ss_vec *v)
+{
+  ss_val r = ss_vec_store (v);
+  free (v);
+  return r;
+}
+
+ss_val
+ss_vec_get (ss_vec *v, ss_val key)
+{
+  return ss_vec_node_get (v->root, key);
+}
+
+void
+ss_vec_set (ss_vec *v, ss_val key, ss_val val)
+{
+  if (key == NULL || ss_is_int (key)
+      || ss_tag (key) < 64 || ss_tag (key) >= 80 || ss_len (key) < 1)
+    dyn_error ("Object of wrong type.");
+
+  if (val == NULL && ss_vec_node_get (v->root, key) == NULL)
+    return;
+
+  ss_arena_enter (&v->arena);
+  v->root = ss_vec_node_set (v->root, ss_ref_int (key, 0), key, val);
+  ss_arena_leave ();
+}
+
+void
+ss_vec_foreach (void (*func) (ss_val key, ss_val val), ss_vec *v)
+{
+  ss_vec_node_foreach (func, v->root);
+}
+
 ss_val
 ss_ref_safely (ss_val obj, int i)
 {
@@ -2512,6 +6214,342 @@ ss_strcmp (ss_val a, ss_val b)
   return c;
 }
 
+/* Profiling
+ */
+
+static const char *
+ss_tag_name (int tag)
+{
+  static char buf[20];
+
+  switch (tag)
+    {
+    case SS_BLOB_TAG:            return "blob";
+    case SS_ZBLOB_TAG:           return "compressed blob";
+    case SET_TAG:                return "set";
+    case SET_DISPATCH_TAG:       return "set dispatch";
+    case SET_SEARCH_TAG:         return "set search";
+    case WEAK_SETS_DISPATCH_TAG: return "weak sets dispatch";
+    case WEAK_SETS_SEARCH_TAG:   return "weak sets search";
+    case WEAK_DICT_DISPATCH_TAG: return "weak dict dispatch";
+    case WEAK_DICT_SEARCH_TAG:   return "weak dict search";
+    case DICT_DISPATCH_TAG:      return "dict dispatch";
+    case DICT_SEARCH_TAG:        return "dict search";
+    case TAB_DISPATCH_TAG:       return "table dispatch";
+    case TAB_SEARCH_TAG:         return "table search";
+    case SS_WEAK_TAG:            return "weak record";
+    case VEC_TAG:                return "vector";
+    default:
+      sprintf (buf, "tag %d", tag);
+      return buf;
+    }
+}
+
+static size_t
+ss_object_words (uint32_t *w)
+{
+  if (SS_IS_RAW (w))
+    return SS_BLOB_LEN_TO_WORDS (SS_LEN (w)) + 1;
+  else
+    return SS_LEN (w) + 1;
+}
+
+void
+ss_profile_store (ss_store ss, ss_store_profile *prof)
+{
+  uint32_t *start = ss->start;
+  uint32_t *end = ((ss->prot & PROT_WRITE)
+		   ? ss->next
+		   : ss->start + ss->slot.len);
+  uint32_t *young = ss->next - ss->alloced_words;
+  size_t n_words = end - start;
+  uint8_t *marks = dyn_calloc (n_words / 8 + 1);
+  ss_val *stack = NULL;
+  int n_stack = 0, stack_capacity = 0;
+
+  bool marked (uint32_t *w)
+  {
+    size_t off = w - start;
+    return marks[off / 8] & (1 << (off % 8));
+  }
+
+  void mark (ss_val obj)
+  {
+    uint32_t *w = (uint32_t *)obj;
+    if (obj && !ss_is_int (obj) && start <= w && w < end && !marked (w))
+      {
+	size_t off = w - start;
+	marks[off / 8] |= 1 << (off % 8);
+	stack = dyn_mgrow (stack, &stack_capacity, sizeof (ss_val),
+			   n_stack + 1);
+	stack[n_stack++] = obj;
+      }
+  }
+
+  memset (prof, 0, sizeof (*prof));
+
+  /* Weak references are followed like all others.
+   */
+  mark (ss_get_root (ss));
+  while (n_stack > 0)
+    {
+      ss_val obj = stack[--n_stack];
+      if (!SS_IS_RAW (obj))
+	for (int i = 0; i < SS_LEN (obj); i++)
+	  mark (ss_ref (obj, i));
+    }
+
+  /* The padding is made of zero words, which look like empty
+     records.
+   */
+  uint32_t *w = start;
+  while (w < end)
+    {
+      int tag = SS_TAG (w);
+      size_t len = ss_object_words (w);
+      bool live = marked (w);
+
+      if (w[0] == 0 && !live)
+	prof->padding_words += len;
+      else
+	{
+	  prof->n_objects[tag] += 1;
+	  prof->n_words[tag] += len;
+	  if (live)
+	    {
+	      prof->n_live_objects[tag] += 1;
+	      prof->n_live_words[tag] += len;
+	      prof->live_words += len;
+	    }
+	}
+      if (w >= young)
+	{
+	  prof->young_words += len;
+	  if (live)
+	    prof->young_live_words += len;
+	}
+      w += len;
+    }
+  prof->total_words = n_words;
+
+  free (stack);
+  free (marks);
+}
+
+void
+ss_store_profile_dump (ss_store_profile *prof)
+{
+  unsigned long long garbage =
+    prof->total_words - prof->live_words - prof->padding_words;
+
+  printf ("%-20s %10s %12s %10s %12s\n",
+	  "Tag", "Objects", "Bytes", "Live", "Live bytes");
+  for (int t = 0; t < 128; t++)
+    if (prof->n_objects[t] > 0)
+      printf ("%-20s %10d %12llu %10d %12llu\n",
+	      ss_tag_name (t),
+	      prof->n_objects[t],
+	      (unsigned long long)prof->n_words[t] * 4,
+	      prof->n_live_objects[t],
+	      (unsigned long long)prof->n_live_words[t] * 4);
+
+  printf ("\n%llu bytes in use: %llu live, %llu garbage (%.1f%%), "
+	  "%llu padding\n",
+	  (unsigned long long)prof->total_words * 4,
+	  (unsigned long long)prof->live_words * 4,
+	  garbage * 4,
+	  prof->total_words? garbage * 100.0 / prof->total_words : 0.0,
+	  (unsigned long long)prof->padding_words * 4);
+  printf ("%llu bytes allocated since the last collection, %llu live\n",
+	  (unsigned long long)prof->young_words * 4,
+	  (unsigned long long)prof->young_live_words * 4);
+  printf ("A full collection would reclaim at least %llu bytes, "
+	  "a minor one %llu bytes\n",
+	  (unsigned long long)(prof->total_words - prof->live_words) * 4,
+	  (unsigned long long)(prof->young_words
+			       - prof->young_live_words) * 4);
+}
+
+static void
+ss_profile_dispatch (ss_trie_profile *prof, int n)
+{
+  prof->n_dispatch_nodes += 1;
+  prof->fanout[n < SS_PROFILE_MAX_FANOUT? n : SS_PROFILE_MAX_FANOUT] += 1;
+}
+
+static void
+ss_profile_search (ss_trie_profile *prof, int depth, int n)
+{
+  prof->n_search_nodes += 1;
+  prof->n_entries += n;
+  prof->depth[depth < SS_PROFILE_MAX_DEPTH
+	      ? depth : SS_PROFILE_MAX_DEPTH - 1] += 1;
+  prof->collisions[n < SS_PROFILE_MAX_COLLISIONS
+		   ? n : SS_PROFILE_MAX_COLLISIONS] += 1;
+}
+
+static void
+ss_profile_trie_node (ss_val node, int dispatch_tag, int width, int depth,
+		      ss_trie_profile *prof)
+{
+  if (node == NULL)
+    return;
+
+  prof->n_words += ss_object_words ((uint32_t *)node);
+
+  if (ss_is (node, dispatch_tag))
+    {
+      int len = ss_len (node), n = 0;
+      for (int i = 1; i < len; i++)
+	{
+	  ss_val child = ss_ref (node, i);
+	  if (child)
+	    {
+	      n++;
+	      ss_profile_trie_node (child, dispatch_tag, width, depth + 1,
+				    prof);
+	    }
+	}
+      ss_profile_dispatch (prof, n);
+    }
+  else
+    ss_profile_search (prof, depth, (ss_len (node) - 1) / width);
+}
+
+/* The nodes of level 0 of a vector count as its search nodes, with
+   the slots that have a key as their entries.
+ */
+static void
+ss_profile_vec_node (ss_val node, int depth, ss_trie_profile *prof)
+{
+  if (node == NULL)
+    return;
+
+  prof->n_words += ss_object_words ((uint32_t *)node);
+
+  int len = ss_len (node), n = 0;
+  if (ss_ref_int (node, 0) == 0)
+    {
+      for (int i = 1; i < len; i += 2)
+	if (ss_ref (node, i))
+	  n++;
+      ss_profile_search (prof, depth, n);
+    }
+  else
+    {
+      for (int i = 1; i < len; i++)
+	if (ss_ref (node, i))
+	  {
+	    n++;
+	    ss_profile_vec_node (ss_ref (node, i), depth + 1, prof);
+	  }
+      ss_profile_dispatch (prof, n);
+    }
+}
+
+/* A record whose fields are all weak records, like a sorted index
+   that is split into leaves, counts as one dispatch node with the
+   leaves as its search nodes.  Entries that have been cleared by a
+   collection are not counted.
+ */
+static bool
+ss_profile_weak_leaves (ss_val rec, ss_trie_profile *prof)
+{
+  int len = ss_len (rec);
+
+  if (SS_IS_RAW (rec) || ss_tag (rec) != 0 || len == 0)
+    return false;
+  for (int i = 0; i < len; i++)
+    if (ss_is_int (ss_ref (rec, i)) || !ss_is (ss_ref (rec, i), SS_WEAK_TAG))
+      return false;
+
+  prof->n_words += ss_object_words ((uint32_t *)rec);
+  for (int i = 0; i < len; i++)
+    {
+      ss_val leaf = ss_ref (rec, i);
+      int n = 0;
+      for (int j = 0; j < ss_len (leaf); j++)
+	if (ss_ref (leaf, j))
+	  n++;
+      prof->n_words += ss_object_words ((uint32_t *)leaf);
+      ss_profile_search (prof, 1, n);
+    }
+  ss_profile_dispatch (prof, len);
+  return true;
+}
+
+bool
+ss_profile_trie (ss_val trie, ss_trie_profile *prof)
+{
+  memset (prof, 0, sizeof (*prof));
+
+  if (trie == NULL)
+    return true;
+  if (ss_is_int (trie))
+    return false;
+
+  if (ss_is (trie, SET_TAG))
+    {
+      prof->n_words += ss_object_words ((uint32_t *)trie);
+      ss_profile_trie_node (ss_ref (trie, 1), SET_DISPATCH_TAG, 1, 0, prof);
+      return true;
+    }
+
+  if (ss_is (trie, VEC_TAG))
+    {
+      ss_profile_vec_node (trie, 0, prof);
+      return true;
+    }
+
+  if (ss_profile_weak_leaves (trie, prof))
+    return true;
+
+  /* Search tags follow their dispatch tags.
+   */
+  int tag = ss_tag (trie), dispatch_tag;
+  if (tag == TAB_DISPATCH_TAG || tag == SET_DISPATCH_TAG
+      || tag == DICT_DISPATCH_TAG || tag == WEAK_DICT_DISPATCH_TAG
+      || tag == WEAK_SETS_DISPATCH_TAG)
+    dispatch_tag = tag;
+  else if (tag == TAB_SEARCH_TAG || tag == SET_SEARCH_TAG
+	   || tag == DICT_SEARCH_TAG || tag == WEAK_DICT_SEARCH_TAG
+	   || tag == WEAK_SETS_SEARCH_TAG)
+    dispatch_tag = tag - 1;
+  else
+    return false;
+
+  int width = ((dispatch_tag == TAB_DISPATCH_TAG
+		|| dispatch_tag == SET_DISPATCH_TAG)
+	       ? 1 : 2);
+  ss_profile_trie_node (trie, dispatch_tag, width, 0, prof);
+  return true;
+}
+
+void
+ss_trie_profile_dump (ss_trie_profile *prof)
+{
+  printf ("%d entries in %d search nodes and %d dispatch nodes, "
+	  "%llu bytes\n",
+	  prof->n_entries, prof->n_search_nodes, prof->n_dispatch_nodes,
+	  (unsigned long long)prof->n_words * 4);
+
+  printf (" depth:");
+  for (int i = 0; i < SS_PROFILE_MAX_DEPTH; i++)
+    if (prof->depth[i])
+      printf (" %d:%d", i, prof->depth[i]);
+  printf ("\n fanout:");
+  for (int i = 0; i <= SS_PROFILE_MAX_FANOUT; i++)
+    if (prof->fanout[i])
+      printf (" %d%s:%d", i, i == SS_PROFILE_MAX_FANOUT? "+" : "",
+	      prof->fanout[i]);
+  printf ("\n collisions:");
+  for (int i = 0; i <= SS_PROFILE_MAX_COLLISIONS; i++)
+    if (prof->collisions[i])
+      printf (" %d%s:%d", i, i == SS_PROFILE_MAX_COLLISIONS? "+" : "",
+	      prof->collisions[i]);
+  printf ("\n");
+}
+
 /* Debugging
  */
 
@@ -2521,16 +6559,18 @@ ss_dump_store (ss_store ss, const char *header)
   printf ("Store %p, %s.\n", ss, header);
   printf (" filename:  %s\n", ss->filename);
   printf (" head:      %p\n", ss->head);
-  printf (" size:      %d\n", ss->file_size);
+  printf (" size:      %zu\n", ss->file_size);
   printf (" start:     %p\n", ss->start);
   printf (" next:      %p\n", ss->next);
   printf (" end:       %p\n", ss->end);
   
   if (ss->head)
     {
-      printf (" head root: %d\n", ss->head->root);
-      printf (" head len:  %d\n", ss->head->len);
-      printf (" head allc: %d\n", ss->head->alloced);
+      printf (" head slot: %d\n", ss->slot_index);
+      printf (" head seq:  %d\n", ss->slot.seq);
+      printf (" head root: %d\n", ss->slot.root);
+      printf (" head len:  %d\n", ss->slot.len);
+      printf (" head allc: %d\n", ss->slot.alloced);
     }
 
   for (int i = 0; i < 16; i++)
@@ -2548,7 +6588,7 @@ ss_scan_store (ss_store ss)
     {
       int t = SS_TAG(w), n = SS_LEN(w);
       printf (" %08x: %d : %d\n", w[0], t, n);
-      if (t == SS_BLOB_TAG)
+      if (t == SS_BLOB_TAG || t == SS_ZBLOB_TAG)
 	w += SS_BLOB_LEN_TO_WORDS (n) + 1;
       else
 	w += 1 + n;
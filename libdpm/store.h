@@ -23,7 +23,10 @@
 /* A struct-store is a file-backed region of memory.
 
    A struct-store is not portable across different architectures.
-   Only a single client can have a given struct-store open.
+   Only a single client can have a given struct-store open for
+   writing, but any number of clients can have it open for reading at
+   the same time.  A reader keeps seeing the root that was set when it
+   opened the struct-store, no matter what the writer does.
 
    It contains three kinds of values: null, small integers, records
    and blobs.  Four.  Four kinds of values.
@@ -35,15 +38,64 @@
    to indicate the absence of a real value.  One of the values is
    designated as the root.
 
+   Big blobs can be stored compressed with ss_blob_new_compressed.
+   They behave like other blobs, except that the pointer returned by
+   ss_blob_start for them is only valid until a few other compressed
+   blobs have been accessed, or until a struct-store is closed.
+
    You can not change values, only create new ones.  Setting a new
    root is guaranteed to leave the struct-store in a consistent state
    on disk: either the new root has been set and all referenced values
    are present, or the old root is still set.  When ss_set_root
    returns, the store hase been written to disk.
 
+   Ss_set_root_relaxed sets a new root without writing it to disk.
+   Other clients don't see it, and it is lost when the store is closed
+   without calling ss_flush, which writes the last one that has been
+   set.  This can be used to commit many times while syncing only once.
+
    A garbage collection is performed from time to time to remove
    unreferenced values.  Since a garbage collection moves objects
-   around, it has to be requested explicitly.
+   around, it has to be requested explicitly.  A full collection
+   (ss_gc) moves every value into a new file; a minor collection
+   (ss_gc_minor) only looks at values created since the last
+   collection, leaves the older ones in place, and appends the
+   survivors to the same file.  Ss_maybe_gc performs a collection
+   when enough new values have been created, see
+   ss_gc_set_young_words.  It is a full one when the file has grown
+   to more than twice the size that it had after the last full one.
+
+   A minor collection can also be deferred (ss_gc_deferred): it then
+   runs in the background and its result is only put in place the
+   next time the struct-store is opened for writing, provided that no
+   new root has been set in the meantime.  Ss_maybe_gc_deferred
+   decides between a minor and a full one like ss_maybe_gc, but
+   doesn't start one while another is still running, or right after
+   the result of one has been thrown away.
+
+   A branch (ss_branch) is a writable store on top of another one.
+   It starts out with a given root, usually the current or an old root
+   of that store, and changes in it are only kept in memory.  Making a
+   branch and throwing it away again is cheap, no matter how big the
+   store is.  Ss_promote_branch writes the new objects of a branch to
+   the store it was made from and commits the root of the branch as
+   its new root.  This is only possible as long as that store has not
+   allocated any new objects itself since the branch was made.
+   Branches can not be collected.
+
+   A delta (ss_export_delta) contains everything that is needed to go
+   from one root of a struct-store to another one, and usually is much
+   smaller than the store.  Ss_import_delta applies it to a copy of the
+   store that has the first root as its current root, and commits the
+   second one.  The objects keep their place, so neither the original
+   nor the copy may be collected between the two roots, except by
+   minor collections in place.  Each full collection starts a new
+   generation of the store, and ss_import_delta refuses deltas from
+   another generation than that of the copy.  Thus, a store that
+   deltas are exported from must not be collected automatically with
+   ss_maybe_gc or ss_maybe_gc_deferred, which might decide on a full
+   collection.  Use ss_gc_minor for it, and make a new copy after each
+   ss_gc.
 
    Accessing store values is generally done without checking whether
    the access is valid.  I.e., getting a record field of an value
@@ -54,6 +106,11 @@
 
    There are 127 different tags. [...]
 
+   Records with the tag SS_WEAK_TAG are weak: their fields don't keep
+   the values they refer to alive.  When a value is only referenced
+   from weak records, a garbage collection removes it and sets those
+   fields to null.
+
    There is special support for 'tables' and 'dictionaries'.
 
    A table keeps values (usually blobs representing strings) with the
@@ -75,6 +132,11 @@
    sets.  If the set becomes empty, it and its key are removed from
    the dictionary.
 
+   The values that are maintained by ss_dict_add and ss_dict_del are
+   sets.  Small sets are plain records, large ones are hash tries.
+   Use ss_elts to iterate over the elements of a set, and ss_set_len
+   to count them, instead of accessing their fields directly.
+
    This removal of table and dictionary entries is purely done to
    collect garbage.  You should not rely on it in the design of your
    data structures and algorithms.
@@ -90,16 +152,45 @@ ss_store ss_open (const char *filename, int mode);
 
 ss_store ss_maybe_gc (ss_store ss);
 ss_store ss_gc (ss_store ss);
+ss_store ss_gc_minor (ss_store ss);
+void ss_gc_deferred (ss_store ss);
+void ss_maybe_gc_deferred (ss_store ss);
+
+/* Collections sort the entries of big dictionaries with the help of N
+   threads, when rebuilding them, and sort the entries of independent
+   dictionaries at the same time.  The threads are started once and
+   kept for later collections.  Zero, the default, uses one per
+   processor.  Everything else, copying objects and storing the
+   rebuilt dictionaries, happens in the calling thread, and the result
+   does not depend on N.
+ */
+void ss_gc_set_threads (int n);
+
+/* Ss_maybe_gc and ss_maybe_gc_deferred collect once N words have
+   been allocated.  Zero restores the default of 5M words.
+ */
+void ss_gc_set_young_words (int n);
 
 struct ss_opaque;
 typedef struct ss_opaque *ss_val;
 
 ss_val ss_get_root (ss_store ss);
 void ss_set_root (ss_store ss, ss_val root);
+void ss_set_root_relaxed (ss_store ss, ss_val root);
+void ss_flush (ss_store ss);
+
+ss_store ss_branch (ss_store ss, ss_val root);
+void ss_promote_branch (ss_store ss, ss_store branch);
+
+void ss_export_delta (ss_store ss, ss_val old_root, ss_val new_root,
+		      const char *filename);
+void ss_import_delta (ss_store ss, const char *filename);
 
 int ss_tag_count (ss_store ss, int tag);
 
 #define SS_BLOB_TAG 0x7F
+#define SS_WEAK_TAG 0x72
+#define SS_VEC_TAG  0x71
 
 int ss_tag (ss_val v);
 int ss_len (ss_val v);
@@ -119,6 +210,7 @@ void *ss_blob_start (ss_val b);
 ss_val ss_new (ss_store ss, int tag, int n, ...);
 ss_val ss_newv (ss_store ss, int tag, int n, ss_val *refs);
 ss_val ss_blob_new (ss_store ss, int blob_len, void *blob);
+ss_val ss_blob_new_compressed (ss_store ss, int blob_len, void *blob);
 
 ss_store ss_find_object_store (ss_val v);
 
@@ -126,14 +218,23 @@ ss_val ss_copy (ss_store ss, ss_val v);
 ss_val ss_insert (ss_store ss, ss_val obj, int index, ss_val v);
 ss_val ss_insert_many (ss_store ss, ss_val obj, int index, int n, ...);
 
+/* Iterates over the fields of a record, or over the elements of a
+   set as used by ss_dict_add and ss_dict_del.
+*/
 DYN_DECLARE_STRUCT_ITER (ss_val, ss_elts, ss_val rec)
 {
   ss_val rec;
   int i;
   ss_val elt;
+
+  int level;
+  ss_val node[10];
+  int index[10];
 };
 
-uint32_t ss_hash (ss_val obj);
+int ss_set_len (ss_val set);
+
+uint32_t ss_hash (ss_store ss, ss_val obj);
 
 struct ss_tab;
 typedef struct ss_tab ss_tab;
@@ -146,8 +247,22 @@ ss_val ss_tab_intern (ss_tab *tab, ss_val v);
 ss_val ss_tab_intern_x (ss_tab *tab, ss_val v,
                         uint32_t hash, bool (*equal) (ss_val a, ss_val b));
 ss_val ss_tab_intern_blob (ss_tab *ot, int len, void *blob);
+ss_val ss_tab_intern_blob_compressed (ss_tab *ot, int len, void *blob);
 ss_val ss_tab_intern_soft (ss_tab *ot, int len, void *blob);
 
+/* Interning many blobs at once is faster than one after the other,
+   since the trie is walked only once for all of them.  The interned
+   blobs are stored in the VAL members.
+ */
+typedef struct {
+  int len;
+  void *blob;
+  bool compressed;
+  ss_val val;
+} ss_tab_intern_op;
+
+void ss_tab_intern_batch (ss_tab *ot, int n, ss_tab_intern_op *ops);
+
 DYN_DECLARE_STRUCT_ITER (ss_val, ss_tab_entries, ss_tab *t)
 {
   ss_tab *tab;
@@ -186,6 +301,21 @@ void ss_dict_update_members (ss_dict *d,
 					     void *data),
 			     void *data);
 
+/* Applies the operations in OPS as if by calling ss_dict_set,
+   ss_dict_add, or ss_dict_del for each in turn, but in a single walk
+   over the trie.
+ */
+#define SS_DICT_OP_SET 0
+#define SS_DICT_OP_ADD 1
+#define SS_DICT_OP_DEL 2
+
+typedef struct {
+  int op;
+  ss_val key, val;
+} ss_dict_op;
+
+void ss_dict_apply_batch (ss_dict *d, int n, ss_dict_op *ops);
+
 DYN_DECLARE_STRUCT_ITER (void, ss_dict_entries, ss_dict *d)
 {
   ss_dict *dict;
@@ -199,10 +329,29 @@ DYN_DECLARE_STRUCT_ITER (void, ss_dict_entries, ss_dict *d)
 DYN_DECLARE_STRUCT_ITER (void, ss_dict_entry_members, ss_dict *d)
 {
   ss_dict_entries entries;
-  int index;
+  ss_elts elts;
   ss_val key, val;
 };
 
+/* A vector maps records with a counted tag (64 to 79) to values,
+   like a strong dictionary, but is indexed by the small integer in
+   their first field instead of by their address.  Getting and setting
+   entries only walks a few levels of a radix tree.  The ids change in
+   a full collection, and vectors are rebuilt then to follow them.
+   Use ss_is (v, SS_VEC_TAG) to recognize a vector.
+ */
+
+struct ss_vec;
+typedef struct ss_vec ss_vec;
+
+ss_vec *ss_vec_init (ss_store ss, ss_val vec);
+ss_val ss_vec_finish (ss_vec *v);
+void ss_vec_abort (ss_vec *v);
+ss_val ss_vec_store (ss_vec *v);
+void ss_vec_set (ss_vec *v, ss_val key, ss_val val);
+ss_val ss_vec_get (ss_vec *v, ss_val key);
+void ss_vec_foreach (void (*func) (ss_val key, ss_val val), ss_vec *v);
+
 ss_val ss_ref_safely (ss_val obj, int i);
 int ss_streq (ss_val obj, const char *str);
 
@@ -210,9 +359,77 @@ int ss_equal_blob (ss_val b, int len, const void *blob);
 
 int ss_strcmp (ss_val a, ss_val b);
 
+/* Counters for the memory management of unstored objects.  Tables,
+   dictionaries and vectors allocate the nodes of their tries from
+   arenas while they are changed.  The counters only ever increase, and are added
+   up over all threads.
+ */
+typedef struct {
+  uint64_t mallocs;         // objects malloced or realloced
+  uint64_t arena_allocs;    // blocks taken from an arena
+  uint64_t arena_reused;    // ... that came from a free list
+  uint64_t arena_chunks;    // chunks malloced for arenas
+  uint64_t grown_in_place;  // resizes that needed no new memory
+} ss_unstored_stats;
+
+void ss_get_unstored_stats (ss_unstored_stats *stats);
+
+/* Profiling
+
+   ss_profile_store looks at every object in a struct-store and finds
+   the ones that are reachable from the root.  Weak references are
+   treated like strong ones, so the reported garbage is the least that
+   a collection would reclaim.  ss_profile_trie looks at the shape of
+   a table, dictionary, large set or vector, or of a record of weak
+   records, and returns false if TRIE is none of those.
+ */
+
+typedef struct {
+  int n_objects[128], n_live_objects[128];
+  uint64_t n_words[128], n_live_words[128];
+  uint64_t total_words;       // including padding
+  uint64_t live_words;
+  uint64_t padding_words;
+  uint64_t young_words;       // allocated since the last collection
+  uint64_t young_live_words;
+} ss_store_profile;
+
+void ss_profile_store (ss_store ss, ss_store_profile *prof);
+void ss_store_profile_dump (ss_store_profile *prof);
+
+#define SS_PROFILE_MAX_DEPTH      12
+#define SS_PROFILE_MAX_COLLISIONS 8
+#define SS_PROFILE_MAX_FANOUT     32
+
+typedef struct {
+  int n_entries;
+  int n_search_nodes;
+  int n_dispatch_nodes;
+  uint64_t n_words;
+  int depth[SS_PROFILE_MAX_DEPTH];        // search nodes per level
+  int fanout[SS_PROFILE_MAX_FANOUT+1];    // dispatch nodes per children
+  int collisions[SS_PROFILE_MAX_COLLISIONS+1];  // search nodes per entries
+} ss_trie_profile;
+
+bool ss_profile_trie (ss_val trie, ss_trie_profile *prof);
+void ss_trie_profile_dump (ss_trie_profile *prof);
+
 /* Debugging
  */
 void ss_scan_store (ss_store ss);
+
+/* Make the collector take simpler paths, for comparing their results
+   and speed with the normal ones.  SS_GC_DEBUG_INSERT rebuilds
+   dictionaries by inserting their entries one by one.
+   SS_GC_DEBUG_BREADTH_FIRST lays out objects in the order in which
+   they are found, breadth-first, and copies compressed blobs where
+   they are found.
+ */
+#define SS_GC_DEBUG_INSERT         1
+#define SS_GC_DEBUG_BREADTH_FIRST  2
+
+void ss_gc_set_debug (int flags);
+
 int ss_id (ss_store ss, ss_val x);
 void ss_tab_dump (ss_tab *ot);
 void ss_dump_store (ss_store ss, const char *header);
@@ -15,10 +15,15 @@
  * along with this program.  If not, see http://www.gnu.org/licenses/.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "dpm.h"
 
@@ -33,7 +38,10 @@
 static void
 failure_printer (const char *file, int line, const char *fmt, va_list ap)
 {
-  dyn_print ("%s:%d: %L\n", file, line, fmt, ap);
+  va_list aq;
+  va_copy (aq, ap);
+  dyn_print ("%s:%d: %L\n", file, line, fmt, &aq);
+  va_end (aq);
 }
 
 SET_FAILURE_PRINTER (failure_printer);
@@ -263,6 +271,59 @@ DEFTEST (dyn_type)
   EXPECT (containers_alive == 0);
 }
 
+DYN_DECLARE_TYPE (bigbox);
+
+struct bigbox_struct {
+  char data[1000];
+};
+
+void
+bigbox_unref (dyn_type *t, void *b)
+{
+}
+
+int
+bigbox_equal (void *a, void *b)
+{
+  return a == b;
+}
+
+DYN_DEFINE_TYPE (bigbox, "bigbox");
+
+DEFTEST (dyn_type_stats)
+{
+  dyn_type_stats before, during, after;
+
+  dyn_get_type_stats (container_type, &before);
+  dyn_block
+    {
+      for (int i = 0; i < 3; i++)
+	dyn_new (container);
+      dyn_get_type_stats (container_type, &during);
+      EXPECT (during.live_objects == before.live_objects + 3);
+      EXPECT (during.live_bytes
+	      >= before.live_bytes + 3 * sizeof (struct container_struct));
+    }
+  dyn_get_type_stats (container_type, &after);
+  EXPECT (after.live_objects == before.live_objects);
+  EXPECT (after.live_bytes == before.live_bytes);
+
+  /* Large values are counted as well.
+   */
+  dyn_get_type_stats (bigbox_type, &before);
+  dyn_block
+    {
+      bigbox b = dyn_new (bigbox);
+      b->data[sizeof (b->data) - 1] = 1;
+      dyn_get_type_stats (bigbox_type, &during);
+      EXPECT (during.live_objects == before.live_objects + 1);
+      EXPECT (during.live_bytes >= before.live_bytes + sizeof (b->data));
+    }
+  dyn_get_type_stats (bigbox_type, &after);
+  EXPECT (after.live_objects == before.live_objects);
+  EXPECT (after.live_bytes == before.live_bytes);
+}
+
 DEFTEST (dyn_string)
 {
   dyn_block
@@ -311,6 +372,15 @@ DEFTEST (dyn_input)
       dyn_input in = dyn_open_file (name);
       expect_numbers (in);
 
+      dyn_input inm = dyn_open_mmap (name);
+      expect_numbers (inm);
+
+      EXPECT_STDERR (1, "can't map /dev/null: No such device\n")
+	dyn_open_mmap ("/dev/null");
+
+      dyn_input inn = dyn_open_file ("/dev/null");
+      EXPECT (dyn_input_grow (inn, 1) == 0);
+
       dyn_input inz = dyn_open_file (testsrc ("numbers.gz"));
       expect_numbers (inz);
 
@@ -322,6 +392,56 @@ DEFTEST (dyn_input)
     }
 }
 
+DEFTEST (dyn_charset)
+{
+  /* Long enough for the vectorized scanner, with delimiters at every
+     offset within a 16 byte chunk.
+   */
+  const char *sets[] = { "x", ":\n", " \t\n,(|", "abcdefghijkl", NULL };
+  char buf[200];
+  for (int i = 0; i < sizeof (buf); i++)
+    buf[i] = "0123456789"[i % 10];
+  for (int i = 17; i < sizeof (buf); i += 17 + i % 5)
+    buf[i] = "x:\n,|l"[i % 6];
+
+  for (int s = 0; sets[s]; s++)
+    dyn_block
+      {
+	dyn_charset set;
+	dyn_charset_init (&set, sets[s]);
+
+	dyn_input in = dyn_open_string (buf, sizeof (buf));
+	dyn_input_count_lines (in);
+	dyn_input_set_mark (in);
+	int pos = 0, lineno = 1;
+	while (1)
+	  {
+	    while (pos < sizeof (buf) && !strchr (sets[s], buf[pos]))
+	      {
+		if (buf[pos] == '\n')
+		  lineno++;
+		pos++;
+	      }
+
+	    int found = dyn_input_find_set (in, &set);
+	    EXPECT (found == (pos < sizeof (buf)));
+	    EXPECT (dyn_input_pos (in) - dyn_input_mark (in) == pos);
+	    EXPECT (dyn_input_lineno (in) == lineno);
+	    if (!found)
+	      break;
+
+	    dyn_input_skip_set (in, &set);
+	    while (pos < sizeof (buf) && strchr (sets[s], buf[pos]))
+	      {
+		if (buf[pos] == '\n')
+		  lineno++;
+		pos++;
+	      }
+	    EXPECT (dyn_input_pos (in) - dyn_input_mark (in) == pos);
+	  }
+      }
+}
+
 DEFTEST (dyn_output)
 {
   dyn_block
@@ -393,6 +513,62 @@ DEFTEST (dyn_var)
   EXPECT (dyn_eq (dyn_get (var_1), "foo"));
 }
 
+static void *
+dyn_thread (void *data)
+{
+  container c = data;
+  bool ok = true;
+
+  dyn_block
+    {
+      /* The binding of the main thread is not visible here.
+       */
+      ok = ok && dyn_eq (dyn_get (var_1), "global");
+      dyn_let (var_1, S("thread"));
+      for (int i = 0; i < 100000; i++)
+	dyn_block
+	  {
+	    dyn_ref (c);
+	    dyn_unref_on_unwind (c);
+	  }
+      ok = ok && dyn_eq (dyn_get (var_1), "thread");
+    }
+  ok = ok && dyn_eq (dyn_get (var_1), "global");
+
+  return ok? data : NULL;
+}
+
+DEFTEST (dyn_threads)
+{
+  dyn_set (var_1, S("global"));
+
+  dyn_block
+    {
+      dyn_let (var_1, S("main"));
+
+      container c = dyn_ref (dyn_share (dyn_new (container)));
+      containers_alive = 1;
+
+      pthread_t threads[4];
+      for (int i = 0; i < 4; i++)
+	pthread_create (&threads[i], NULL, dyn_thread, c);
+      for (int i = 0; i < 4; i++)
+	{
+	  void *result;
+	  pthread_join (threads[i], &result);
+	  EXPECT (result == c);
+	}
+
+      EXPECT (dyn_eq (dyn_get (var_1), "main"));
+      dyn_unref (c);
+      EXPECT (containers_alive == 1);
+    }
+
+  EXPECT (containers_alive == 0);
+  EXPECT (dyn_eq (dyn_get (var_1), "global"));
+  dyn_set (var_1, NULL);
+}
+
 static void
 throw_test (dyn_target *target, void *data)
 {
@@ -432,6 +608,48 @@ DEFTEST (dyn_catch)
     }
 }
 
+static void
+count_unwind (int for_throw, void *data)
+{
+  *(int *)data += 1;
+}
+
+static void
+deep_throw_test (dyn_target *target, void *data)
+{
+  void deep (int n)
+  {
+    dyn_block
+      {
+	dyn_on_unwind (count_unwind, data);
+	if (n > 0)
+	  deep (n - 1);
+	else
+	  dyn_throw (target, S("deep"));
+      }
+  }
+
+  deep (10000);
+}
+
+DEFTEST (dyn_deep_catch)
+{
+  /* The windlist grows while the target of the throw is on it.
+   */
+  dyn_block
+    {
+      int i = 0;
+      dyn_val x = dyn_catch (deep_throw_test, &i);
+      EXPECT (dyn_eq (x, "deep"));
+      EXPECT (i == 10001);
+
+      i = 0;
+      x = dyn_catch (deep_throw_test, &i);
+      EXPECT (dyn_eq (x, "deep"));
+      EXPECT (i == 10001);
+    }
+}
+
 static void
 unhandled_test (dyn_val val)
 {
@@ -527,6 +745,108 @@ DEFTEST (store_basic)
     }
 }
 
+DEFTEST (store_upgrade)
+{
+  dyn_block
+    {
+      dyn_val name = testdst ("store.db");
+
+      /* A version 0 or 1 store with a blob and a record that refers
+         to it.  References are byte offsets in version 0 and word
+         offsets in version 1, the root is relative to the header.
+      */
+      void write_store (int version)
+      {
+	int shift = (version == 0? 0 : 1);
+	uint32_t words[21 + 2 + 3];
+	memset (words, 0, sizeof (words));
+	words[0] = 0x42445453;
+	words[1] = version;
+	words[2] = (23*4) >> shift;
+	words[3] = 5;
+	words[4] = 5;
+	words[21] = 0x7F000003;
+	memcpy (words + 22, "foo", 3);
+	words[23] = 0x05000002;
+	words[24] = (uint32_t)((-2*4) >> shift);
+	words[25] = (12 << 2) | 3;
+
+	FILE *f = fopen (name, "w");
+	fwrite (words, sizeof (words), 1, f);
+	fclose (f);
+      }
+
+      void check (ss_store s)
+      {
+        ss_val r = ss_get_root (s);
+        EXPECT (ss_is (r, 5) && ss_len (r) == 2);
+        EXPECT (ss_ref_int (r, 1) == 12);
+        ss_val x = ss_ref (r, 0);
+        EXPECT (ss_is_blob (x) && ss_len (x) == 3);
+        EXPECT (strncmp (ss_blob_start (x), "foo", 3) == 0);
+      }
+
+      for (int version = 0; version < 2; version++)
+	{
+	  write_store (version);
+	  check (ss_open (name, SS_READ));
+	  check (ss_open (name, SS_WRITE));
+	  check (ss_open (name, SS_READ));
+	}
+    }
+}
+
+DEFTEST (store_header_slots)
+{
+  dyn_block
+    {
+      dyn_val name = testdst ("store.db");
+
+      dyn_val s = ss_open (name, SS_TRUNC);
+      ss_set_root (s, ss_blob_new (s, 1, "A"));
+      ss_set_root (s, ss_blob_new (s, 1, "B"));
+      EXPECT (strncmp (ss_blob_start (ss_get_root (s)), "B", 1) == 0);
+
+      /* The second root went into the first slot, right after the
+         magic and version words.  When it is damaged, the first root
+         in the second slot is used.
+      */
+      int fd = open (name, O_RDWR);
+      uint32_t seq;
+      EXPECT (pread (fd, &seq, sizeof (seq), 8) == sizeof (seq));
+      EXPECT (seq == 2);
+      seq = 12;
+      EXPECT (pwrite (fd, &seq, sizeof (seq), 8) == sizeof (seq));
+      close (fd);
+
+      s = ss_open (name, SS_WRITE);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (s)), "A", 1) == 0);
+
+      ss_set_root (s, ss_blob_new (s, 1, "C"));
+      s = ss_open (name, SS_READ);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (s)), "C", 1) == 0);
+
+      /* A root whose objects didn't make it to the disk is not used.
+      */
+      s = ss_open (name, SS_WRITE);
+      ss_set_root (s, ss_blob_new (s, 4, "lost"));
+
+      struct stat buf;
+      EXPECT (stat (name, &buf) == 0);
+      char *data = malloc (buf.st_size);
+      fd = open (name, O_RDWR);
+      EXPECT (pread (fd, data, buf.st_size, 0) == buf.st_size);
+      char *lost = memmem (data, buf.st_size, "lost", 4);
+      EXPECT (lost != NULL);
+      EXPECT (pwrite (fd, "LOST", 4, lost - data) == 4);
+      close (fd);
+      free (data);
+
+      s = ss_open (name, SS_READ);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (s)), "C", 1) == 0);
+    }
+}
+
 DYN_DECLARE_STRUCT_ITER (const char *, sgb_words)
 {
   dyn_input in;
@@ -755,6 +1075,58 @@ DEFTEST (store_table)
     }
 }
 
+DEFTEST (store_table_hash_versions)
+{
+  dyn_block
+    {
+      dyn_val name = testdst ("store.db");
+
+      /* Version 2 stores keep using the old hash function for their
+         tables, also across garbage collections.  Version 3 and 4
+         stores become version 5 stores, which use the same one.  An
+         empty store of version 4 or earlier is the magic, the version,
+         and two slots of 21 zero words, sealed with a checksum.
+      */
+      for (int version = 2; version <= 4; version++)
+	{
+	  uint32_t head[2 + 2*21];
+	  memset (head, 0, sizeof (head));
+	  head[0] = 0x42445453;
+	  head[1] = version;
+	  head[2+20] = head[2+21+20] = crc32 (0, (void *)(head + 2),
+					      20 * sizeof (uint32_t));
+	  FILE *f = fopen (name, "w");
+	  fwrite (head, sizeof (head), 1, f);
+	  fclose (f);
+
+	  dyn_val s = ss_open (name, SS_WRITE);
+	  ss_tab *t = ss_tab_init (s, NULL);
+	  ss_val blobs[6000];
+	  int n = 0;
+	  dyn_foreach (w, sgb_words)
+	    blobs[n++] = ss_tab_intern_blob (t, strlen (w), (void *)w);
+	  ss_val words = ss_newv (s, 0, n, blobs);
+	  ss_set_root (s, ss_new (s, 0, 2, ss_tab_finish (t), words));
+	  s = ss_gc (s);
+
+	  s = ss_open (name, SS_READ);
+	  t = ss_tab_init (s, ss_ref (ss_get_root (s), 0));
+	  dyn_foreach (w, sgb_words)
+	    {
+	      ss_val b = ss_tab_intern_soft (t, strlen (w), (void *)w);
+	      EXPECT (b && strncmp (w, ss_blob_start (b), strlen (w)) == 0);
+	    }
+	  ss_tab_abort (t);
+
+	  int fd = open (name, O_RDONLY);
+	  int v;
+	  EXPECT (pread (fd, &v, sizeof (v), 4) == sizeof (v));
+	  close (fd);
+	  EXPECT (v == (version == 2? 2 : 5));
+	}
+    }
+}
+
 DEFTEST (store_table_foreach)
 {
   dyn_block
@@ -941,146 +1313,1509 @@ DEFTEST (store_dict_weak)
     }
 }
 
-DEFTEST (store_dict_weak_set)
+DEFTEST (store_gc_minor)
 {
   dyn_block
     {
-      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+      dyn_val name = testdst ("store.db");
+      dyn_val s = ss_open (name, SS_TRUNC);
 
       ss_tab *t = ss_tab_init (s, NULL);
-      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_WEAK_SETS);
-      
-      dyn_foreach_iter (u, contiguous_usa)
+      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_WEAK_KEYS);
+      ss_val v[200];
+      int ids[100];
+
+      // The first 100 words become old.
+
+      int i = 0;
+      dyn_foreach (w, sgb_words)
 	{
-	  ss_val a = ss_tab_intern_blob (t, strlen(u.a), (void *)u.a);
-	  ss_val b = ss_tab_intern_blob (t, strlen(u.b), (void *)u.b);
-	  ss_dict_add (d, a, b);
+	  if (i < 100)
+	    {
+	      v[i] = ss_tab_intern_blob (t, strlen(w), (void *)w);
+	      ss_dict_set (d, v[i], ss_from_int (i));
+	    }
+	  i += 1;
 	}
 
-      ss_set_root (s, ss_new (s, 0, 2,
+      ss_set_root (s, ss_new (s, 0, 3,
 			      ss_tab_finish (t),
-			      ss_dict_finish (d)));
+			      ss_dict_finish (d),
+			      ss_newv (s, 0, 100, v)));
       s = ss_gc (s);
       ss_val r = ss_get_root (s);
 
-      EXPECT (ss_ref (r, 0) == NULL);
-      EXPECT (ss_ref (r, 1) == NULL);
+      for (i = 0; i < 100; i++)
+	ids[i] = ss_id (s, ss_ref (ss_ref (r, 2), i));
 
-      t = ss_tab_init (s, NULL);
-      d = ss_dict_init (s, NULL, SS_DICT_WEAK_SETS);
-      ss_val v[20];
+      // The next 100 are young, and only 50 of them survive.  Some
+      // more garbage is created before them.
 
-      int i = 0;
-      dyn_foreach_iter (u, contiguous_usa)
+      char garbage[10000];
+      memset (garbage, 0, sizeof (garbage));
+      ss_blob_new (s, sizeof (garbage), garbage);
+
+      t = ss_tab_init (s, ss_ref (r, 0));
+      d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_WEAK_KEYS);
+
+      i = 0;
+      dyn_foreach (w, sgb_words)
 	{
-	  ss_val a = ss_tab_intern_blob (t, strlen(u.a), (void *)u.a);
-	  ss_val b = ss_tab_intern_blob (t, strlen(u.b), (void *)u.b);
-	  ss_dict_add (d, a, b);
-	  if (i < 20)
-	    v[i] = b;
-	  i++;
+	  if (i >= 100 && i < 200)
+	    {
+	      v[i] = ss_tab_intern_blob (t, strlen(w), (void *)w);
+	      ss_dict_set (d, v[i], ss_from_int (i));
+	    }
+	  i += 1;
 	}
 
-      ss_set_root (s, ss_new (s, 0, 3,
+      int young_id = ss_id (s, v[100]);
+      ss_set_root (s, ss_new (s, 0, 4,
 			      ss_tab_finish (t),
 			      ss_dict_finish (d),
-			      ss_newv (s, 0, 20, v)));
-      s = ss_gc (s);
+			      ss_ref (r, 2),
+			      ss_newv (s, 0, 50, v + 100)));
+
+      struct stat before, after;
+      dyn_val reader = ss_open (name, SS_READ);
+      stat (name, &before);
+      s = ss_gc_minor (s);
+      stat (name, &after);
       r = ss_get_root (s);
-      
-      EXPECT (ss_ref (r, 0) != NULL);
-      EXPECT (ss_ref (r, 1) != NULL);
 
-      ss_val vv = ss_ref (r, 2);
+      // Old objects have not moved, young ones have been appended to
+      // the same file.  A reader still finds the young ones where
+      // they were.
+
+      for (i = 0; i < 100; i++)
+	EXPECT (ss_id (s, ss_ref (ss_ref (r, 2), i)) == ids[i]);
+      EXPECT (ss_id (s, ss_ref (ss_ref (r, 3), 0)) > young_id);
+      EXPECT (before.st_ino == after.st_ino);
+      ss_val ry = ss_ref (ss_ref (ss_get_root (reader), 3), 0);
+      ss_val y = ss_ref (ss_ref (r, 3), 0);
+      EXPECT (ss_id (reader, ry) == young_id);
+      EXPECT (ss_len (ry) == ss_len (y)
+	      && memcmp (ss_blob_start (ry), ss_blob_start (y),
+			 ss_len (y)) == 0);
+
       t = ss_tab_init (s, ss_ref (r, 0));
-      d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_WEAK_SETS);
+      d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_WEAK_KEYS);
 
       i = 0;
-      dyn_foreach_iter (u, contiguous_usa)
+      dyn_foreach (w, sgb_words)
 	{
-	  ss_val a = ss_tab_intern_soft (t, strlen(u.a), (void *)u.a);
-	  ss_val b = ss_tab_intern_soft (t, strlen(u.b), (void *)u.b);
-
-	  if (i < 20)
+	  if (i < 200)
 	    {
-	      EXPECT (a != NULL);
-	      EXPECT (b == ss_ref (vv, i));
-	      ss_val bb = ss_dict_get (d, a);
-	      EXPECT (bb != NULL);
-	      int found = 0;
-	      for (int j = 0; j < ss_len (bb); j++)
-		if (ss_ref (bb, j) == b)
-		  found = 1;
-	      EXPECT (found);
+	      ss_val b = ss_tab_intern_soft (t, strlen(w), (void *)w);
+	      if (i < 150)
+		{
+		  ss_val x = (i < 100
+			      ? ss_ref (ss_ref (r, 2), i)
+			      : ss_ref (ss_ref (r, 3), i - 100));
+		  EXPECT (b == x);
+		  EXPECT (ss_dict_get (d, b) == ss_from_int (i));
+		}
+	      else
+		EXPECT (b == NULL);
 	    }
-	  i++;
+	  i += 1;
 	}
 
+      ss_tab_abort (t);
+      ss_dict_abort (d);
     }
 }
 
-DEFTEST (store_dict_foreach)
+DEFTEST (store_gc_ephemeron_chain)
 {
   dyn_block
     {
       dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
 
-      ss_tab *t = ss_tab_init (s, NULL);
-      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_WEAK_SETS);
-      
-      int count = 0;
-      dyn_foreach_iter (u, contiguous_usa)
+      /* Weak dict I maps K[I] to a record that refers to K[I+1], and
+	 the same for M.  Only K[0] is alive, and the last of the K
+	 keeps X alive via a weak set.  There are more dicts than the
+	 collector used to allow.
+       */
+      const int n = 2000;
+      ss_val k[n+1], m[n+1], dicts[n];
+      for (int i = 0; i <= n; i++)
 	{
-	  ss_val a = ss_tab_intern_blob (t, strlen(u.a), (void *)u.a);
-	  ss_val b = ss_tab_intern_blob (t, strlen(u.b), (void *)u.b);
-	  ss_dict_add (d, a, b);
-	  count++;
+	  k[i] = ss_new (s, 0, 1, ss_from_int (i));
+	  m[i] = ss_new (s, 0, 1, ss_from_int (i));
+	}
+      for (int i = 0; i < n; i++)
+	{
+	  ss_dict *d = ss_dict_init (s, NULL, SS_DICT_WEAK_KEYS);
+	  ss_dict_set (d, k[i], ss_new (s, 0, 1, k[i+1]));
+	  ss_dict_set (d, m[i], ss_new (s, 0, 1, m[i+1]));
+	  dicts[n-1-i] = ss_dict_finish (d);
 	}
+      ss_val x = ss_blob_new (s, 1, "x");
+      ss_dict *ws = ss_dict_init (s, NULL, SS_DICT_WEAK_SETS);
+      ss_dict_add (ws, x, k[n]);
+      ss_dict_add (ws, ss_blob_new (s, 1, "y"), m[n]);
 
-      int count2 = 0;
-      dyn_foreach_iter (kv, ss_dict_entries, d)
+      ss_set_root (s, ss_new (s, 0, 3, k[0], ss_newv (s, 0, n, dicts),
+			      ss_dict_finish (ws)));
+      s = ss_gc (s);
+      ss_val r = ss_get_root (s);
+
+      ss_val key = ss_ref (r, 0);
+      for (int i = 0; i < n; i++)
 	{
-	  count2 += ss_len (kv.val);
+	  ss_dict *d = ss_dict_init (s, ss_ref (ss_ref (r, 1), n-1-i),
+				     SS_DICT_WEAK_KEYS);
+	  int count = 0;
+	  dyn_foreach_iter (e, ss_dict_entries, d)
+	    count++;
+	  EXPECT (count == 1);
+	  EXPECT (ss_to_int (ss_ref (key, 0)) == i);
+	  key = ss_ref (ss_dict_get (d, key), 0);
+	  ss_dict_abort (d);
 	}
-      EXPECT (count == count2);
+      EXPECT (ss_to_int (ss_ref (key, 0)) == n);
 
-      int count3 = 0;
-      dyn_foreach_iter (km, ss_dict_entry_members, d)
+      ws = ss_dict_init (s, ss_ref (r, 2), SS_DICT_WEAK_SETS);
+      int count = 0;
+      dyn_foreach_iter (e, ss_dict_entries, ws)
 	{
-	  count3++;
+	  EXPECT (ss_streq (e.key, "x"));
+	  EXPECT (ss_ref (e.val, 0) == key);
+	  count++;
 	}
-      EXPECT (count == count3);
+      EXPECT (count == 1);
+      ss_dict_abort (ws);
     }
 }
 
-DEFTEST (parse_comma_fields)
+DEFTEST (store_gc_policy)
 {
   dyn_block
     {
-      dyn_val fields[4];
-      int i = 0;
-      dyn_input in = dyn_open_string ("  foo   ,bar,,x y\tz\n z\ny  ", -1);
-      dyn_foreach_iter (f, dpm_parse_comma_fields, in)
+      dyn_val name = testdst ("store.db");
+      dyn_val s = ss_open (name, SS_TRUNC);
+
+      /* About 20000 words are alive all the time, and each round
+	 leaves about 4000 words of garbage.  Every round collects.
+      */
+      const int n = 2000;
+      ss_val elts[n];
+      char text[32];
+      for (int i = 0; i < n; i++)
 	{
-	  EXPECT (i < 4);
-	  fields[i++] = dyn_from_stringn (f.field, f.len);
+	  memset (text, 0, sizeof (text));
+	  sprintf (text, "%d", i);
+	  elts[i] = ss_blob_new (s, sizeof (text), text);
 	}
+      ss_set_root (s, ss_newv (s, 0, n, elts));
+      s = ss_gc (s);
+      ss_gc_set_young_words (1000);
 
-      EXPECT (i == 4);
-      EXPECT (dyn_eq (fields[0], "foo"));
-      EXPECT (dyn_eq (fields[1], "bar"));
-      EXPECT (dyn_eq (fields[2], ""));
-      EXPECT (dyn_eq (fields[3], "x y\tz\n z\ny"));
+      int n_full = 0, n_minor = 0, max_len = 0;
+      for (int round = 0; round < 50; round++)
+	{
+	  char garbage[8000];
+	  memset (garbage, round, sizeof (garbage));
+	  ss_blob_new (s, sizeof (garbage), garbage);
+
+	  ss_val r = ss_get_root (s);
+	  for (int i = 0; i < n; i++)
+	    elts[i] = ss_ref (r, i);
+	  memset (text, 0, sizeof (text));
+	  sprintf (text, "round %d", round);
+	  elts[round] = ss_blob_new (s, sizeof (text), text);
+	  ss_set_root (s, ss_newv (s, 0, n, elts));
+
+	  struct stat before, after;
+	  stat (name, &before);
+	  s = ss_maybe_gc (s);
+	  stat (name, &after);
+	  if (before.st_ino != after.st_ino)
+	    n_full++;
+	  else
+	    n_minor++;
+
+	  int len = ss_id (s, ss_new (s, 0, 0));
+	  if (len > max_len)
+	    max_len = len;
+	}
+      ss_gc_set_young_words (0);
+
+      // Most collections are minor, but the garbage that they leave
+      // behind is cleaned up by full ones.
+
+      EXPECT (n_full > 0);
+      EXPECT (n_minor > n_full);
+      EXPECT (max_len < 3 * 20000);
+
+      ss_val r = ss_get_root (s);
+      for (int i = 0; i < n; i++)
+	{
+	  memset (text, 0, sizeof (text));
+	  if (i < 50)
+	    sprintf (text, "round %d", i);
+	  else
+	    sprintf (text, "%d", i);
+	  EXPECT (memcmp (ss_blob_start (ss_ref (r, i)), text,
+			  sizeof (text)) == 0);
+	}
     }
 }
 
-DEFTEST (parse_relations)
+DEFTEST (store_gc_layout)
 {
   dyn_block
     {
-      dyn_input in = dyn_open_string ("foo | bar (>= 1.0)", -1);
-      int i = 0;
-      dyn_foreach_iter (r, dpm_parse_relation_alternatives, in)
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      const int n = 100;
+      char text[1000];
+      memset (text, 'x', sizeof (text));
+      ss_val desc = ss_blob_new_compressed (s, sizeof (text), text);
+      ss_val recs[n];
+      for (int i = 0; i < n; i++)
+	recs[i] = ss_new (s, 0, 2, ss_blob_new (s, 3, "foo"), desc);
+      for (int i = 0; i < n; i++)
+	recs[i] = ss_new (s, 0, 1, recs[i]);
+
+      ss_set_root (s, ss_newv (s, 0, n, recs));
+      s = ss_gc (s);
+      ss_val r = ss_get_root (s);
+
+      /* Children follow their parents, and the compressed blob comes
+	 last.
+       */
+      for (int i = 0; i < n; i++)
+	{
+	  ss_val a = ss_ref (r, i), b = ss_ref (a, 0), c = ss_ref (b, 0);
+	  EXPECT (ss_id (s, b) == ss_id (s, a) + 2);
+	  EXPECT (ss_id (s, c) == ss_id (s, b) + 3);
+	  EXPECT (ss_id (s, ss_ref (b, 1)) > ss_id (s, c));
+	}
+
+      /* The old layout is still available, for comparison.  Siblings
+	 follow each other, and the compressed blob is copied where it
+	 is found.
+       */
+      ss_gc_set_debug (SS_GC_DEBUG_BREADTH_FIRST);
+      s = ss_gc (s);
+      ss_gc_set_debug (0);
+      r = ss_get_root (s);
+      for (int i = 1; i < n; i++)
+	EXPECT (ss_id (s, ss_ref (r, i)) == ss_id (s, ss_ref (r, i-1)) + 2);
+      ss_val b0 = ss_ref (ss_ref (r, 0), 0);
+      EXPECT (ss_id (s, ss_ref (b0, 1)) == ss_id (s, ss_ref (b0, 0)) + 2);
+    }
+}
+
+static void
+wait_for_file (const char *name)
+{
+  for (int i = 0; i < 1000 && access (name, F_OK) < 0; i++)
+    usleep (10000);
+}
+
+DEFTEST (store_gc_deferred)
+{
+  dyn_block
+    {
+      dyn_val name = testdst ("store.db");
+      dyn_val newname = testdst ("store.db.gcnew");
+      struct stat before, after;
+
+      dyn_val s = ss_open (name, SS_TRUNC);
+      ss_blob_new (s, 3, "bar");
+      ss_val x = ss_blob_new (s, 3, "foo");
+      ss_set_root (s, x);
+      int id = ss_id (s, x);
+
+      // The result of a minor collection is appended when the store
+      // has not changed.
+
+      ss_gc_deferred (s);
+      wait_for_file (newname);
+      EXPECT (access (newname, F_OK) == 0);
+
+      EXPECT (stat (name, &before) == 0);
+      s = ss_open (name, SS_WRITE);
+      EXPECT (stat (name, &after) == 0);
+      EXPECT (after.st_ino == before.st_ino);
+      x = ss_get_root (s);
+      EXPECT (ss_id (s, x) > id);
+      EXPECT (strncmp (ss_blob_start (x), "foo", 3) == 0);
+      EXPECT (access (newname, F_OK) < 0);
+
+      // The result is thrown away when a new root has been set, and
+      // no new collection is started right away.
+
+      static char garbage[8000];
+      ss_gc_deferred (s);
+      wait_for_file (newname);
+      ss_blob_new (s, sizeof garbage, garbage);
+      ss_set_root (s, ss_blob_new (s, 3, "baz"));
+
+      s = ss_open (name, SS_WRITE);
+      x = ss_get_root (s);
+      EXPECT (strncmp (ss_blob_start (x), "baz", 3) == 0);
+      EXPECT (access (newname, F_OK) < 0);
+
+      ss_gc_set_young_words (1000);
+      ss_set_root (s, ss_new (s, 0, 2, x, ss_blob_new (s, 3, "qux")));
+      ss_maybe_gc_deferred (s);
+      usleep (200000);
+      EXPECT (access (newname, F_OK) < 0);
+
+      // A full collection replaces the store.  Ss_maybe_gc_deferred
+      // starts one because there hasn't been any yet.
+
+      ss_blob_new (s, sizeof garbage, garbage);
+      ss_set_root (s, ss_new (s, 0, 2, x, ss_blob_new (s, 3, "qux")));
+      ss_maybe_gc_deferred (s);
+      wait_for_file (newname);
+      EXPECT (access (newname, F_OK) == 0);
+
+      s = ss_open (name, SS_WRITE);
+      EXPECT (stat (name, &after) == 0);
+      EXPECT (after.st_ino != before.st_ino);
+      x = ss_get_root (s);
+      EXPECT (ss_id (s, x) < id);
+      EXPECT (strncmp (ss_blob_start (ss_ref (x, 0)), "baz", 3) == 0);
+      EXPECT (strncmp (ss_blob_start (ss_ref (x, 1)), "qux", 3) == 0);
+      ss_gc_set_young_words (0);
+
+      // Anything else is ignored.
+
+      FILE *f = fopen (newname, "w");
+      fprintf (f, "garbage");
+      fclose (f);
+
+      s = ss_open (name, SS_WRITE);
+      x = ss_get_root (s);
+      EXPECT (strncmp (ss_blob_start (ss_ref (x, 1)), "qux", 3) == 0);
+      EXPECT (access (newname, F_OK) < 0);
+    }
+}
+
+DEFTEST (store_readers)
+{
+  dyn_block
+    {
+      dyn_val name = testdst ("store.db");
+
+      dyn_val w = ss_open (name, SS_TRUNC);
+      ss_set_root (w, ss_blob_new (w, 1, "A"));
+
+      // Readers don't need the lock, and can't write.
+
+      dyn_val r1 = ss_open (name, SS_READ);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (r1)), "A", 1) == 0);
+
+      dyn_val exp = dyn_format ("%s is read-only\n", name);
+      EXPECT_STDERR (1, exp)
+	{
+	  ss_blob_new (r1, 1, "X");
+	}
+
+      // A reader keeps its snapshot while the writer grows the file,
+      // and a new reader sees the new root.
+
+      static char garbage[100000];
+      for (int i = 0; i < 20; i++)
+	ss_blob_new (w, sizeof garbage, garbage);
+      ss_set_root (w, ss_blob_new (w, 1, "B"));
+
+      dyn_val r2 = ss_open (name, SS_READ);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (r1)), "A", 1) == 0);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (r2)), "B", 1) == 0);
+
+      // Garbage collection replaces the file, and existing readers
+      // are not affected.
+
+      w = ss_gc (w);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (w)), "B", 1) == 0);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (r1)), "A", 1) == 0);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (r2)), "B", 1) == 0);
+
+      // Starting over doesn't affect them either.
+
+      w = ss_open (name, SS_TRUNC);
+      EXPECT (ss_get_root (w) == NULL);
+      EXPECT (strncmp (ss_blob_start (ss_get_root (r1)), "A", 1) == 0);
+    }
+}
+
+DEFTEST (store_branches)
+{
+  dyn_block
+    {
+      dyn_val name = testdst ("store.db");
+
+      dyn_val s = ss_open (name, SS_TRUNC);
+      ss_val a = ss_blob_new (s, 1, "A");
+      ss_set_root (s, ss_new (s, 0, 2, a, NULL));
+      ss_val old_root = ss_get_root (s);
+
+      // A branch starts with the given root and keeps its changes to
+      // itself.
+
+      dyn_val b1 = ss_branch (s, old_root);
+      ss_val r = ss_get_root (b1);
+      EXPECT (ss_streq (ss_ref (r, 0), "A"));
+
+      ss_tab *t = ss_tab_init (b1, NULL);
+      ss_dict *d = ss_dict_init (b1, NULL, SS_DICT_STRONG);
+      ss_val key = ss_tab_intern_blob (t, 3, "key");
+      ss_dict_set (d, key, ss_ref (r, 0));
+      static char big[100000];
+      for (int i = 0; i < 50; i++)
+	ss_blob_new (b1, sizeof big, big);
+      ss_set_root (b1, ss_new (b1, 0, 3, ss_ref (r, 0),
+			       ss_tab_finish (t), ss_dict_finish (d)));
+
+      EXPECT (ss_get_root (s) == old_root);
+      EXPECT (ss_get_root (ss_open (name, SS_READ)) != NULL);
+      EXPECT (ss_len (ss_get_root (ss_open (name, SS_READ))) == 2);
+
+      // Another branch doesn't see that, and can be dropped.
+
+      dyn_block
+	{
+	  dyn_val b2 = ss_branch (s, old_root);
+	  EXPECT (ss_len (ss_get_root (b2)) == 2);
+	  ss_set_root (b2, ss_blob_new (b2, 1, "B"));
+	}
+
+      // Promoting makes the changes permanent.
+
+      ss_promote_branch (s, b1);
+      s = ss_open (name, SS_WRITE);
+      r = ss_get_root (s);
+      EXPECT (ss_len (r) == 3);
+      EXPECT (ss_streq (ss_ref (r, 0), "A"));
+      t = ss_tab_init (s, ss_ref (r, 1));
+      d = ss_dict_init (s, ss_ref (r, 2), SS_DICT_STRONG);
+      key = ss_tab_intern_soft (t, 3, "key");
+      EXPECT (key && ss_dict_get (d, key) == ss_ref (r, 0));
+      ss_tab_abort (t);
+      ss_dict_abort (d);
+
+      // But not once the store has changed in the meantime.
+
+      dyn_val b3 = ss_branch (s, ss_get_root (s));
+      ss_set_root (b3, ss_blob_new (b3, 1, "C"));
+      ss_blob_new (s, 1, "D");
+      dyn_val exp = dyn_format ("%s has changed since the branch was made\n",
+				name);
+      EXPECT_STDERR (1, exp)
+	{
+	  ss_promote_branch (s, b3);
+	}
+
+      exp = dyn_format ("Can't collect %s (branch)\n", name);
+      EXPECT_STDERR (1, exp)
+	{
+	  ss_gc (b3);
+	}
+    }
+}
+
+DEFTEST (store_weak_records)
+{
+  dyn_block
+    {
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      ss_val a = ss_blob_new (s, 1, "A");
+      ss_val b = ss_blob_new (s, 1, "B");
+      ss_val w = ss_new (s, SS_WEAK_TAG, 3, a, b, ss_from_int (12));
+      ss_set_root (s, ss_new (s, 0, 2, a, w));
+
+      // Only the fields that refer to otherwise live values survive.
+
+      s = ss_gc (s);
+      ss_val r = ss_get_root (s);
+      w = ss_ref (r, 1);
+      EXPECT (ss_len (w) == 3);
+      EXPECT (ss_ref (w, 0) == ss_ref (r, 0));
+      EXPECT (ss_streq (ss_ref (w, 0), "A"));
+      EXPECT (ss_ref (w, 1) == NULL);
+      EXPECT (ss_ref_int (w, 2) == 12);
+    }
+}
+
+static void
+copy_contents (const char *from, const char *to)
+{
+  FILE *f = fopen (from, "r"), *t = fopen (to, "w");
+  int c;
+
+  while ((c = getc (f)) != EOF)
+    putc (c, t);
+  fclose (f);
+  fclose (t);
+}
+
+static off_t
+file_size (const char *name)
+{
+  struct stat buf;
+  return stat (name, &buf) < 0? -1 : buf.st_size;
+}
+
+DEFTEST (store_delta)
+{
+  dyn_block
+    {
+      dyn_val name = testdst ("store.db");
+      dyn_val copy = testdst ("store-copy.db");
+      dyn_val delta1 = testdst ("store1.delta");
+      dyn_val delta2 = testdst ("store2.delta");
+
+      dyn_val s = ss_open (name, SS_TRUNC);
+      static char big[100000];
+      ss_val a = ss_blob_new (s, sizeof big, big);
+      ss_set_root (s, ss_new (s, 0, 1, a));
+      ss_val root0 = ss_get_root (s);
+      copy_contents (name, copy);
+
+      // Build a table and a dictionary on top of the first root and
+      // send only them over.
+
+      ss_tab *t = ss_tab_init (s, NULL);
+      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_STRONG);
+      ss_val key = ss_tab_intern_blob (t, 3, "key");
+      ss_dict_set (d, key, a);
+      ss_set_root (s, ss_new (s, 0, 3, a,
+			      ss_tab_finish (t), ss_dict_finish (d)));
+      ss_val root1 = ss_get_root (s);
+      ss_export_delta (s, root0, root1, delta1);
+      EXPECT (file_size (delta1) > 0);
+      EXPECT (file_size (delta1) < file_size (name) / 10);
+
+      dyn_block
+	{
+	  dyn_val c = ss_open (copy, SS_WRITE);
+	  ss_import_delta (c, delta1);
+	}
+
+      dyn_block
+	{
+	  dyn_val c = ss_open (copy, SS_READ);
+	  ss_val r = ss_get_root (c);
+	  EXPECT (ss_len (r) == 3);
+	  EXPECT (ss_len (ss_ref (r, 0)) == sizeof big);
+	  ss_tab *ct = ss_tab_init (c, ss_ref (r, 1));
+	  ss_dict *cd = ss_dict_init (c, ss_ref (r, 2), SS_DICT_STRONG);
+	  ss_val ckey = ss_tab_intern_soft (ct, 3, "key");
+	  EXPECT (ckey && ss_dict_get (cd, ckey) == ss_ref (r, 0));
+	  ss_tab_abort (ct);
+	  ss_dict_abort (cd);
+	}
+
+      // A second delta applies on top of the first.
+
+      ss_set_root (s, ss_new (s, 0, 2, root1, ss_blob_new (s, 1, "B")));
+      ss_export_delta (s, root1, ss_get_root (s), delta2);
+      dyn_block
+	{
+	  dyn_val c = ss_open (copy, SS_WRITE);
+	  ss_import_delta (c, delta2);
+	  ss_val r = ss_get_root (c);
+	  EXPECT (ss_len (r) == 2);
+	  EXPECT (ss_streq (ss_ref (r, 1), "B"));
+	  EXPECT (ss_len (ss_ref (r, 0)) == 3);
+	}
+
+      // But not twice.
+
+      dyn_val exp = dyn_format ("%s does not have the base root of %s\n",
+				copy, delta2);
+      EXPECT_STDERR (1, exp)
+	{
+	  dyn_val c = ss_open (copy, SS_WRITE);
+	  ss_import_delta (c, delta2);
+	}
+
+      // A minor collection in place keeps everything where the copy
+      // has it.
+
+      dyn_val delta3 = testdst ("store3.delta");
+      ss_val root2 = ss_get_root (s);
+      s = ss_gc_minor (s);
+      ss_set_root (s, ss_new (s, 0, 2, ss_get_root (s),
+			      ss_blob_new (s, 1, "C")));
+      ss_export_delta (s, root2, ss_get_root (s), delta3);
+      dyn_block
+	{
+	  dyn_val c = ss_open (copy, SS_WRITE);
+	  ss_import_delta (c, delta3);
+	  ss_val r = ss_get_root (c);
+	  EXPECT (ss_streq (ss_ref (r, 1), "C"));
+	  EXPECT (ss_streq (ss_ref (ss_ref (r, 0), 1), "B"));
+	}
+
+      // A full one moves them, and the copy refuses deltas from
+      // after it.
+
+      dyn_val delta4 = testdst ("store4.delta");
+      s = ss_gc (s);
+      ss_val root3 = ss_get_root (s);
+      ss_set_root (s, ss_new (s, 0, 2, root3, ss_blob_new (s, 1, "D")));
+      ss_export_delta (s, root3, ss_get_root (s), delta4);
+      exp = dyn_format ("%s is from generation 1 of its store, but %s is "
+			"at generation 0; one of them has been collected\n",
+			delta4, copy);
+      EXPECT_STDERR (1, exp)
+	{
+	  dyn_val c = ss_open (copy, SS_WRITE);
+	  ss_import_delta (c, delta4);
+	}
+    }
+}
+
+DEFTEST (store_vec)
+{
+  dyn_block
+    {
+      const int n = 3000;
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      ss_val keys[n];
+      for (int i = 0; i < n; i++)
+	keys[i] = ss_new (s, 64, 1, NULL);
+
+      ss_vec *v = ss_vec_init (s, NULL);
+      for (int i = 0; i < n; i += 2)
+	ss_vec_set (v, keys[i], ss_from_int (i));
+      ss_vec_set (v, keys[10], NULL);
+      ss_vec_set (v, keys[11], NULL);
+      ss_val vec = ss_vec_finish (v);
+
+      // Only the odd keys are kept alive by anything else than the
+      // vector, so all keys get new ids.
+
+      ss_val odd = NULL;
+      for (int i = n-1; i > 0; i -= 2)
+	odd = ss_new (s, 0, 2, keys[i], odd);
+      ss_set_root (s, ss_new (s, 0, 2, vec, odd));
+
+      for (int round = 0; round < 3; round++)
+	{
+	  if (round == 1)
+	    s = ss_gc (s);
+	  else if (round == 2)
+	    {
+	      // Changing some entries makes young nodes that are
+	      // copied by a minor collection.
+
+	      ss_val r = ss_get_root (s);
+	      v = ss_vec_init (s, ss_ref (r, 0));
+	      for (ss_val o = ss_ref (r, 1); o; o = ss_ref (o, 1))
+		ss_vec_set (v, ss_ref (o, 0), ss_from_int (2*n));
+	      ss_set_root (s, ss_new (s, 0, 2,
+				      ss_vec_finish (v), ss_ref (r, 1)));
+	      s = ss_gc_minor (s);
+	    }
+
+	  ss_val r = ss_get_root (s);
+	  v = ss_vec_init (s, ss_ref (r, 0));
+
+	  int count = 0;
+	  void check (ss_val key, ss_val val)
+	  {
+	    EXPECT (ss_vec_get (v, key) == val);
+	    EXPECT (ss_to_int (val) % 2 == 0 && ss_to_int (val) != 10);
+	    count++;
+	  }
+	  ss_vec_foreach (check, v);
+	  EXPECT (count == (round < 2? n/2 - 1 : n - 1));
+
+	  for (ss_val o = ss_ref (r, 1); o; o = ss_ref (o, 1))
+	    EXPECT (ss_vec_get (v, ss_ref (o, 0))
+		    == (round < 2? NULL : ss_from_int (2*n)));
+	  ss_vec_abort (v);
+	}
+    }
+}
+
+DEFTEST (store_dict_weak_set)
+{
+  dyn_block
+    {
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      ss_tab *t = ss_tab_init (s, NULL);
+      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_WEAK_SETS);
+      
+      dyn_foreach_iter (u, contiguous_usa)
+	{
+	  ss_val a = ss_tab_intern_blob (t, strlen(u.a), (void *)u.a);
+	  ss_val b = ss_tab_intern_blob (t, strlen(u.b), (void *)u.b);
+	  ss_dict_add (d, a, b);
+	}
+
+      ss_set_root (s, ss_new (s, 0, 2,
+			      ss_tab_finish (t),
+			      ss_dict_finish (d)));
+      s = ss_gc (s);
+      ss_val r = ss_get_root (s);
+
+      EXPECT (ss_ref (r, 0) == NULL);
+      EXPECT (ss_ref (r, 1) == NULL);
+
+      t = ss_tab_init (s, NULL);
+      d = ss_dict_init (s, NULL, SS_DICT_WEAK_SETS);
+      ss_val v[20];
+
+      int i = 0;
+      dyn_foreach_iter (u, contiguous_usa)
+	{
+	  ss_val a = ss_tab_intern_blob (t, strlen(u.a), (void *)u.a);
+	  ss_val b = ss_tab_intern_blob (t, strlen(u.b), (void *)u.b);
+	  ss_dict_add (d, a, b);
+	  if (i < 20)
+	    v[i] = b;
+	  i++;
+	}
+
+      ss_set_root (s, ss_new (s, 0, 3,
+			      ss_tab_finish (t),
+			      ss_dict_finish (d),
+			      ss_newv (s, 0, 20, v)));
+      s = ss_gc (s);
+      r = ss_get_root (s);
+      
+      EXPECT (ss_ref (r, 0) != NULL);
+      EXPECT (ss_ref (r, 1) != NULL);
+
+      ss_val vv = ss_ref (r, 2);
+      t = ss_tab_init (s, ss_ref (r, 0));
+      d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_WEAK_SETS);
+
+      i = 0;
+      dyn_foreach_iter (u, contiguous_usa)
+	{
+	  ss_val a = ss_tab_intern_soft (t, strlen(u.a), (void *)u.a);
+	  ss_val b = ss_tab_intern_soft (t, strlen(u.b), (void *)u.b);
+
+	  if (i < 20)
+	    {
+	      EXPECT (a != NULL);
+	      EXPECT (b == ss_ref (vv, i));
+	      ss_val bb = ss_dict_get (d, a);
+	      EXPECT (bb != NULL);
+	      int found = 0;
+	      for (int j = 0; j < ss_len (bb); j++)
+		if (ss_ref (bb, j) == b)
+		  found = 1;
+	      EXPECT (found);
+	    }
+	  i++;
+	}
+
+    }
+}
+
+DEFTEST (store_dict_large_sets)
+{
+  dyn_block
+    {
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      const int n = 1000;
+      ss_val key = ss_blob_new (s, 3, "key");
+      ss_val v[n];
+      for (int i = 0; i < n; i++)
+	v[i] = ss_from_int (i);
+      ss_val vals = ss_newv (s, 0, n, v);
+      for (int i = 0; i < n; i++)
+	v[i] = ss_new (s, 0, 1, ss_ref (vals, i));
+
+      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_WEAK_SETS);
+      for (int k = 0; k < 2; k++)
+	for (int i = 0; i < n; i++)
+	  ss_dict_add (d, key, v[i]);
+      EXPECT (ss_set_len (ss_dict_get (d, key)) == n);
+
+      for (int i = 1; i < n; i += 2)
+	ss_dict_del (d, key, v[i]);
+      EXPECT (ss_set_len (ss_dict_get (d, key)) == n/2);
+
+      int count = 0;
+      dyn_foreach_iter (km, ss_dict_entry_members, d)
+	{
+	  EXPECT (km.key == key);
+	  EXPECT (ss_to_int (ss_ref (km.val, 0)) % 2 == 0);
+	  count++;
+	}
+      EXPECT (count == n/2);
+
+      /* Only every fourth value survives the collection.
+       */
+      ss_val keep[n/4];
+      for (int i = 0; i < n/4; i++)
+	keep[i] = v[4*i];
+      ss_set_root (s, ss_new (s, 0, 3, key, ss_dict_finish (d),
+			      ss_newv (s, 0, n/4, keep)));
+      s = ss_gc (s);
+      ss_val r = ss_get_root (s);
+
+      d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_WEAK_SETS);
+      ss_val set = ss_dict_get (d, ss_ref (r, 0));
+      EXPECT (ss_set_len (set) == n/4);
+      bool seen[n];
+      memset (seen, 0, sizeof (seen));
+      dyn_foreach (m, ss_elts, set)
+	{
+	  int i = ss_to_int (ss_ref (m, 0));
+	  EXPECT (i % 4 == 0 && !seen[i]);
+	  seen[i] = true;
+	}
+
+      /* Shrinking turns it back into a record.
+       */
+      for (int i = 0; i < n/4 - 10; i++)
+	ss_dict_del (d, ss_ref (r, 0), ss_ref (ss_ref (r, 2), i));
+      set = ss_dict_get (d, ss_ref (r, 0));
+      EXPECT (ss_set_len (set) == 10);
+      EXPECT (ss_tag (set) == 0 && ss_len (set) == 10);
+      dyn_foreach (m, ss_elts, set)
+	EXPECT (ss_to_int (ss_ref (m, 0)) >= 4 * (n/4 - 10));
+      ss_dict_abort (d);
+
+      /* Large sets in strong dictionaries keep their elements alive.
+       */
+      key = ss_ref (r, 0);
+      d = ss_dict_init (s, NULL, SS_DICT_STRONG);
+      for (int i = 0; i < n; i++)
+	ss_dict_add (d, key, ss_from_int (i));
+      ss_set_root (s, ss_new (s, 0, 2, key, ss_dict_finish (d)));
+      s = ss_gc (s);
+      r = ss_get_root (s);
+      d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_STRONG);
+      set = ss_dict_get (d, ss_ref (r, 0));
+      EXPECT (ss_set_len (set) == n);
+      count = 0;
+      dyn_foreach (m, ss_elts, set)
+	count += ss_to_int (m);
+      EXPECT (count == n * (n-1) / 2);
+      ss_dict_abort (d);
+    }
+}
+
+DEFTEST (store_unstored_arena)
+{
+  dyn_block
+    {
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+      ss_unstored_stats before, after;
+
+      ss_get_unstored_stats (&before);
+      ss_tab *t = ss_tab_init (s, NULL);
+      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_STRONG);
+      for (int i = 0; i < 10000; i++)
+	{
+	  char buf[20];
+	  sprintf (buf, "%d", i);
+	  ss_val k = ss_tab_intern_blob (t, strlen (buf), buf);
+	  ss_dict_set (d, k, ss_from_int (i));
+	}
+      ss_get_unstored_stats (&after);
+
+      EXPECT (after.mallocs == before.mallocs);
+      EXPECT (after.arena_allocs > before.arena_allocs + 10000);
+      EXPECT (after.arena_reused > before.arena_reused);
+      EXPECT (after.grown_in_place > before.grown_in_place);
+
+      ss_set_root (s, ss_new (s, 0, 2,
+			      ss_tab_finish (t), ss_dict_finish (d)));
+      ss_val r = ss_get_root (s);
+      t = ss_tab_init (s, ss_ref (r, 0));
+      d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_STRONG);
+      for (int i = 0; i < 10000; i += 100)
+	{
+	  char buf[20];
+	  sprintf (buf, "%d", i);
+	  ss_val k = ss_tab_intern_soft (t, strlen (buf), buf);
+	  EXPECT (ss_to_int (ss_dict_get (d, k)) == i);
+	}
+      ss_tab_abort (t);
+      ss_dict_abort (d);
+
+      // Vectors too.
+
+      const int n = 2000;
+      ss_val keys[n];
+      for (int i = 0; i < n; i++)
+	keys[i] = ss_new (s, 64, 1, NULL);
+
+      ss_get_unstored_stats (&before);
+      ss_vec *v = ss_vec_init (s, NULL);
+      for (int i = n-1; i >= 0; i--)
+	ss_vec_set (v, keys[i], ss_from_int (i));
+      ss_get_unstored_stats (&after);
+
+      EXPECT (after.mallocs == before.mallocs);
+      EXPECT (after.arena_allocs > before.arena_allocs);
+
+      ss_val vec = ss_vec_finish (v);
+      v = ss_vec_init (s, vec);
+      for (int i = 0; i < n; i++)
+	EXPECT (ss_to_int (ss_vec_get (v, keys[i])) == i);
+      ss_vec_set (v, keys[0], ss_from_int (-1));
+      ss_vec_abort (v);
+    }
+}
+
+static void *
+arena_thread (void *data)
+{
+  ss_store s = data;
+  bool ok = true;
+
+  dyn_block
+    {
+      ss_tab *t = ss_tab_init (s, NULL);
+      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_STRONG);
+      for (int i = 0; i < 10000; i++)
+	{
+	  char buf[20];
+	  sprintf (buf, "%d", i);
+	  ss_dict_set (d, ss_tab_intern_blob (t, strlen (buf), buf),
+		       ss_from_int (i));
+	}
+      ss_set_root (s, ss_new (s, 0, 2,
+			      ss_tab_finish (t), ss_dict_finish (d)));
+
+      ss_val r = ss_get_root (s);
+      t = ss_tab_init (s, ss_ref (r, 0));
+      d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_STRONG);
+      for (int i = 0; i < 10000; i++)
+	{
+	  char buf[20];
+	  sprintf (buf, "%d", i);
+	  ss_val k = ss_tab_intern_soft (t, strlen (buf), buf);
+	  ok = ok && k && ss_to_int (ss_dict_get (d, k)) == i;
+	}
+      ss_tab_abort (t);
+      ss_dict_abort (d);
+    }
+
+  return ok? data : NULL;
+}
+
+DEFTEST (store_unstored_arena_threads)
+{
+  dyn_block
+    {
+      ss_unstored_stats before, after;
+      dyn_val s[4];
+      pthread_t threads[4];
+
+      for (int i = 0; i < 4; i++)
+	{
+	  char name[20];
+	  sprintf (name, "store-%d.db", i);
+	  s[i] = ss_open (testdst (name), SS_TRUNC);
+	}
+
+      // Each thread uses its own arenas, and the counters of all of
+      // them are added up.
+
+      ss_get_unstored_stats (&before);
+      for (int i = 0; i < 4; i++)
+	pthread_create (&threads[i], NULL, arena_thread, s[i]);
+      for (int i = 0; i < 4; i++)
+	{
+	  void *result;
+	  pthread_join (threads[i], &result);
+	  EXPECT (result == s[i]);
+	}
+      ss_get_unstored_stats (&after);
+
+      EXPECT (after.arena_allocs > before.arena_allocs + 4*10000);
+      EXPECT (after.arena_reused > before.arena_reused);
+    }
+}
+
+DEFTEST (store_compressed_blobs)
+{
+  dyn_block
+    {
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      /* More texts than fit into the decompression cache.
+       */
+      const int n = 40, len = 2000;
+      char text[n][len];
+      ss_val b[n];
+
+      ss_tab *t = ss_tab_init (s, NULL);
+      for (int i = 0; i < n; i++)
+	{
+	  for (int j = 0; j < len; j++)
+	    text[i][j] = 'a' + (j / 10 + i) % 26;
+	  b[i] = ss_tab_intern_blob_compressed (t, len, text[i]);
+	}
+
+      /* A compressed blob doesn't start right after its header.
+       */
+      EXPECT ((char *)ss_blob_start (b[0]) != (char *)b[0] + 4);
+
+      ss_val small = ss_blob_new_compressed (s, 10, "0123456789");
+      EXPECT ((char *)ss_blob_start (small) == (char *)small + 4);
+      EXPECT (ss_streq (small, "0123456789"));
+
+      for (int k = 0; k < 2; k++)
+	for (int i = 0; i < n; i++)
+	  {
+	    EXPECT (ss_is_blob (b[i]));
+	    EXPECT (ss_tag (b[i]) == SS_BLOB_TAG);
+	    EXPECT (ss_len (b[i]) == len);
+	    EXPECT (memcmp (ss_blob_start (b[i]), text[i], len) == 0);
+	    EXPECT (ss_tab_intern_blob (t, len, text[i]) == b[i]);
+	  }
+
+      ss_set_root (s, ss_new (s, 0, 2,
+			      ss_tab_finish (t), ss_newv (s, 0, n, b)));
+      s = ss_gc (s);
+      ss_val r = ss_get_root (s);
+
+      t = ss_tab_init (s, ss_ref (r, 0));
+      for (int i = 0; i < n; i++)
+	{
+	  ss_val x = ss_ref (ss_ref (r, 1), i);
+	  EXPECT (memcmp (ss_blob_start (x), text[i], len) == 0);
+	  EXPECT (ss_tab_intern_soft (t, len, text[i]) == x);
+	}
+      ss_tab_abort (t);
+    }
+}
+
+static void *zblob_main_data;
+
+static void *
+zblob_thread (void *data)
+{
+  void *d = ss_blob_start (data);
+  if (d == zblob_main_data || memcmp (d, zblob_main_data, 1000) != 0)
+    return NULL;
+  return data;
+}
+
+DEFTEST (store_compressed_blobs_cache)
+{
+  dyn_block
+    {
+      char text[1000];
+      for (int j = 0; j < 1000; j++)
+	text[j] = 'a' + j / 10 % 26;
+
+      dyn_val a = ss_open (testdst ("store.db"), SS_TRUNC);
+      ss_val b = ss_blob_new_compressed (a, sizeof text, text);
+      void *data = ss_blob_start (b);
+      EXPECT (memcmp (data, text, sizeof text) == 0);
+
+      // Closing another store keeps the entry.
+
+      dyn_block
+	{
+	  dyn_val c = ss_open (testdst ("store-2.db"), SS_TRUNC);
+	  ss_blob_start (ss_blob_new_compressed (c, sizeof text, text));
+	}
+      EXPECT (ss_blob_start (b) == data);
+
+      // Other threads have their own cache.
+
+      pthread_t thread;
+      void *result;
+      zblob_main_data = data;
+      pthread_create (&thread, NULL, zblob_thread, b);
+      pthread_join (thread, &result);
+      EXPECT (result == b);
+      EXPECT (ss_blob_start (b) == data);
+
+      // Closing its store drops it.  The next store might well be
+      // mapped at the same address, with a different blob in the
+      // same place.
+
+      for (int i = 0; i < 2; i++)
+	dyn_block
+	  {
+	    text[0] = 'X' + i;
+	    dyn_val c = ss_open (testdst ("store-2.db"), SS_TRUNC);
+	    b = ss_blob_new_compressed (c, sizeof text, text);
+	    EXPECT (memcmp (ss_blob_start (b), text, sizeof text) == 0);
+	  }
+    }
+}
+
+DEFTEST (store_profile)
+{
+  dyn_block
+    {
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      ss_tab *t = ss_tab_init (s, NULL);
+      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_STRONG);
+      int n = 0;
+      dyn_foreach (w, sgb_words)
+	{
+	  ss_val b = ss_tab_intern_blob (t, strlen (w), (void *)w);
+	  ss_dict_set (d, b, ss_from_int (n++));
+	}
+      ss_set_root (s, ss_new (s, 0, 2, ss_tab_store (t), ss_dict_store (d)));
+      s = ss_gc (s);
+
+      /* Replacing the dictionary makes the old one garbage.
+       */
+      ss_val r = ss_get_root (s);
+      ss_dict_abort (d);
+      ss_tab_abort (t);
+      d = ss_dict_init (s, NULL, SS_DICT_STRONG);
+      ss_dict_set (d, ss_ref (r, 0), NULL);
+      ss_set_root (s, ss_new (s, 0, 2, ss_ref (r, 0), ss_dict_finish (d)));
+
+      ss_store_profile prof;
+      ss_profile_store (s, &prof);
+
+      uint64_t words = prof.padding_words, live_words = 0;
+      for (int i = 0; i < 128; i++)
+	{
+	  words += prof.n_words[i];
+	  live_words += prof.n_live_words[i];
+	}
+      EXPECT (words == prof.total_words);
+      EXPECT (live_words == prof.live_words);
+      EXPECT (prof.n_live_objects[SS_BLOB_TAG] == n);
+      EXPECT (prof.live_words < prof.total_words - prof.padding_words);
+      EXPECT (prof.young_words > 0 && prof.young_words < prof.total_words);
+
+      ss_trie_profile trie;
+      EXPECT (ss_profile_trie (ss_ref (r, 0), &trie));
+      EXPECT (trie.n_entries == n);
+      int n_search = 0, n_dispatch = 0;
+      for (int i = 0; i <= SS_PROFILE_MAX_COLLISIONS; i++)
+	n_search += trie.collisions[i];
+      for (int i = 0; i <= 32; i++)
+	n_dispatch += trie.fanout[i];
+      EXPECT (n_search == trie.n_search_nodes);
+      EXPECT (n_dispatch == trie.n_dispatch_nodes);
+
+      EXPECT (ss_profile_trie (ss_ref (r, 1), &trie));
+      EXPECT (trie.n_entries == n);
+      EXPECT (!ss_profile_trie (ss_get_root (s), &trie));
+
+      /* Vectors, and records of weak records.
+       */
+      const int n_keys = 100;
+      ss_val keys[n_keys];
+      ss_vec *v = ss_vec_init (s, NULL);
+      for (int i = 0; i < n_keys; i++)
+	{
+	  keys[i] = ss_new (s, 64, 1, NULL);
+	  ss_vec_set (v, keys[i], ss_from_int (i));
+	}
+      EXPECT (ss_profile_trie (ss_vec_finish (v), &trie));
+      EXPECT (trie.n_entries == n_keys);
+      EXPECT (trie.n_search_nodes > 1 && trie.n_dispatch_nodes > 0);
+
+      ss_val index = ss_new (s, 0, 3,
+			     ss_new (s, SS_WEAK_TAG, 2, keys[0], keys[1]),
+			     ss_new (s, SS_WEAK_TAG, 2, keys[2], NULL),
+			     ss_new (s, SS_WEAK_TAG, 1, keys[3]));
+      EXPECT (ss_profile_trie (index, &trie));
+      EXPECT (trie.n_entries == 4);
+      EXPECT (trie.n_search_nodes == 3 && trie.n_dispatch_nodes == 1);
+      EXPECT (trie.fanout[3] == 1 && trie.collisions[1] == 2);
+      EXPECT (!ss_profile_trie (ss_new (s, 0, 2, index, keys[0]), &trie));
+    }
+}
+
+static bool
+same_contents (const char *a, const char *b)
+{
+  FILE *fa = fopen (a, "r"), *fb = fopen (b, "r");
+  bool same = fa && fb;
+
+  while (same)
+    {
+      int ca = getc (fa), cb = getc (fb);
+      if (ca != cb)
+	same = false;
+      else if (ca == EOF)
+	break;
+    }
+  if (fa)
+    fclose (fa);
+  if (fb)
+    fclose (fb);
+  return same;
+}
+
+DEFTEST (store_gc_parallel_rehash)
+{
+  dyn_block
+    {
+      const int n = 70000;
+      dyn_val names[3] = { testdst ("store1.db"), testdst ("store4.db"),
+			   testdst ("store-insert.db") };
+
+      /* Big enough to be rebuilt in parallel, together with eight
+	 independent dictionaries that are the values of a small one,
+	 and one of which is also referenced from the root.  The result
+	 must be the same with any number of threads, and the same as
+	 when inserting the entries one by one.
+       */
+      for (int k = 0; k < 3; k++)
+	dyn_block
+	  {
+	    ss_gc_set_threads (k == 1? 4 : 1);
+	    ss_gc_set_debug (k == 2? SS_GC_DEBUG_INSERT : 0);
+	    dyn_val s = ss_open (names[k], SS_TRUNC);
+	    ss_tab *t = ss_tab_init (s, NULL);
+	    ss_dict *d = ss_dict_init (s, NULL, SS_DICT_STRONG);
+	    for (int i = 0; i < n; i++)
+	      {
+		const char *str = dyn_to_string (dyn_format ("key-%d", i));
+		ss_val key = ss_tab_intern_blob (t, strlen (str), (void *)str);
+		ss_dict_set (d, key, ss_from_int (i));
+	      }
+	    ss_dict *outer = ss_dict_init (s, NULL, SS_DICT_STRONG);
+	    ss_val inner[8];
+	    for (int j = 0; j < 8; j++)
+	      {
+		ss_dict *di = ss_dict_init (s, NULL, SS_DICT_STRONG);
+		for (int i = 0; i < 3000; i++)
+		  {
+		    const char *str =
+		      dyn_to_string (dyn_format ("key-%d", j*3000 + i));
+		    ss_val key = ss_tab_intern_blob (t, strlen (str),
+						     (void *)str);
+		    ss_dict_set (di, key, ss_from_int (i + j));
+		  }
+		inner[j] = ss_dict_finish (di);
+		const char *str = dyn_to_string (dyn_format ("outer-%d", j));
+		ss_dict_set (outer, ss_tab_intern_blob (t, strlen (str),
+							(void *)str),
+			     inner[j]);
+	      }
+	    ss_set_root (s, ss_new (s, 0, 4, ss_tab_finish (t),
+				    ss_dict_finish (d), ss_dict_finish (outer),
+				    inner[3]));
+	    s = ss_gc (s);
+
+	    ss_val r = ss_get_root (s);
+	    t = ss_tab_init (s, ss_ref (r, 0));
+	    d = ss_dict_init (s, ss_ref (r, 1), SS_DICT_STRONG);
+	    int count = 0;
+	    dyn_foreach_iter (e, ss_dict_entries, d)
+	      count++;
+	    EXPECT (count == n);
+	    for (int i = 0; i < n; i += 97)
+	      {
+		const char *str = dyn_to_string (dyn_format ("key-%d", i));
+		ss_val key = ss_tab_intern_soft (t, strlen (str), (void *)str);
+		EXPECT (key && ss_to_int (ss_dict_get (d, key)) == i);
+	      }
+	    outer = ss_dict_init (s, ss_ref (r, 2), SS_DICT_STRONG);
+	    for (int j = 0; j < 8; j++)
+	      {
+		const char *str = dyn_to_string (dyn_format ("outer-%d", j));
+		ss_val di = ss_dict_get (outer, ss_tab_intern_soft (t, strlen (str),
+								    (void *)str));
+		EXPECT (di && (j != 3 || di == ss_ref (r, 3)));
+		str = dyn_to_string (dyn_format ("key-%d", j*3000 + 17));
+		ss_val key = ss_tab_intern_soft (t, strlen (str), (void *)str);
+		ss_dict *dj = ss_dict_init (s, di, SS_DICT_STRONG);
+		EXPECT (key && ss_to_int (ss_dict_get (dj, key)) == 17 + j);
+		ss_dict_abort (dj);
+	      }
+	    ss_tab_abort (t);
+	    ss_dict_abort (d);
+	    ss_dict_abort (outer);
+	  }
+      ss_gc_set_threads (0);
+      ss_gc_set_debug (0);
+
+      EXPECT (same_contents (names[0], names[1]));
+      EXPECT (same_contents (names[0], names[2]));
+    }
+}
+
+DEFTEST (store_dict_foreach)
+{
+  dyn_block
+    {
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      ss_tab *t = ss_tab_init (s, NULL);
+      ss_dict *d = ss_dict_init (s, NULL, SS_DICT_WEAK_SETS);
+      
+      int count = 0;
+      dyn_foreach_iter (u, contiguous_usa)
+	{
+	  ss_val a = ss_tab_intern_blob (t, strlen(u.a), (void *)u.a);
+	  ss_val b = ss_tab_intern_blob (t, strlen(u.b), (void *)u.b);
+	  ss_dict_add (d, a, b);
+	  count++;
+	}
+
+      int count2 = 0;
+      dyn_foreach_iter (kv, ss_dict_entries, d)
+	{
+	  count2 += ss_len (kv.val);
+	}
+      EXPECT (count == count2);
+
+      int count3 = 0;
+      dyn_foreach_iter (km, ss_dict_entry_members, d)
+	{
+	  count3++;
+	}
+      EXPECT (count == count3);
+    }
+}
+
+DEFTEST (store_batch)
+{
+  dyn_block
+    {
+      dyn_val s = ss_open (testdst ("store.db"), SS_TRUNC);
+
+      const int n = 256;
+      char words[n][6];
+      int n_words = 0;
+      dyn_foreach (w, sgb_words)
+	if (n_words < n)
+	  {
+	    strncpy (words[n_words], w, 5);
+	    words[n_words++][5] = '\0';
+	  }
+
+      /* Every word twice in one batch gives the same blob twice.
+       */
+      ss_tab *t = ss_tab_init (s, NULL);
+      ss_tab_intern_op tops[2*n];
+      for (int i = 0; i < 2*n; i++)
+	{
+	  tops[i].len = strlen (words[i % n]);
+	  tops[i].blob = (void *)words[i % n];
+	  tops[i].compressed = false;
+	}
+      ss_tab_intern_batch (t, 2*n, tops);
+      for (int i = 0; i < n; i++)
+	{
+	  EXPECT (tops[i].val == tops[i+n].val);
+	  EXPECT (ss_equal_blob (tops[i].val, tops[i].len, tops[i].blob));
+	  EXPECT (ss_tab_intern_soft (t, tops[i].len, tops[i].blob)
+		  == tops[i].val);
+	}
+
+      /* A batch of dictionary operations has the same effect as
+	 applying them one after the other.
+       */
+      ss_dict *d1 = ss_dict_init (s, NULL, SS_DICT_STRONG);
+      ss_dict *d2 = ss_dict_init (s, NULL, SS_DICT_STRONG);
+      ss_dict_op dops[4*n];
+      int n_ops = 0;
+      void op (int code, ss_val key, int val)
+      {
+	dops[n_ops].op = code;
+	dops[n_ops].key = key;
+	dops[n_ops].val = ss_from_int (val);
+	n_ops++;
+      }
+
+      for (int i = 0; i < n; i++)
+	{
+	  ss_val key = tops[i].val;
+	  if (i % 5 == 0)
+	    {
+	      op (SS_DICT_OP_SET, key, i);
+	      op (SS_DICT_OP_SET, key, -i);
+	    }
+	  else
+	    {
+	      op (SS_DICT_OP_ADD, key, i);
+	      op (SS_DICT_OP_ADD, key, i+1);
+	      if (i % 3 == 0)
+		op (SS_DICT_OP_DEL, key, i);
+	    }
+	}
+      for (int i = 0; i < n_ops; i++)
+	{
+	  if (dops[i].op == SS_DICT_OP_SET)
+	    ss_dict_set (d1, dops[i].key, dops[i].val);
+	  else if (dops[i].op == SS_DICT_OP_ADD)
+	    ss_dict_add (d1, dops[i].key, dops[i].val);
+	  else
+	    ss_dict_del (d1, dops[i].key, dops[i].val);
+	}
+      for (int i = 0; i < n_ops; i += 100)
+	ss_dict_apply_batch (d2, n_ops - i < 100? n_ops - i : 100, dops + i);
+
+      ss_set_root (s, ss_new (s, 0, 3,
+			      ss_tab_finish (t),
+			      ss_dict_finish (d1),
+			      ss_dict_finish (d2)));
+      s = ss_gc (s);
+      ss_val r = ss_get_root (s);
+      t = ss_tab_init (s, ss_ref (r, 0));
+      d1 = ss_dict_init (s, ss_ref (r, 1), SS_DICT_STRONG);
+      d2 = ss_dict_init (s, ss_ref (r, 2), SS_DICT_STRONG);
+
+      for (int i = 0; i < n; i++)
+	{
+	  ss_val key = ss_tab_intern_soft (t, strlen (words[i]),
+					   (void *)words[i]);
+	  ss_val v1 = ss_dict_get (d1, key), v2 = ss_dict_get (d2, key);
+	  if (i % 5 == 0)
+	    EXPECT (v1 == ss_from_int (-i) && v2 == v1);
+	  else
+	    {
+	      EXPECT (ss_set_len (v1) == (i % 3 == 0? 1 : 2));
+	      EXPECT (ss_set_len (v2) == ss_set_len (v1));
+	      for (int j = 0; j < ss_len (v1); j++)
+		EXPECT (ss_ref (v1, j) == ss_ref (v2, j));
+	    }
+	}
+
+      ss_tab_abort (t);
+      ss_dict_abort (d1);
+      ss_dict_abort (d2);
+    }
+}
+
+DEFTEST (parse_comma_fields)
+{
+  dyn_block
+    {
+      dyn_val fields[4];
+      int i = 0;
+      dyn_input in = dyn_open_string ("  foo   ,bar,,x y\tz\n z\ny  ", -1);
+      dyn_foreach_iter (f, dpm_parse_comma_fields, in)
+	{
+	  EXPECT (i < 4);
+	  fields[i++] = dyn_from_stringn (f.field, f.len);
+	}
+
+      EXPECT (i == 4);
+      EXPECT (dyn_eq (fields[0], "foo"));
+      EXPECT (dyn_eq (fields[1], "bar"));
+      EXPECT (dyn_eq (fields[2], ""));
+      EXPECT (dyn_eq (fields[3], "x y\tz\n z\ny"));
+    }
+}
+
+DEFTEST (parse_relations)
+{
+  dyn_block
+    {
+      dyn_input in = dyn_open_string ("foo | bar (>= 1.0)", -1);
+      int i = 0;
+      dyn_foreach_iter (r, dpm_parse_relation_alternatives, in)
 	{
 	  EXPECT (i < 2);
 	  switch (i)
@@ -1578,6 +3313,189 @@ DEFTEST (db_remove)
     }
 }
 
+DEFTEST (db_transactions)
+{
+  dyn_block
+    {
+      dyn_let (dpm_database_name, testdst ("test.db"));
+      dpm_db_open ();
+
+      dpm_origin o = dpm_db_origin_find ("o");
+      dpm_db_origin_update (o, I(L(Package: foo)
+				 L(Version: 1.0)));
+      dpm_db_checkpoint ();
+
+      dpm_package foo = dpm_db_package_find ("foo");
+
+      int flags_now ()
+      {
+	return dpm_stat_flags (dpm_db_status (dpm_db_package_find ("foo")));
+      }
+
+      int flags_on_disk ()
+      {
+	int flags;
+	dyn_block
+	  {
+	    dpm_db_open_read_only ();
+	    flags = flags_now ();
+	  }
+	return flags;
+      }
+
+      // Nothing is committed before the outermost dpm_db_commit.
+
+      dpm_db_begin ();
+      dpm_db_set_status_flags (foo, DPM_STAT_MANUAL);
+      dpm_db_begin ();
+      dpm_db_checkpoint ();
+      dpm_db_commit ();
+      EXPECT (flags_on_disk () == 0);
+      dpm_db_commit ();
+      EXPECT (flags_on_disk () == DPM_STAT_MANUAL);
+
+      // Rolling back.
+
+      dpm_db_begin ();
+      dpm_db_set_status_flags (foo, 0);
+      EXPECT (flags_now () == 0);
+      dpm_db_rollback ();
+      EXPECT (flags_now () == DPM_STAT_MANUAL);
+
+      dpm_db_savepoint sp = dpm_db_save ();
+      dpm_db_set_status_flags (foo, 0);
+      dpm_db_rollback_to (sp);
+      EXPECT (flags_now () == DPM_STAT_MANUAL);
+
+      // Relaxed commits are only visible after syncing.
+
+      dpm_db_set_relaxed (true);
+      dpm_db_set_status_flags (foo, 0);
+      dpm_db_checkpoint ();
+      EXPECT (flags_on_disk () == DPM_STAT_MANUAL);
+      dpm_db_sync ();
+      EXPECT (flags_on_disk () == 0);
+
+      dpm_db_set_status_flags (foo, DPM_STAT_MANUAL);
+      dpm_db_checkpoint ();
+      dpm_db_done ();
+      EXPECT (flags_on_disk () == DPM_STAT_MANUAL);
+    }
+}
+
+DEFTEST (db_names)
+{
+  dyn_block
+    {
+      dyn_let (dpm_database_name, testdst ("test.db"));
+      dpm_db_open ();
+
+      static char meta[50000];
+      int meta_len;
+
+      meta_len = 0;
+      for (int i = 0; i < 1000; i += 2)
+	meta_len += sprintf (meta + meta_len,
+			     "Package: p%04d\nVersion: 1.0\n\n", i);
+      dpm_origin o = dpm_db_origin_find ("o");
+      dpm_db_origin_update (o, I(meta));
+      dpm_db_checkpoint ();
+
+      // Filling the gaps in between splits the leaves.
+
+      meta_len = 0;
+      for (int i = 1; i < 1000; i += 2)
+	meta_len += sprintf (meta + meta_len,
+			     "Package: p%04d\nVersion: 1.0\n\n", i);
+      dpm_origin o2 = dpm_db_origin_find ("o2");
+      dpm_db_origin_update (o2, I(meta));
+      dpm_db_checkpoint ();
+      dpm_db_done ();
+
+      int count_prefix (const char *prefix)
+      {
+	int n = 0;
+	ss_val last = NULL;
+	dyn_foreach (p, dpm_db_packages_prefix, prefix)
+	  {
+	    ss_val name = dpm_pkg_name (p);
+	    EXPECT (last == NULL || memcmp (ss_blob_start (last),
+					    ss_blob_start (name), 5) < 0);
+	    last = name;
+	    n++;
+	  }
+	return n;
+      }
+
+      dpm_db_open_read_only ();
+      EXPECT (count_prefix (NULL) == 1000);
+      EXPECT (count_prefix ("p") == 1000);
+      EXPECT (count_prefix ("p05") == 100);
+      EXPECT (count_prefix ("p0999") == 1);
+      EXPECT (count_prefix ("p1") == 0);
+      EXPECT (count_prefix ("a") == 0);
+      EXPECT (count_prefix ("q") == 0);
+      dpm_db_done ();
+
+      // Packages that are collected disappear from the index.
+
+      dpm_db_open ();
+      o2 = dpm_db_origin_find ("o2");
+      dpm_db_origin_update (o2, I(L(Remove:)));
+      dpm_db_checkpoint ();
+      dpm_db_gc_and_done ();
+
+      dpm_db_open ();
+      EXPECT (count_prefix ("p") == 500);
+      o2 = dpm_db_origin_find ("o2");
+      dpm_db_origin_update (o2, I(L(Package: p0005)
+				  L(Version: 1.0)));
+      EXPECT (count_prefix ("p000") == 6);
+      dpm_db_done ();
+
+      // Databases from before the index get one when they are stored.
+      // Until then, read-only ones sort the packages for each
+      // iteration.
+
+      int root_len ()
+      {
+	dyn_val s = ss_open (dyn_get (dpm_database_name), SS_READ);
+	return ss_len (ss_get_root (s));
+      }
+
+      dyn_block
+	{
+	  dyn_val s = ss_open (dyn_get (dpm_database_name), SS_WRITE);
+	  ss_val r = ss_get_root (s);
+	  ss_val fields[9];
+	  for (int i = 0; i < 9; i++)
+	    fields[i] = ss_ref (r, i);
+	  ss_set_root (s, ss_newv (s, 0, 9, fields));
+	}
+
+      dpm_db_open_read_only ();
+      EXPECT (count_prefix (NULL) == 500);
+      EXPECT (count_prefix ("p000") == 5);
+      EXPECT (count_prefix ("q") == 0);
+      dpm_db_done ();
+      EXPECT (root_len () == 9);
+
+      dpm_db_open ();
+      o2 = dpm_db_origin_find ("o2");
+      dpm_db_origin_update (o2, I(L(Package: p0005)
+				  L(Version: 1.0)));
+      EXPECT (count_prefix ("p000") == 6);
+      EXPECT (count_prefix (NULL) == 501);
+      dpm_db_checkpoint ();
+      dpm_db_done ();
+      EXPECT (root_len () == 10);
+
+      dpm_db_open_read_only ();
+      EXPECT (count_prefix (NULL) == 501);
+      dpm_db_done ();
+    }
+}
+
 void
 setup_db (const char *origin, ...)
 {
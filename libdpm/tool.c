@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <fnmatch.h>
 
 #include "dpm.h"
 
@@ -12,7 +13,7 @@ void
 usage ()
 {
   fprintf (stderr, "Usage: dpm-tool [OPTIONS] update ORIGIN FILE\n");
-  fprintf (stderr, "       dpm-tool [OPTIONS] show [PACKAGE [VERSION]]\n");
+  fprintf (stderr, "       dpm-tool [OPTIONS] show [PACKAGE [VERSION] | PATTERN]\n");
   fprintf (stderr, "       dpm-tool [OPTIONS] search STRING\n");
   fprintf (stderr, "       dpm-tool [OPTIONS] tags EXPRESSION\n");
   fprintf (stderr, "       dpm-tool [OPTIONS] relations PACKAGE\n");
@@ -20,6 +21,7 @@ usage ()
   fprintf (stderr, "       dpm-tool [OPTIONS] install PACKAGE\n");
   fprintf (stderr, "       dpm-tool [OPTIONS] remove PACKAGE\n");
   fprintf (stderr, "       dpm-tool [OPTIONS] stats\n");
+  fprintf (stderr, "       dpm-tool [OPTIONS] store-profile\n");
   fprintf (stderr, "       dpm-tool [OPTIONS] dump\n");
   fprintf (stderr, "       dpm-tool [OPTIONS] gc\n");
   fprintf (stderr, "       dpm-tool [OPTIONS] force-install PACKAGE\n");
@@ -114,13 +116,29 @@ show_versions (dpm_package pkg)
 void
 show (const char *package, const char *version)
 {
-  dpm_db_open ();
+  dpm_db_open_read_only ();
 
   if (package == NULL)
     {
-      dyn_foreach (p, dpm_db_packages)
+      dyn_foreach (p, dpm_db_packages_prefix, NULL)
         dyn_print ("%r\n", dpm_pkg_name (p));
     }
+  else if (strpbrk (package, "*?["))
+    {
+      /* Only the packages that start with the part before the first
+	 wildcard need to be looked at.
+       */
+      char *prefix = strndup (package, strcspn (package, "*?["));
+      dyn_foreach (p, dpm_db_packages_prefix, prefix)
+	{
+	  ss_val n = dpm_pkg_name (p);
+	  char *name = strndup (ss_blob_start (n), ss_len (n));
+	  if (fnmatch (package, name, 0) == 0)
+	    dyn_print ("%s\n", name);
+	  free (name);
+	}
+      free (prefix);
+    }
   else
     {
       dpm_package pkg = dpm_db_package_find (package);
@@ -155,11 +173,19 @@ show (const char *package, const char *version)
 void
 stats ()
 {
-  dpm_db_open ();
+  dpm_db_open_read_only ();
   dpm_db_stats ();
   dpm_db_done ();
 }
 
+void
+store_profile ()
+{
+  dpm_db_open_read_only ();
+  dpm_db_profile ();
+  dpm_db_done ();
+}
+
 const char *relname[] = {
   [DPM_EQ] = "=",
   [DPM_LESS] = "<<",
@@ -293,10 +319,10 @@ list_ss_versions (ss_val versions, dpm_package rev)
 {
   if (versions)
     {
-      int n = ss_len(versions);
-      dpm_version v[n];
-      for (int i = 0; i < n; i++)
-	v[i] = ss_ref (versions, i);
+      int n = 0;
+      dpm_version v[ss_set_len (versions)];
+      dyn_foreach (ver, ss_elts, versions)
+	v[n++] = ver;
       list_versions (v, n, rev);
     }
 }
@@ -306,7 +332,7 @@ search (const char *pattern)
 {
   int pattern_len = strlen (pattern);
 
-  dpm_db_open ();
+  dpm_db_open_read_only ();
 
   bool seen[dpm_db_package_id_limit()];
   memset (seen, 0, sizeof(seen));
@@ -340,7 +366,7 @@ tags (const char *exp)
 {
   if (exp)
     {
-      dpm_db_open ();
+      dpm_db_open_read_only ();
       list_ss_versions (dpm_db_query_tag (exp), NULL);
       dpm_db_done ();
     }
@@ -351,7 +377,7 @@ list_reverse_relations (const char *package)
 {
   if (package)
     {
-      dpm_db_open ();
+      dpm_db_open_read_only ();
 
       dpm_package pkg = dpm_db_package_find (package);
       ss_val versions = dpm_db_reverse_relations (pkg);
@@ -365,7 +391,7 @@ list_provides (const char *package)
 {
   if (package)
     {
-      dpm_db_open ();
+      dpm_db_open_read_only ();
       dpm_package pkg = dpm_db_package_find (package);
       dyn_foreach (ver, ss_elts, dpm_db_provides (pkg))
 	dyn_print ("%r %r\n",
@@ -568,7 +594,7 @@ cmd_show_broken ()
 void
 status (char **packages)
 {
-  dpm_db_open ();
+  dpm_db_open_read_only ();
 
   while (*packages)
     {
@@ -727,6 +753,8 @@ main (int argc, char **argv)
     show (argv[2], argv[3]);
   else if (strcmp (argv[1], "stats") == 0)
     stats ();
+  else if (strcmp (argv[1], "store-profile") == 0)
+    store_profile ();
   else if (strcmp (argv[1], "search") == 0)
     search (argv[2]);
   else if (strcmp (argv[1], "tags") == 0)